@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "classifier.h"
+#include "region.h"
+#include "stree.h"
+#include "learned.h"
+
+// Measures classifier lookup latency over a synthetic rule set for each
+// engine (as `server -e`), once on regular pages and once with huge pages
+// (as `server -l`), so engines and the effect of TLB pressure on their
+// tables can be compared on a given machine. Every lookup is checked
+// against a scan of the rules. Most lookups fall inside some rule, often
+// inside several overlapping ones, so rule priority is checked as well.
+//
+// With -s it instead compares searches over sorted boundary arrays of 10k
+// to 10M keys: a plain binary search, the Eytzinger layout, and the S-tree
+// and learned index used by the stree and learned engines, with their
+// build times and sizes.
+
+#define DEFAULT_RULES 100000
+#define DEFAULT_LOOKUPS 10000
+#define WARMUP_LOOKUPS 1000
+#define SEARCH_LOOKUPS 1000000
+
+typedef struct {
+    uint32_t ip;
+    int port;
+} Lookup;
+
+uint64_t bench_state = 88172645463325252ULL;
+
+uint64_t next_random() {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return bench_state;
+}
+long elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+// Rules are /24 to /16 blocks with port ranges of up to 1024, so most
+// lookups scan a large part of the table before matching or missing. One
+// in four instead lies within an earlier rule's block, with ports
+// overlapping its range, so that lookups there match both.
+void build_rules(Classifier *classifier, int count, uint64_t seed) {
+    bench_state = seed;
+    for (int i = 0; i < count; i++) {
+        ClassifierRule rule;
+        uint32_t size = 1U << (8 + next_random() % 9);
+        rule.ip_start = (uint32_t)next_random() & ~(size - 1);
+        rule.port_start = next_random() % 65536;
+        if (i > 0 && next_random() % 4 == 0) {
+            const ClassifierRule *outer = &classifier->rules[next_random() % i];
+            uint64_t outer_size = (uint64_t)outer->ip_end - outer->ip_start + 1;
+            while (size > outer_size / 2 && size > 1) size /= 2;
+            rule.ip_start = outer->ip_start + ((uint32_t)next_random() & (outer_size - 1) & ~(size - 1));
+            rule.port_start = outer->port_start + next_random() % (outer->port_end - outer->port_start + 1);
+        }
+        rule.ip_end = rule.ip_start + size - 1;
+        rule.port_end = rule.port_start + next_random() % 1024;
+        if (rule.port_end < rule.port_start) rule.port_end = 65535;
+        classifier_append(classifier, &rule);
+    }
+}
+// Seven in eight lookups pick a rule and a point inside it; the rest are
+// anywhere
+void pick_lookups(const Classifier *rules, Lookup *lookups, int count) {
+    bench_state = 2;
+    for (int i = 0; i < count; i++) {
+        lookups[i].ip = (uint32_t)next_random();
+        lookups[i].port = next_random() % 65536;
+        if (next_random() % 8 == 0) continue;
+        const ClassifierRule *rule = &rules->rules[next_random() % rules->count];
+        lookups[i].ip = rule->ip_start + next_random() % ((uint64_t)rule->ip_end - rule->ip_start + 1);
+        lookups[i].port = rule->port_start + next_random() % (rule->port_end - rule->port_start + 1);
+    }
+}
+// Returns false if any lookup disagreed with expected
+bool run(int engine, bool huge, int rule_count, const Lookup *lookups, const int *expected,
+         int lookup_count) {
+    region_use_huge_pages(huge);
+    classifier_use_engine(engine);
+    Classifier *classifier = classifier_create(-1);
+    build_rules(classifier, rule_count, 1);
+    struct timespec built, start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    classifier_install(classifier, classifier_build(classifier));
+    clock_gettime(CLOCK_MONOTONIC, &built);
+    long build_ms = elapsed_ns(&start, &built) / 1000000;
+    const char *pages = huge ? "huge" : "regular";
+    if (classifier->declined > 0) {
+        printf("%-10s %-8s %10ld  declined to index the rules\n", classifier_engine_name(engine),
+               pages, build_ms);
+        classifier_destroy(classifier);
+        return true;
+    }
+    long *latencies = malloc(lookup_count * sizeof(long));
+    volatile int sink = 0;
+    for (int i = 0; i < WARMUP_LOOKUPS; i++) {
+        sink += classifier_match(classifier, lookups[i % lookup_count].ip, lookups[i % lookup_count].port);
+    }
+    int matched = 0, wrong = 0;
+    long total = 0;
+    for (int i = 0; i < lookup_count; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int index = classifier_match(classifier, lookups[i].ip, lookups[i].port);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies[i] = elapsed_ns(&start, &end);
+        total += latencies[i];
+        if (index >= 0) matched++;
+        if (index != expected[i]) wrong++;
+    }
+    (void)sink;
+    qsort(latencies, lookup_count, sizeof(long), compare_longs);
+    RegionStats stats;
+    region_stats(&stats);
+    printf("%-10s %-8s %10ld %10ld %10ld %10ld %10ld %9d %10zu %10zu\n",
+           classifier_engine_name(engine), pages, build_ms, total / lookup_count,
+           latencies[lookup_count / 2], latencies[lookup_count * 99 / 100],
+           latencies[lookup_count - 1], matched, stats.mapped / 1024,
+           (stats.hugetlb + stats.transparent) / 1024);
+    if (wrong > 0) {
+        fprintf(stderr, "%s: %d lookups differ from a scan\n", classifier_engine_name(engine),
+                wrong);
+    }
+    free(latencies);
+    classifier_destroy(classifier);
+    return wrong == 0;
+}
+// Number of keys less than or equal to key
+size_t binary_rank(const uint32_t *keys, size_t count, uint32_t key) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (keys[middle] <= key) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+// Eytzinger layout: a binary search tree in BFS order from slot 1, with
+// the children of k at 2k and 2k + 1, and the sorted position of each slot
+void eytzinger_fill(const uint32_t *keys, size_t count, uint32_t *tree, uint32_t *ranks,
+                    size_t k, size_t *next) {
+    if (k > count) return;
+    eytzinger_fill(keys, count, tree, ranks, 2 * k, next);
+    tree[k] = keys[*next];
+    ranks[k] = (*next)++;
+    eytzinger_fill(keys, count, tree, ranks, 2 * k + 1, next);
+}
+size_t eytzinger_rank(const uint32_t *tree, const uint32_t *ranks, size_t count, uint32_t key) {
+    size_t k = 1;
+    while (k <= count) {
+        __builtin_prefetch(tree + k * 16);
+        k = 2 * k + (tree[k] <= key);
+    }
+    // Undo the right turns after the last left one, which was at the
+    // first key greater than key
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? count : ranks[k];
+}
+void run_search(size_t count) {
+    uint32_t *keys = malloc(count * sizeof(uint32_t));
+    uint64_t gap = (1ULL << 32) / count - 1;
+    keys[0] = next_random() % gap;
+    for (size_t i = 1; i < count; i++) keys[i] = keys[i - 1] + 1 + next_random() % gap;
+    uint32_t *tree = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *ranks = malloc((count + 1) * sizeof(uint32_t));
+    size_t next = 0;
+    eytzinger_fill(keys, count, tree, ranks, 1, &next);
+    struct timespec start, end;
+    long build_ms[2];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    StaticTree *stree = stree_build(keys, count, -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    build_ms[0] = elapsed_ns(&start, &end) / 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LearnedIndex *model = learned_build(keys, count, -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    build_ms[1] = elapsed_ns(&start, &end) / 1000000;
+    uint32_t *queries = malloc(SEARCH_LOOKUPS * sizeof(uint32_t));
+    for (int i = 0; i < SEARCH_LOOKUPS; i++) queries[i] = next_random();
+    // Timed over the whole batch: a lookup is too short to time alone
+    size_t sums[4] = {0, 0, 0, 0};
+    long ns[4];
+    for (int method = 0; method < 4; method++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < SEARCH_LOOKUPS; i++) {
+            uint32_t key = queries[i];
+            sums[method] += method == 0 ? binary_rank(keys, count, key) :
+                            method == 1 ? eytzinger_rank(tree, ranks, count, key) :
+                            method == 2 ? stree_rank(stree, key) : learned_rank(model, key);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[method] = elapsed_ns(&start, &end);
+    }
+    printf("%9zu %9.1f %9.1f %9.1f %9.1f %9ld %9ld %9zu %9zu\n", count,
+           (double)ns[0] / SEARCH_LOOKUPS, (double)ns[1] / SEARCH_LOOKUPS,
+           (double)ns[2] / SEARCH_LOOKUPS, (double)ns[3] / SEARCH_LOOKUPS, build_ms[0],
+           build_ms[1], stree->size / 1024, model->size / 1024);
+    if (sums[1] != sums[0] || sums[2] != sums[0] || sums[3] != sums[0]) {
+        fprintf(stderr, "Searches disagree at %zu keys\n", count);
+        exit(1);
+    }
+    learned_free(model);
+    stree_free(stree);
+    free(queries);
+    free(ranks);
+    free(tree);
+    free(keys);
+}
+
+int main(int argc, char *argv[]) {
+    int rule_count = DEFAULT_RULES;
+    int lookup_count = DEFAULT_LOOKUPS;
+    int only_engine = -1;
+    bool search = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:l:e:s")) != -1) {
+        switch (opt) {
+        case 'r':
+            rule_count = atoi(optarg);
+            break;
+        case 'l':
+            lookup_count = atoi(optarg);
+            break;
+        case 'e':
+            only_engine = classifier_engine_named(optarg);
+            if (only_engine < 0) {
+                fprintf(stderr, "Unknown classifier engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            search = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rules] [-l lookups] [-e engine] | %s -s\n", argv[0],
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (rule_count <= 0 || lookup_count <= 0) {
+        fprintf(stderr, "Rule and lookup counts must be positive\n");
+        return 1;
+    }
+    if (search) {
+        printf("%d lookups per size\n", SEARCH_LOOKUPS);
+        printf("%9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "", "binary", "eytz", "stree",
+               "learned", "stree", "learned", "stree", "learned");
+        printf("%9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "keys", "ns", "ns", "ns", "ns",
+               "build ms", "build ms", "KB", "KB");
+        for (size_t count = 10000; count <= 10000000; count *= 10) run_search(count);
+        return 0;
+    }
+    // Answers from a plain scan, to check the engines against
+    Lookup *lookups = malloc(lookup_count * sizeof(Lookup));
+    int *expected = malloc(lookup_count * sizeof(int));
+    Classifier *reference = classifier_create(-1);
+    build_rules(reference, rule_count, 1);
+    pick_lookups(reference, lookups, lookup_count);
+    for (int i = 0; i < lookup_count; i++) {
+        expected[i] = classifier_match(reference, lookups[i].ip, lookups[i].port);
+    }
+    classifier_destroy(reference);
+    printf("%d rules, %d lookups\n", rule_count, lookup_count);
+    printf("%-10s %-8s %10s %10s %10s %10s %10s %9s %10s %10s\n", "engine", "pages", "build ms",
+           "mean ns", "p50 ns", "p99 ns", "max ns", "matched", "mapped KB", "huge KB");
+    bool ok = true;
+    for (int engine = 0; engine < CLASSIFIER_ENGINES; engine++) {
+        if (only_engine >= 0 && engine != only_engine) continue;
+        ok = run(engine, false, rule_count, lookups, expected, lookup_count) && ok;
+        ok = run(engine, true, rule_count, lookups, expected, lookup_count) && ok;
+    }
+    free(expected);
+    free(lookups);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "classifier.h"
+#include "region.h"
+#include "rfc.h"
+#include "intervals.h"
+#include "rangetree.h"
+#include "native.h"
+#include "tcam.h"
+
+#define CLASSIFIER_INITIAL_CAPACITY 1024
+
+typedef struct {
+    const char *name;
+    void *(*build)(const ClassifierRule *rules, int count, int node);
+    int (*match)(const void *index, uint32_t ip, int port);
+    void (*free)(void *index);
+    size_t (*size)(const void *index);
+    void *(*share)(void *index);  // NULL if indexes cannot be shared
+    bool background;
+} ClassifierEngine;
+
+void *build_rfc(const ClassifierRule *rules, int count, int node) {
+    return rfc_build(rules, count, node);
+}
+int match_rfc(const void *index, uint32_t ip, int port) {
+    return rfc_match(index, ip, port);
+}
+void free_rfc(void *index) {
+    rfc_free(index);
+}
+size_t size_rfc(const void *index) {
+    return ((const RfcTable *)index)->size;
+}
+void *build_stree(const ClassifierRule *rules, int count, int node) {
+    return intervals_build(rules, count, node, INTERVALS_STREE);
+}
+void *build_learned(const ClassifierRule *rules, int count, int node) {
+    return intervals_build(rules, count, node, INTERVALS_LEARNED);
+}
+int match_intervals(const void *index, uint32_t ip, int port) {
+    return intervals_match(index, ip, port);
+}
+void free_intervals(void *index) {
+    intervals_free(index);
+}
+size_t size_intervals(const void *index) {
+    return ((const IntervalIndex *)index)->size;
+}
+void *build_rangetree(const ClassifierRule *rules, int count, int node) {
+    return rangetree_build(rules, count, node);
+}
+int match_rangetree(const void *index, uint32_t ip, int port) {
+    return rangetree_match(index, ip, port);
+}
+void free_rangetree(void *index) {
+    rangetree_free(index);
+}
+size_t size_rangetree(const void *index) {
+    return ((const RangeTree *)index)->size;
+}
+// Generated code does not depend on the node it runs on
+void *build_native(const ClassifierRule *rules, int count, int node) {
+    return native_build(rules, count);
+}
+int match_native(const void *index, uint32_t ip, int port) {
+    return native_match(index, ip, port);
+}
+void free_native(void *index) {
+    native_free(index);
+}
+size_t size_native(const void *index) {
+    return ((const NativeCode *)index)->size;
+}
+void *share_native(void *index) {
+    return native_retain(index);
+}
+void *build_tcam(const ClassifierRule *rules, int count, int node) {
+    return tcam_build(rules, count, node);
+}
+int match_tcam(const void *index, uint32_t ip, int port) {
+    return tcam_match(index, ip, port);
+}
+void free_tcam(void *index) {
+    tcam_free(index);
+}
+size_t size_tcam(const void *index) {
+    return ((const TernaryTable *)index)->size;
+}
+
+// The linear engine has no index: its lookups are the scan
+ClassifierEngine engines[CLASSIFIER_ENGINES] = {
+    [CLASSIFIER_LINEAR] = { "linear", NULL, NULL, NULL, NULL },
+    [CLASSIFIER_RFC] = { "rfc", build_rfc, match_rfc, free_rfc, size_rfc, NULL, true },
+    [CLASSIFIER_STREE] = { "stree", build_stree, match_intervals, free_intervals, size_intervals },
+    [CLASSIFIER_LEARNED] = { "learned", build_learned, match_intervals, free_intervals,
+                             size_intervals },
+    [CLASSIFIER_RANGETREE] = { "rangetree", build_rangetree, match_rangetree, free_rangetree,
+                               size_rangetree },
+    [CLASSIFIER_NATIVE] = { "native", build_native, match_native, free_native, size_native,
+                            share_native, true },
+    [CLASSIFIER_TCAM] = { "tcam", build_tcam, match_tcam, free_tcam, size_tcam },
+};
+int default_engine = CLASSIFIER_LINEAR;
+
+bool decode_ip(const char *ip, uint32_t *result) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1) return false;
+    *result = ntohl(addr.s_addr);
+    return true;
+}
+// Same semantics as matching on the strings: a single address or port is a
+// range of one, and an inverted range matches nothing
+bool classifier_decode(const char *ip_range, const char *port_range, ClassifierRule *rule) {
+    char ip_start[64], ip_end[64];
+    uint32_t start, end;
+    if (strchr(ip_range, '-') == NULL) {
+        if (!decode_ip(ip_range, &start)) return false;
+        end = start;
+    } else if (sscanf(ip_range, "%63[^-]-%63s", ip_start, ip_end) != 2 ||
+               !decode_ip(ip_start, &start) || !decode_ip(ip_end, &end)) {
+        return false;
+    }
+    int port_start, port_end;
+    if (strchr(port_range, '-') == NULL) {
+        port_start = port_end = atoi(port_range);
+    } else if (sscanf(port_range, "%d-%d", &port_start, &port_end) != 2) {
+        return false;
+    }
+    rule->ip_start = start;
+    rule->ip_end = end;
+    rule->port_start = port_start;
+    rule->port_end = port_end;
+    return true;
+}
+// Tables are regions of their own rather than heap memory, so each sits on
+// pages placed on the requested node, huge pages when enabled
+void classifier_grow(Classifier *classifier, int capacity) {
+    size_t size = capacity * sizeof(ClassifierRule);
+    classifier->rules = region_realloc(classifier->rules, &size, classifier->node);
+    classifier->capacity = size / sizeof(ClassifierRule);
+}
+void classifier_drop_index(Classifier *classifier) {
+    if (classifier->index != NULL) engines[classifier->engine].free(classifier->index);
+    classifier->index = NULL;
+}
+Classifier *classifier_create(int node) {
+    Classifier *classifier = calloc(1, sizeof(Classifier));
+    classifier->node = node;
+    classifier->engine = default_engine;
+    classifier_grow(classifier, CLASSIFIER_INITIAL_CAPACITY);
+    return classifier;
+}
+void classifier_destroy(Classifier *classifier) {
+    classifier_drop_index(classifier);
+    region_free(classifier->rules);
+    free(classifier);
+}
+void classifier_append(Classifier *classifier, const ClassifierRule *rule) {
+    if (classifier->count == classifier->capacity) {
+        classifier_grow(classifier, classifier->capacity * 2);
+    }
+    classifier->rules[classifier->count++] = *rule;
+    classifier_drop_index(classifier);
+}
+void classifier_remove(Classifier *classifier, int index) {
+    memmove(&classifier->rules[index], &classifier->rules[index + 1],
+            (classifier->count - index - 1) * sizeof(ClassifierRule));
+    classifier->count--;
+    classifier_drop_index(classifier);
+}
+void classifier_clear(Classifier *classifier) {
+    classifier->count = 0;
+    classifier->declined = 0;
+    classifier_drop_index(classifier);
+}
+int classifier_match(const Classifier *classifier, uint32_t ip, int port) {
+    if (classifier->index != NULL) {
+        return engines[classifier->engine].match(classifier->index, ip, port);
+    }
+    for (int i = 0; i < classifier->count; i++) {
+        const ClassifierRule *rule = &classifier->rules[i];
+        if (ip >= rule->ip_start && ip <= rule->ip_end &&
+            port >= rule->port_start && port <= rule->port_end) {
+            return i;
+        }
+    }
+    return -1;
+}
+int classifier_engine_named(const char *name) {
+    for (int i = 0; i < CLASSIFIER_ENGINES; i++) {
+        if (strcmp(engines[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+const char *classifier_engine_name(int engine) {
+    return engines[engine].name;
+}
+void classifier_use_engine(int engine) {
+    default_engine = engine;
+}
+bool classifier_engine_background(int engine) {
+    return engines[engine].background;
+}
+bool classifier_engine_shares(int engine) {
+    return engines[engine].share != NULL;
+}
+bool classifier_stale(const Classifier *classifier) {
+    return engines[classifier->engine].build != NULL && classifier->index == NULL &&
+           (classifier->declined == 0 || classifier->count < classifier->declined);
+}
+void *classifier_build(const Classifier *classifier) {
+    const ClassifierEngine *engine = &engines[classifier->engine];
+    if (engine->build == NULL) return NULL;
+    return engine->build(classifier->rules, classifier->count, classifier->node);
+}
+void classifier_install(Classifier *classifier, void *index) {
+    classifier_drop_index(classifier);
+    classifier->index = index;
+    bool declined = index == NULL && engines[classifier->engine].build != NULL;
+    classifier->declined = declined ? classifier->count : 0;
+}
+bool classifier_same_rules(const Classifier *a, const Classifier *b) {
+    return a->count == b->count &&
+           memcmp(a->rules, b->rules, a->count * sizeof(ClassifierRule)) == 0;
+}
+void *classifier_share(const Classifier *classifier, void *index) {
+    if (index == NULL || engines[classifier->engine].share == NULL) return NULL;
+    return engines[classifier->engine].share(index);
+}
+void classifier_discard(const Classifier *classifier, void *index) {
+    if (index != NULL) engines[classifier->engine].free(index);
+}
+size_t classifier_index_size(const Classifier *classifier) {
+    if (classifier->index == NULL) return 0;
+    return engines[classifier->engine].size(classifier->index);
+}
@@ -0,0 +1,87 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only form of the rule set used to answer checks: rules decoded to
+// integer ranges, in rule order, so a lookup never parses strings. The
+// server keeps one per NUMA node in use and applies every rule change to
+// each of them under its lock.
+//
+// A classifier may also keep an index built by one of the engines below.
+// Any change drops the index, and lookups scan the rules until the owner
+// builds and installs a new one, so an engine only has to handle a fixed
+// rule set.
+
+#define CLASSIFIER_LINEAR 0
+#define CLASSIFIER_RFC 1
+#define CLASSIFIER_STREE 2
+#define CLASSIFIER_LEARNED 3
+#define CLASSIFIER_RANGETREE 4
+#define CLASSIFIER_NATIVE 5
+#define CLASSIFIER_TCAM 6
+#define CLASSIFIER_ENGINES 7
+
+typedef struct {
+    uint32_t ip_start;
+    uint32_t ip_end;
+    uint16_t port_start;
+    uint16_t port_end;
+} ClassifierRule;
+
+typedef struct {
+    ClassifierRule *rules;
+    int count;
+    int capacity;
+    int node;  // NUMA node the table is placed on, -1 for no placement
+    int engine;
+    void *index;  // built by engine for the current rules, NULL when stale
+    int declined;  // rule count the engine last declined to index, 0 if none
+} Classifier;
+
+// Decodes a validated "<ip>[-<ip>]" and "<port>[-<port>]" pair
+bool classifier_decode(const char *ip_range, const char *port_range, ClassifierRule *rule);
+
+Classifier *classifier_create(int node);
+void classifier_destroy(Classifier *classifier);
+void classifier_append(Classifier *classifier, const ClassifierRule *rule);
+void classifier_remove(Classifier *classifier, int index);
+void classifier_clear(Classifier *classifier);
+// Index of the first rule matching ip (host byte order) and port, or -1
+int classifier_match(const Classifier *classifier, uint32_t ip, int port);
+
+// Engine by name, or -1 if there is none
+int classifier_engine_named(const char *name);
+const char *classifier_engine_name(int engine);
+// Engine for classifiers created from now on
+void classifier_use_engine(int engine);
+// True for engines too slow to build before a reloaded rule set is swapped
+// in; their indexes are left to the builder thread
+bool classifier_engine_background(int engine);
+// True when one index can serve classifiers on every node
+bool classifier_engine_shares(int engine);
+// True when the classifier's engine has no index for the current rules and
+// has not declined them. A declined rule set is retried once it has
+// shrunk, or been replaced.
+bool classifier_stale(const Classifier *classifier);
+// Builds an index for the current rules, NULL if the engine declines (too
+// large). Only reads the classifier, so lookups may carry on meanwhile.
+void *classifier_build(const Classifier *classifier);
+// Replaces the index with one from classifier_build(), which lookups must
+// be excluded from. NULL records that the engine declined the rules.
+void classifier_install(Classifier *classifier, void *index);
+// True when both hold the same rules in the same order
+bool classifier_same_rules(const Classifier *a, const Classifier *b);
+// Another reference to an index built for the classifier's rules, to be
+// installed in a classifier with the same rules; NULL if the engine
+// cannot share indexes
+void *classifier_share(const Classifier *classifier, void *index);
+// Frees an index from classifier_build() or classifier_share() that was
+// not installed
+void classifier_discard(const Classifier *classifier, void *index);
+// Bytes held by the index, 0 without one
+size_t classifier_index_size(const Classifier *classifier);
+
+#endif
@@ -1,82 +1,136 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <arpa/inet.h>
+#include <pthread.h>
 #include <unistd.h>
+#include "fwclient.h"
 
 #define BUFFER_SIZE 1024
+#define CALL_TIMEOUT_MS 10000
+
+// Responses arrive in request order on the reader thread; the main thread
+// only waits for the last one before exiting
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int outstanding;
+    int failures;
+} StreamState;
+
+void print_response(int status, const char *response, void *arg) {
+    StreamState *state = arg;
+    if (status == FW_OK) {
+        printf("%s\n", response);
+    } else {
+        fprintf(stderr, "Request failed (%d)\n", status);
+    }
+    pthread_mutex_lock(&state->lock);
+    if (status != FW_OK) state->failures++;
+    if (--state->outstanding == 0) pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void print_mutation(const FwMutation *m, void *arg) {
+    if (m->op == 'R') {
+        printf("Reset %lu\n", m->version);
+    } else {
+        printf("%lu %c %lu %s %s\n", m->version, m->op, m->id, m->ip_range, m->port_range);
+    }
+    fflush(stdout);
+}
+
+// Sends every line of stdin over one connection without waiting for replies
+int run_stream(FwConnection *conn) {
+    StreamState state = { .outstanding = 0, .failures = 0 };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        pthread_mutex_lock(&state.lock);
+        state.outstanding++;
+        pthread_mutex_unlock(&state.lock);
+        int status = fw_call_async(conn, line, CALL_TIMEOUT_MS, print_response, &state);
+        if (status != FW_OK) {
+            fprintf(stderr, "Request failed (%d)\n", status);
+            pthread_mutex_lock(&state.lock);
+            state.outstanding--;
+            state.failures++;
+            pthread_mutex_unlock(&state.lock);
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_lock(&state.lock);
+    while (state.outstanding > 0) {
+        pthread_cond_wait(&state.cond, &state.lock);
+    }
+    int failures = state.failures;
+    pthread_mutex_unlock(&state.lock);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+    return failures == 0 ? 0 : 1;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 4) {
-        fprintf(stderr, "Usage: %s <serverHost> <serverPort> <command>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <serverHost> <serverPort> <command> | - | W <version>\n", argv[0]);
         return 1;
     }
-    
-    int sock;
-    struct sockaddr_in serv_addr;
-    
+
+    FwConnection *conn = fw_connect(argv[1], atoi(argv[2]), CALL_TIMEOUT_MS);
+    if (conn == NULL) {
+        perror("Connection Failed");
+        return -1;
+    }
+
+    if (argc == 4 && strcmp(argv[3], "-") == 0) {
+        int rc = run_stream(conn);
+        fw_close(conn);
+        return rc;
+    }
+
+    if (argc == 5 && strcmp(argv[3], "W") == 0) {
+        // Print rule changes as they happen until interrupted
+        if (fw_watch(conn, strtoul(argv[4], NULL, 10), print_mutation, NULL,
+                     CALL_TIMEOUT_MS, NULL) != FW_OK) {
+            fprintf(stderr, "Watch failed\n");
+            fw_close(conn);
+            return 1;
+        }
+        for (;;) pause();
+    }
+
     // Dynamically allocate command buffer based on arguments
     size_t command_length = 0;
     for (int i = 3; i < argc; i++) {
         command_length += strlen(argv[i]) + 1;
     }
-    
+
     char *command = malloc(command_length);
-    
+
     if (!command) {
         perror("Failed to allocate memory for command");
+        fw_close(conn);
         return 1;
     }
-    
+
     command[0] = '\0';
-    
+
     for (int i = 3; i < argc; i++) {
         strcat(command, argv[i]);
         if (i < argc - 1) {
             strcat(command, " ");
         }
     }
-    
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        free(command);
-        return -1;
-    }
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(atoi(argv[2]));
-    
-    if (strcmp(argv[1], "localhost") == 0) {
-        argv[1] = "127.0.0.1";
-    }
-    
-    if (inet_pton(AF_INET, argv[1], &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address");
-        free(command);
-        return -1;
-    }
-    
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection Failed");
-        free(command);
-        return -1;
-    }
-    
-    send(sock, command, strlen(command), 0);
-    free(command);  // Free command buffer after sending
-    
-    // Allocate response buffer dynamically
-    char *buffer = malloc(BUFFER_SIZE);
-    if (!buffer) {
-        perror("Failed to allocate memory for response buffer");
-        close(sock);
+
+    char response[BUFFER_SIZE];
+    int status = fw_call(conn, command, response, sizeof(response), CALL_TIMEOUT_MS);
+    free(command);
+    fw_close(conn);
+    if (status != FW_OK) {
+        fprintf(stderr, "Request failed (%d)\n", status);
         return 1;
     }
-    
-    read(sock, buffer, BUFFER_SIZE);
-    printf("%s\n", buffer);
-    
-    free(buffer);  // Free the response buffer
-    close(sock);
+    printf("%s\n", response);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,897 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "fwclient.h"
+
+#define FW_READ_BUFFER_SIZE (64 * 1024)
+#define FW_HOST_SIZE 256
+// Upper bound on a reader's sleep, so deadlines queued while it is blocked
+// are still noticed promptly
+#define FW_POLL_INTERVAL_MS 50
+#define FW_RECONNECT_MAX_DELAY_MS 2000
+// Cached hits are reported in "H <ip> <port> ..." lines that must fit the
+// server's request buffer
+#define FW_HIT_BUFFER_SIZE 960
+#define FW_HIT_MAX_LEN 22
+
+typedef struct {
+    uint32_t ip;
+    uint16_t port;
+    int8_t verdict;
+    bool valid;
+} FwCacheEntry;
+
+typedef struct FwPending {
+    FwCallback callback;
+    void *arg;
+    long long deadline_ms;  // 0 = no deadline
+    bool done;              // callback already fired by a timeout
+    struct FwPending *next;
+} FwPending;
+
+struct FwConnection {
+    char host[FW_HOST_SIZE];
+    int port;
+    int fd;
+    int readers;
+    bool closing;
+    // Lock order is write_lock then state_lock. write_lock keeps request bytes
+    // in the same order as the pending queue; state_lock guards everything else
+    pthread_mutex_t write_lock;
+    pthread_mutex_t state_lock;
+    pthread_cond_t state_cond;
+    FwPending *head;
+    FwPending *tail;
+    int pending;
+    bool send_deadlines;  // set by fw_send_deadlines()
+    // Decision cache, enabled by fw_enable_cache(). Direct-mapped: a new
+    // verdict simply replaces whatever shared its slot.
+    FwCacheEntry *cache;
+    size_t cache_mask;
+    unsigned long version;        // last rule-set version pushed by the server
+    unsigned long invalidations;  // bumped whenever cached verdicts are dropped
+    char hits[FW_HIT_BUFFER_SIZE];
+    size_t hits_len;
+    // Mutation stream, enabled by fw_watch()
+    FwMutationCallback watch_callback;
+    void *watch_arg;
+};
+
+struct FwFuture {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int status;
+    char *response;
+};
+
+struct FwPool {
+    FwConnection **conns;
+    int size;
+    unsigned int next;
+};
+
+typedef struct {
+    FwConnection *conn;
+    int fd;
+} ReaderArgs;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t remaining;
+    int status;
+    int *verdicts;
+} CheckBatch;
+
+typedef struct {
+    CheckBatch *batch;
+    size_t index;
+} CheckSlot;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// "@<ms since the epoch> " ending timeout_ms from now, when the connection
+// sends deadlines and the call has a timeout; otherwise empty
+static int format_deadline(FwConnection *conn, char *out, size_t size, int timeout_ms) {
+    out[0] = '\0';
+    if (!__atomic_load_n(&conn->send_deadlines, __ATOMIC_RELAXED) || timeout_ms <= 0) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long deadline = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout_ms;
+    return snprintf(out, size, "@%lld ", deadline);
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static int open_socket(const char *host, int port, int timeout_ms) {
+    struct addrinfo hints = {0}, *res;
+    char port_str[16];
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+            rc = 0;
+        }
+    }
+    if (rc < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Fires timeout callbacks for expired calls. Expired entries stay queued so
+// later responses still line up with the requests that produced them.
+static void expire_pending(FwConnection *conn) {
+    FwPending *expired[64];
+    int count = 0;
+    long long now = now_ms();
+    pthread_mutex_lock(&conn->state_lock);
+    for (FwPending *p = conn->head; p != NULL && count < 64; p = p->next) {
+        if (!p->done && p->deadline_ms != 0 && p->deadline_ms <= now) {
+            p->done = true;
+            expired[count++] = p;
+        }
+    }
+    // Copy out before unlocking: the entries may be freed once it is released
+    FwCallback callbacks[64];
+    void *args[64];
+    for (int i = 0; i < count; i++) {
+        callbacks[i] = expired[i]->callback;
+        args[i] = expired[i]->arg;
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    for (int i = 0; i < count; i++) {
+        callbacks[i](FW_ERR_TIMEOUT, NULL, args[i]);
+    }
+}
+
+static int next_timeout(FwConnection *conn) {
+    long long earliest = 0;
+    pthread_mutex_lock(&conn->state_lock);
+    for (FwPending *p = conn->head; p != NULL; p = p->next) {
+        if (!p->done && p->deadline_ms != 0 &&
+            (earliest == 0 || p->deadline_ms < earliest)) {
+            earliest = p->deadline_ms;
+        }
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    if (earliest == 0) return FW_POLL_INTERVAL_MS;
+    long long wait = earliest - now_ms();
+    if (wait > FW_POLL_INTERVAL_MS) return FW_POLL_INTERVAL_MS;
+    return wait > 0 ? (int)wait : 0;
+}
+
+static bool parse_ip(const char *ip, uint32_t *result) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1) return false;
+    *result = ntohl(addr.s_addr);
+    return true;
+}
+
+static bool parse_ip_range(const char *range, uint32_t *start, uint32_t *end) {
+    char first[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
+    if (strchr(range, '-') == NULL) {
+        if (!parse_ip(range, start)) return false;
+        *end = *start;
+        return true;
+    }
+    return sscanf(range, "%15[^-]-%15s", first, last) == 2 &&
+           parse_ip(first, start) && parse_ip(last, end);
+}
+
+static bool parse_port_range(const char *range, int *start, int *end) {
+    if (strchr(range, '-') == NULL) {
+        *start = *end = atoi(range);
+        return true;
+    }
+    return sscanf(range, "%d-%d", start, end) == 2;
+}
+
+static size_t cache_slot(FwConnection *conn, uint32_t ip, uint16_t port) {
+    uint32_t hash = (ip * 2654435761u) ^ (port * 40503u);
+    return (hash ^ (hash >> 16)) & conn->cache_mask;
+}
+
+// Called with state_lock held
+static void cache_clear(FwConnection *conn) {
+    memset(conn->cache, 0, (conn->cache_mask + 1) * sizeof(FwCacheEntry));
+    conn->invalidations++;
+}
+
+// Passes a mutation or reset frame to the watch callback
+static void handle_mutation(FwConnection *conn, const char *frame) {
+    FwMutation m = {0};
+    char ip_range[64] = "", port_range[16] = "";
+    unsigned long count;
+    if (sscanf(frame, "!R %lu %lu", &m.version, &count) == 2) {
+        m.op = 'R';
+        m.id = count;
+    } else if (sscanf(frame, "!E %lu %c %lu %63s %15s", &m.version, &m.op, &m.id,
+                      ip_range, port_range) != 5) {
+        return;
+    }
+    m.ip_range = ip_range;
+    m.port_range = port_range;
+    pthread_mutex_lock(&conn->state_lock);
+    // A reset may move the version backwards if the server was restarted
+    if (m.op == 'R' || m.version > conn->version) conn->version = m.version;
+    FwMutationCallback callback = conn->watch_callback;
+    void *arg = conn->watch_arg;
+    pthread_mutex_unlock(&conn->state_lock);
+    if (callback != NULL) callback(&m, arg);
+}
+
+// Handles a frame the server pushed on its own initiative
+static void handle_push(FwConnection *conn, const char *frame) {
+    unsigned long version;
+    char ip_range[64], port_range[16];
+    uint32_t ip_start, ip_end;
+    int port_start, port_end;
+    if (frame[1] == 'E' || frame[1] == 'R') {
+        handle_mutation(conn, frame);
+        return;
+    }
+    if (sscanf(frame, "!I %lu %63s %15s", &version, ip_range, port_range) != 3) return;
+    bool ranges = parse_ip_range(ip_range, &ip_start, &ip_end) &&
+                  parse_port_range(port_range, &port_start, &port_end);
+    pthread_mutex_lock(&conn->state_lock);
+    if (version > conn->version) conn->version = version;
+    if (conn->cache != NULL && !ranges) {
+        cache_clear(conn);
+    } else if (conn->cache != NULL) {
+        for (size_t i = 0; i <= conn->cache_mask; i++) {
+            FwCacheEntry *e = &conn->cache[i];
+            if (e->valid && e->ip >= ip_start && e->ip <= ip_end &&
+                e->port >= port_start && e->port <= port_end) {
+                e->valid = false;
+            }
+        }
+        conn->invalidations++;
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+}
+
+static void dispatch_response(FwConnection *conn, const char *response) {
+    if (response[0] == '!') {
+        handle_push(conn, response);
+        return;
+    }
+    pthread_mutex_lock(&conn->state_lock);
+    FwPending *p = conn->head;
+    if (p != NULL) {
+        conn->head = p->next;
+        if (conn->head == NULL) conn->tail = NULL;
+        conn->pending--;
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    if (p == NULL) return;
+    if (!p->done) p->callback(FW_OK, response, p->arg);
+    free(p);
+}
+
+static void flush_hits(FwConnection *conn, bool from_reader);
+static int ensure_connected(FwConnection *conn, int timeout_ms);
+
+static void *reader_main(void *arg) {
+    ReaderArgs *args = arg;
+    FwConnection *conn = args->conn;
+    int fd = args->fd;
+    free(args);
+    char *buffer = malloc(FW_READ_BUFFER_SIZE);
+    size_t len = 0;
+    bool truncated = false;
+    while (buffer != NULL) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, next_timeout(conn));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        flush_hits(conn, true);
+        // Checked on every pass: a steady stream of responses would otherwise
+        // keep poll from ever timing out
+        expire_pending(conn);
+        if (ready == 0) continue;
+        ssize_t n = recv(fd, buffer + len, FW_READ_BUFFER_SIZE - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        size_t start = 0;
+        char *end;
+        while ((end = memchr(buffer + start, '\0', len - start)) != NULL) {
+            // The head of an oversized response was already delivered
+            if (!truncated) dispatch_response(conn, buffer + start);
+            truncated = false;
+            start = end + 1 - buffer;
+        }
+        memmove(buffer, buffer + start, len - start);
+        len -= start;
+        if (len == FW_READ_BUFFER_SIZE) {
+            buffer[FW_READ_BUFFER_SIZE - 1] = '\0';
+            dispatch_response(conn, buffer);
+            truncated = true;
+            len = 0;
+        }
+    }
+    free(buffer);
+
+    // Connection lost: detach it and fail everything still outstanding. The
+    // cache is dropped too, as invalidations can no longer arrive.
+    pthread_mutex_lock(&conn->write_lock);
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->fd == fd) {
+        conn->fd = -1;
+        if (conn->cache != NULL) cache_clear(conn);
+    }
+    close(fd);
+    FwPending *p = conn->head;
+    conn->head = conn->tail = NULL;
+    conn->pending = 0;
+    pthread_mutex_unlock(&conn->state_lock);
+    pthread_mutex_unlock(&conn->write_lock);
+    while (p != NULL) {
+        FwPending *next = p->next;
+        if (!p->done) p->callback(FW_ERR_IO, NULL, p->arg);
+        free(p);
+        p = next;
+    }
+
+    // Subscribed connections reconnect on their own, since the application
+    // may never make another call that would do it
+    int delay_ms = FW_POLL_INTERVAL_MS;
+    for (;;) {
+        pthread_mutex_lock(&conn->state_lock);
+        bool resume = !conn->closing &&
+                      (conn->cache != NULL || conn->watch_callback != NULL);
+        pthread_mutex_unlock(&conn->state_lock);
+        if (!resume) break;
+        usleep(delay_ms * 1000);
+        pthread_mutex_lock(&conn->write_lock);
+        int status = ensure_connected(conn, FW_RECONNECT_MAX_DELAY_MS);
+        pthread_mutex_unlock(&conn->write_lock);
+        if (status != FW_ERR_CONNECT) break;
+        delay_ms = delay_ms * 2 < FW_RECONNECT_MAX_DELAY_MS ?
+                   delay_ms * 2 : FW_RECONNECT_MAX_DELAY_MS;
+    }
+    pthread_mutex_lock(&conn->state_lock);
+    conn->readers--;
+    pthread_cond_broadcast(&conn->state_cond);
+    pthread_mutex_unlock(&conn->state_lock);
+    return NULL;
+}
+
+static void ignore_response(int status, const char *response, void *arg) {
+}
+
+// Called with write_lock held
+static int ensure_connected(FwConnection *conn, int timeout_ms) {
+    pthread_mutex_lock(&conn->state_lock);
+    bool closing = conn->closing;
+    bool connected = conn->fd >= 0;
+    pthread_mutex_unlock(&conn->state_lock);
+    if (closing) return FW_ERR_CLOSED;
+    if (connected) return FW_OK;
+
+    int fd = open_socket(conn->host, conn->port, timeout_ms);
+    if (fd < 0) return FW_ERR_CONNECT;
+    ReaderArgs *args = malloc(sizeof(ReaderArgs));
+    args->conn = conn;
+    args->fd = fd;
+    pthread_mutex_lock(&conn->state_lock);
+    conn->fd = fd;
+    conn->readers++;
+    pthread_mutex_unlock(&conn->state_lock);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_main, args) != 0) {
+        pthread_mutex_lock(&conn->state_lock);
+        conn->fd = -1;
+        conn->readers--;
+        pthread_mutex_unlock(&conn->state_lock);
+        close(fd);
+        free(args);
+        return FW_ERR_CONNECT;
+    }
+    pthread_detach(reader);
+
+    // A new connection has no subscriptions and may have missed pushes, so
+    // start the cache over, resume the watch where it left off, and do both
+    // before anything else is sent
+    char requests[64];
+    size_t len = 0;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->cache != NULL) {
+        cache_clear(conn);
+        len += sprintf(requests + len, "S\n");
+    }
+    if (conn->watch_callback != NULL) {
+        len += sprintf(requests + len, "W %lu\n", conn->version);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (requests[i] != '\n') continue;
+        FwPending *p = calloc(1, sizeof(FwPending));
+        p->callback = ignore_response;
+        if (conn->tail != NULL) {
+            conn->tail->next = p;
+        } else {
+            conn->head = p;
+        }
+        conn->tail = p;
+        conn->pending++;
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    if (len > 0 && !send_all(fd, requests, len)) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    return FW_OK;
+}
+
+// Queues a chain of pending entries and writes their requests in one send.
+// Called with write_lock held.
+static int enqueue_locked(FwConnection *conn, const char *data, size_t len,
+                          FwPending *first, FwPending *last, int count, int timeout_ms) {
+    int status = ensure_connected(conn, timeout_ms);
+    if (status != FW_OK) return status;
+    pthread_mutex_lock(&conn->state_lock);
+    if (conn->tail != NULL) {
+        conn->tail->next = first;
+    } else {
+        conn->head = first;
+    }
+    conn->tail = last;
+    conn->pending += count;
+    int fd = conn->fd;
+    pthread_mutex_unlock(&conn->state_lock);
+    if (!send_all(fd, data, len)) {
+        // The reader sees the shutdown and fails the queued calls
+        shutdown(fd, SHUT_RDWR);
+    }
+    return FW_OK;
+}
+
+static int enqueue(FwConnection *conn, const char *data, size_t len,
+                   FwPending *first, FwPending *last, int count, int timeout_ms) {
+    pthread_mutex_lock(&conn->write_lock);
+    int status = enqueue_locked(conn, data, len, first, last, count, timeout_ms);
+    pthread_mutex_unlock(&conn->write_lock);
+    return status;
+}
+
+static FwConnection *conn_create(const char *host, int port) {
+    FwConnection *conn = calloc(1, sizeof(FwConnection));
+    if (conn == NULL) return NULL;
+    strncpy(conn->host, host, FW_HOST_SIZE - 1);
+    conn->port = port;
+    conn->fd = -1;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    pthread_mutex_init(&conn->state_lock, NULL);
+    pthread_cond_init(&conn->state_cond, NULL);
+    return conn;
+}
+
+FwConnection *fw_connect(const char *host, int port, int timeout_ms) {
+    FwConnection *conn = conn_create(host, port);
+    if (conn == NULL) return NULL;
+    pthread_mutex_lock(&conn->write_lock);
+    int status = ensure_connected(conn, timeout_ms);
+    pthread_mutex_unlock(&conn->write_lock);
+    if (status != FW_OK) {
+        fw_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void fw_close(FwConnection *conn) {
+    if (conn == NULL) return;
+    flush_hits(conn, false);
+    pthread_mutex_lock(&conn->state_lock);
+    conn->closing = true;
+    if (conn->fd >= 0) shutdown(conn->fd, SHUT_RDWR);
+    while (conn->readers > 0) {
+        pthread_cond_wait(&conn->state_cond, &conn->state_lock);
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    pthread_mutex_destroy(&conn->write_lock);
+    pthread_mutex_destroy(&conn->state_lock);
+    pthread_cond_destroy(&conn->state_cond);
+    free(conn->cache);
+    free(conn);
+}
+
+int fw_pending(FwConnection *conn) {
+    pthread_mutex_lock(&conn->state_lock);
+    int pending = conn->pending;
+    pthread_mutex_unlock(&conn->state_lock);
+    return pending;
+}
+
+static FwPending *pending_create(FwCallback callback, void *arg, int timeout_ms) {
+    FwPending *p = calloc(1, sizeof(FwPending));
+    if (p == NULL) return NULL;
+    p->callback = callback;
+    p->arg = arg;
+    p->deadline_ms = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+    return p;
+}
+
+int fw_call_async(FwConnection *conn, const char *request, int timeout_ms,
+                  FwCallback callback, void *arg) {
+    size_t len = strlen(request);
+    if (memchr(request, '\n', len) != NULL) return FW_ERR_INVALID;
+    char deadline[32];
+    size_t prefix = format_deadline(conn, deadline, sizeof(deadline), timeout_ms);
+    char *line = malloc(prefix + len + 1);
+    FwPending *p = pending_create(callback, arg, timeout_ms);
+    if (line == NULL || p == NULL) {
+        free(line);
+        free(p);
+        return FW_ERR_IO;
+    }
+    memcpy(line, deadline, prefix);
+    memcpy(line + prefix, request, len);
+    line[prefix + len] = '\n';
+    int status = enqueue(conn, line, prefix + len + 1, p, p, 1, timeout_ms);
+    free(line);
+    if (status != FW_OK) free(p);
+    return status;
+}
+
+static void future_complete(int status, const char *response, void *arg) {
+    FwFuture *future = arg;
+    pthread_mutex_lock(&future->lock);
+    future->status = status;
+    future->response = response != NULL ? strdup(response) : NULL;
+    future->done = true;
+    pthread_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+FwFuture *fw_submit(FwConnection *conn, const char *request, int timeout_ms) {
+    FwFuture *future = calloc(1, sizeof(FwFuture));
+    if (future == NULL) return NULL;
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    int status = fw_call_async(conn, request, timeout_ms, future_complete, future);
+    if (status != FW_OK) future_complete(status, NULL, future);
+    return future;
+}
+
+int fw_future_wait(FwFuture *future, char *response, size_t size) {
+    if (future == NULL) return FW_ERR_IO;
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->lock);
+    }
+    pthread_mutex_unlock(&future->lock);
+    int status = future->status;
+    if (response != NULL && size > 0) {
+        response[0] = '\0';
+        if (future->response != NULL) {
+            strncpy(response, future->response, size - 1);
+            response[size - 1] = '\0';
+        }
+    }
+    free(future->response);
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+    return status;
+}
+
+int fw_call(FwConnection *conn, const char *request, char *response,
+            size_t size, int timeout_ms) {
+    return fw_future_wait(fw_submit(conn, request, timeout_ms), response, size);
+}
+
+static void check_complete(int status, const char *response, void *arg) {
+    CheckSlot *slot = arg;
+    CheckBatch *batch = slot->batch;
+    int verdict = FW_VERDICT_ERROR;
+    if (status == FW_OK && strcmp(response, "Connection accepted") == 0) {
+        verdict = FW_VERDICT_ACCEPTED;
+    } else if (status == FW_OK && strcmp(response, "Connection rejected") == 0) {
+        verdict = FW_VERDICT_REJECTED;
+    }
+    pthread_mutex_lock(&batch->lock);
+    batch->verdicts[slot->index] = verdict;
+    if (status != FW_OK && batch->status == FW_OK) batch->status = status;
+    if (--batch->remaining == 0) pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+int fw_check_batch(FwConnection *conn, const char *const *ips, const int *ports,
+                   size_t count, int *verdicts, int timeout_ms) {
+    if (count == 0) return FW_OK;
+    // "C " + address + " " + port + "\n" fits comfortably in 32 bytes, and
+    // the same again covers a deadline
+    char deadline[32];
+    format_deadline(conn, deadline, sizeof(deadline), timeout_ms);
+    char *data = malloc(count * 64);
+    CheckSlot *slots = malloc(count * sizeof(CheckSlot));
+    FwPending *first = NULL, *last = NULL;
+    CheckBatch batch = { .remaining = count, .status = FW_OK, .verdicts = verdicts };
+    size_t len = 0;
+    int status = FW_OK;
+    if (data == NULL || slots == NULL) status = FW_ERR_IO;
+    for (size_t i = 0; status == FW_OK && i < count; i++) {
+        int n = snprintf(data + len, 64, "%sC %.15s %d\n", deadline, ips[i], ports[i]);
+        if (n < 0 || n >= 64) {
+            status = FW_ERR_INVALID;
+            break;
+        }
+        len += n;
+        slots[i].batch = &batch;
+        slots[i].index = i;
+        FwPending *p = pending_create(check_complete, &slots[i], timeout_ms);
+        if (p == NULL) {
+            status = FW_ERR_IO;
+            break;
+        }
+        if (last != NULL) {
+            last->next = p;
+        } else {
+            first = p;
+        }
+        last = p;
+    }
+    if (status == FW_OK) {
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.cond, NULL);
+        status = enqueue(conn, data, len, first, last, (int)count, timeout_ms);
+        if (status == FW_OK) {
+            first = NULL;
+            pthread_mutex_lock(&batch.lock);
+            while (batch.remaining > 0) {
+                pthread_cond_wait(&batch.cond, &batch.lock);
+            }
+            pthread_mutex_unlock(&batch.lock);
+            status = batch.status;
+        }
+        pthread_mutex_destroy(&batch.lock);
+        pthread_cond_destroy(&batch.cond);
+    }
+    while (first != NULL) {
+        FwPending *next = first->next;
+        free(first);
+        first = next;
+    }
+    free(slots);
+    free(data);
+    return status;
+}
+
+FwPool *fw_pool_create(const char *host, int port, int size) {
+    if (size <= 0) return NULL;
+    FwPool *pool = calloc(1, sizeof(FwPool));
+    if (pool == NULL) return NULL;
+    pool->conns = calloc(size, sizeof(FwConnection*));
+    pool->size = size;
+    for (int i = 0; pool->conns != NULL && i < size; i++) {
+        // Connections open on first use and reopen after failures
+        if ((pool->conns[i] = conn_create(host, port)) == NULL) {
+            pool->size = i;
+            fw_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    if (pool->conns == NULL) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void fw_pool_destroy(FwPool *pool) {
+    if (pool == NULL) return;
+    for (int i = 0; i < pool->size; i++) {
+        fw_close(pool->conns[i]);
+    }
+    free(pool->conns);
+    free(pool);
+}
+
+FwConnection *fw_pool_get(FwPool *pool) {
+    // Start from a rotating offset so idle connections share the load
+    unsigned int start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    FwConnection *best = NULL;
+    int best_pending = 0;
+    for (int i = 0; i < pool->size; i++) {
+        FwConnection *conn = pool->conns[(start + i) % pool->size];
+        int pending = fw_pending(conn);
+        if (best == NULL || pending < best_pending) {
+            best = conn;
+            best_pending = pending;
+        }
+    }
+    return best;
+}
+
+int fw_pool_call(FwPool *pool, const char *request, char *response,
+                 size_t size, int timeout_ms) {
+    return fw_call(fw_pool_get(pool), request, response, size, timeout_ms);
+}
+
+// Sends cached hits back so the server's query logs stay complete. The
+// reader only flushes opportunistically: it must never wait on write_lock,
+// since a blocked writer may in turn be waiting for the reader to drain.
+static void flush_hits(FwConnection *conn, bool from_reader) {
+    if (from_reader) {
+        if (pthread_mutex_trylock(&conn->write_lock) != 0) return;
+    } else {
+        pthread_mutex_lock(&conn->write_lock);
+    }
+    char line[FW_HIT_BUFFER_SIZE + 3];
+    pthread_mutex_lock(&conn->state_lock);
+    size_t len = conn->hits_len;
+    if (len > 0) {
+        memcpy(line, "H ", 2);
+        memcpy(line + 2, conn->hits, len);
+        line[len + 2] = '\n';
+        conn->hits_len = 0;
+    }
+    pthread_mutex_unlock(&conn->state_lock);
+    FwPending *p = len > 0 ? pending_create(ignore_response, NULL, 0) : NULL;
+    if (p != NULL && enqueue_locked(conn, line, len + 3, p, p, 1, 0) != FW_OK) {
+        // Nowhere to report them; the hits are dropped with the connection
+        free(p);
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void record_hit(FwConnection *conn, const char *ip, int port) {
+    for (;;) {
+        pthread_mutex_lock(&conn->state_lock);
+        if (conn->hits_len + FW_HIT_MAX_LEN <= FW_HIT_BUFFER_SIZE) {
+            conn->hits_len += sprintf(conn->hits + conn->hits_len, "%s %d ", ip, port);
+            pthread_mutex_unlock(&conn->state_lock);
+            return;
+        }
+        pthread_mutex_unlock(&conn->state_lock);
+        flush_hits(conn, false);
+    }
+}
+
+int fw_enable_cache(FwConnection *conn, size_t entries, int timeout_ms) {
+    size_t size = 1;
+    while (size < entries) size <<= 1;
+    FwCacheEntry *cache = calloc(size, sizeof(FwCacheEntry));
+    if (cache == NULL) return FW_ERR_IO;
+    pthread_mutex_lock(&conn->state_lock);
+    free(conn->cache);
+    conn->cache = cache;
+    conn->cache_mask = size - 1;
+    conn->invalidations++;
+    pthread_mutex_unlock(&conn->state_lock);
+    char response[64];
+    int status = fw_call(conn, "S", response, sizeof(response), timeout_ms);
+    unsigned long version;
+    if (status == FW_OK && sscanf(response, "Subscribed %lu", &version) != 1) {
+        status = FW_ERR_INVALID;
+    } else if (status == FW_OK) {
+        pthread_mutex_lock(&conn->state_lock);
+        if (version > conn->version) conn->version = version;
+        pthread_mutex_unlock(&conn->state_lock);
+    }
+    return status;
+}
+
+void fw_send_deadlines(FwConnection *conn, bool enabled) {
+    __atomic_store_n(&conn->send_deadlines, enabled, __ATOMIC_RELAXED);
+}
+
+unsigned long fw_rule_version(FwConnection *conn) {
+    pthread_mutex_lock(&conn->state_lock);
+    unsigned long version = conn->version;
+    pthread_mutex_unlock(&conn->state_lock);
+    return version;
+}
+
+int fw_check(FwConnection *conn, const char *ip, int port, int *verdict, int timeout_ms) {
+    uint32_t addr;
+    bool cacheable = parse_ip(ip, &addr) && port >= 0 && port <= 65535;
+    unsigned long observed = 0;
+    size_t slot = 0;
+    if (cacheable) {
+        pthread_mutex_lock(&conn->state_lock);
+        cacheable = conn->cache != NULL;
+        if (cacheable) {
+            slot = cache_slot(conn, addr, port);
+            FwCacheEntry *e = &conn->cache[slot];
+            if (e->valid && e->ip == addr && e->port == port) {
+                *verdict = e->verdict;
+                pthread_mutex_unlock(&conn->state_lock);
+                if (*verdict == FW_VERDICT_ACCEPTED) record_hit(conn, ip, port);
+                return FW_OK;
+            }
+            observed = conn->invalidations;
+        }
+        pthread_mutex_unlock(&conn->state_lock);
+    }
+
+    char request[64], response[64];
+    snprintf(request, sizeof(request), "C %.15s %d", ip, port);
+    int status = fw_call(conn, request, response, sizeof(response), timeout_ms);
+    if (status != FW_OK) return status;
+    if (strcmp(response, "Connection accepted") == 0) {
+        *verdict = FW_VERDICT_ACCEPTED;
+    } else if (strcmp(response, "Connection rejected") == 0) {
+        *verdict = FW_VERDICT_REJECTED;
+    } else {
+        *verdict = FW_VERDICT_ERROR;
+        return FW_OK;
+    }
+    if (cacheable) {
+        // Only cache if no invalidation arrived while the check was in
+        // flight; otherwise the verdict may predate the change
+        pthread_mutex_lock(&conn->state_lock);
+        if (conn->cache != NULL && conn->invalidations == observed) {
+            conn->cache[slot] = (FwCacheEntry){ addr, port, *verdict, true };
+        }
+        pthread_mutex_unlock(&conn->state_lock);
+    }
+    return FW_OK;
+}
+
+int fw_watch(FwConnection *conn, unsigned long from_version,
+             FwMutationCallback callback, void *arg, int timeout_ms,
+             unsigned long *current_version) {
+    pthread_mutex_lock(&conn->state_lock);
+    conn->watch_callback = callback;
+    conn->watch_arg = arg;
+    conn->version = from_version;
+    pthread_mutex_unlock(&conn->state_lock);
+    char request[32], response[64];
+    snprintf(request, sizeof(request), "W %lu", from_version);
+    int status = fw_call(conn, request, response, sizeof(response), timeout_ms);
+    unsigned long version;
+    if (status == FW_OK && sscanf(response, "Watching %lu", &version) != 1) {
+        status = FW_ERR_INVALID;
+    } else if (status == FW_OK && current_version != NULL) {
+        *current_version = version;
+    }
+    return status;
+}
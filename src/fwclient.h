@@ -0,0 +1,99 @@
+#ifndef FWCLIENT_H
+#define FWCLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Client library for the firewall server's pipelined protocol. Requests are
+// sent as newline-terminated lines and answered in order with NUL-terminated
+// responses, so any number of calls may be in flight on one connection.
+//
+// Every call takes a timeout in milliseconds (0 waits forever). A connection
+// that drops fails its outstanding calls with FW_ERR_IO and is re-established
+// transparently by the next call.
+
+#define FW_OK 0
+#define FW_ERR_CONNECT -1
+#define FW_ERR_IO -2
+#define FW_ERR_TIMEOUT -3
+#define FW_ERR_CLOSED -4
+#define FW_ERR_INVALID -5
+
+#define FW_VERDICT_REJECTED 0
+#define FW_VERDICT_ACCEPTED 1
+#define FW_VERDICT_ERROR -1
+
+typedef struct FwConnection FwConnection;
+typedef struct FwPool FwPool;
+typedef struct FwFuture FwFuture;
+
+// A rule-set change streamed by fw_watch(). op is 'A' or 'D' for a rule
+// added or deleted at version, or 'R' when the server could not replay from
+// the requested version: drop all local state, the current rules follow as
+// additions and id holds how many there are.
+typedef struct {
+    char op;
+    unsigned long version;
+    unsigned long id;
+    const char *ip_range;
+    const char *port_range;
+} FwMutation;
+
+// Invoked exactly once per accepted call, from the connection's reader
+// thread. response is NULL unless status is FW_OK.
+typedef void (*FwCallback)(int status, const char *response, void *arg);
+
+// Connections
+FwConnection *fw_connect(const char *host, int port, int timeout_ms);
+void fw_close(FwConnection *conn);
+int fw_pending(FwConnection *conn);
+
+// Asynchronous calls. A non-FW_OK return means the callback will not run.
+int fw_call_async(FwConnection *conn, const char *request, int timeout_ms,
+                  FwCallback callback, void *arg);
+FwFuture *fw_submit(FwConnection *conn, const char *request, int timeout_ms);
+// Waits for and releases the future; each future must be waited on once
+int fw_future_wait(FwFuture *future, char *response, size_t size);
+
+// Synchronous calls
+int fw_call(FwConnection *conn, const char *request, char *response,
+            size_t size, int timeout_ms);
+// Pipelines count checks in a single write and fills verdicts with
+// FW_VERDICT_* values. Returns the first error encountered, if any.
+int fw_check_batch(FwConnection *conn, const char *const *ips, const int *ports,
+                   size_t count, int *verdicts, int timeout_ms);
+
+// Single check. With the decision cache enabled, verdicts are remembered
+// and served locally until the server pushes an invalidation covering them;
+// accepted hits served locally are reported back to the server in batches.
+int fw_check(FwConnection *conn, const char *ip, int port, int *verdict,
+             int timeout_ms);
+// Subscribes the connection to rule-change pushes and enables a local cache
+// of about entries verdicts. Reconnects resubscribe with an empty cache.
+int fw_enable_cache(FwConnection *conn, size_t entries, int timeout_ms);
+// Latest rule-set version the server has pushed to a subscribed connection
+unsigned long fw_rule_version(FwConnection *conn);
+
+// Streams every rule change after from_version to callback, on the reader
+// thread. current_version, if not NULL, receives the server's version when
+// the watch started: catch-up is complete once that version is delivered.
+// After a reconnect the watch resumes from the last version seen.
+typedef void (*FwMutationCallback)(const FwMutation *mutation, void *arg);
+int fw_watch(FwConnection *conn, unsigned long from_version,
+             FwMutationCallback callback, void *arg, int timeout_ms,
+             unsigned long *current_version);
+
+// Sends each call's timeout along as a deadline, "@<ms since the epoch>"
+// before the request, so a server under overload skips calls the client has
+// stopped waiting for and answers them "Deadline exceeded". Needs a server
+// that understands deadlines and a clock in step with the client's.
+void fw_send_deadlines(FwConnection *conn, bool enabled);
+
+// Pools of lazily-opened connections; calls go to the least busy one
+FwPool *fw_pool_create(const char *host, int port, int size);
+void fw_pool_destroy(FwPool *pool);
+FwConnection *fw_pool_get(FwPool *pool);
+int fw_pool_call(FwPool *pool, const char *request, char *response,
+                 size_t size, int timeout_ms);
+
+#endif
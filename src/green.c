@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "green.h"
+
+#define GREEN_EVENT_BATCH 256
+#define GREEN_MAX_POOLED 1024
+
+// A green thread starts on its own stack through makecontext() once, then
+// stays in green_trampoline() for as long as it is pooled. Switches after
+// that are _setjmp()/_longjmp(), which unlike swapcontext() do not save
+// and restore the signal mask with a system call.
+typedef struct GreenThread GreenThread;
+
+// epoll data for one descriptor a green thread waits on
+typedef struct {
+    GreenThread *thread;
+    int index;
+} GreenWaiter;
+
+struct GreenThread {
+    jmp_buf context;
+    ucontext_t start;
+    char *stack;  // mapping, guard page first
+    void (*fn)(void *);
+    void *arg;
+    bool started;
+    bool finished;
+    bool queued;      // on the run queue
+    struct pollfd *fds;  // while waiting in green_poll
+    int timer_index;  // in the loop's timer heap, -1 when not
+    long deadline_ms;
+    GreenWaiter waiters[GREEN_MAX_POLL_FDS];
+    GreenThread *next;  // run queue or pool
+};
+
+typedef struct GreenSpawn {
+    void (*fn)(void *);
+    void *arg;
+    struct GreenSpawn *next;
+} GreenSpawn;
+
+struct GreenLoop {
+    int epoll_fd;
+    int wake_fd;  // signalled when spawns are queued
+    pthread_mutex_t spawn_lock;
+    GreenSpawn *spawns;  // newest first
+    GreenThread *run_head;
+    GreenThread *run_tail;
+    GreenThread **timers;  // min-heap on deadline_ms
+    int timer_count;
+    int timer_capacity;
+    GreenThread *pool;
+    GreenThread *current;
+    jmp_buf scheduler;
+    unsigned long running;
+    unsigned long started;
+    unsigned long switches;
+    unsigned long pooled;
+};
+
+__thread GreenLoop *green_loop = NULL;  // the loop this OS thread runs
+
+long green_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+GreenLoop *green_loop_create() {
+    GreenLoop *loop = calloc(1, sizeof(GreenLoop));
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+        perror("Failed to create event loop");
+        exit(1);
+    }
+    // Spawn requests are the only events without a waiter
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event);
+    pthread_mutex_init(&loop->spawn_lock, NULL);
+    return loop;
+}
+bool green_active() {
+    return green_loop != NULL && green_loop->current != NULL;
+}
+void green_stats(GreenLoop *loop, GreenStats *stats) {
+    stats->running = __atomic_load_n(&loop->running, __ATOMIC_RELAXED);
+    stats->started = __atomic_load_n(&loop->started, __ATOMIC_RELAXED);
+    stats->switches = __atomic_load_n(&loop->switches, __ATOMIC_RELAXED);
+    stats->pooled = __atomic_load_n(&loop->pooled, __ATOMIC_RELAXED);
+}
+void green_make_runnable(GreenLoop *loop, GreenThread *thread) {
+    if (thread->queued) return;
+    thread->queued = true;
+    thread->next = NULL;
+    if (loop->run_tail != NULL) loop->run_tail->next = thread;
+    else loop->run_head = thread;
+    loop->run_tail = thread;
+}
+void green_timer_swap(GreenLoop *loop, int a, int b) {
+    GreenThread *thread = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = thread;
+    loop->timers[a]->timer_index = a;
+    loop->timers[b]->timer_index = b;
+}
+void green_timer_sift(GreenLoop *loop, int i) {
+    while (i > 0 && loop->timers[(i - 1) / 2]->deadline_ms > loop->timers[i]->deadline_ms) {
+        green_timer_swap(loop, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < loop->timer_count; child++) {
+            if (loop->timers[child]->deadline_ms < loop->timers[smallest]->deadline_ms) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) return;
+        green_timer_swap(loop, i, smallest);
+        i = smallest;
+    }
+}
+void green_timer_add(GreenLoop *loop, GreenThread *thread, long deadline_ms) {
+    if (loop->timer_count == loop->timer_capacity) {
+        loop->timer_capacity = loop->timer_capacity > 0 ? loop->timer_capacity * 2 : 64;
+        loop->timers = realloc(loop->timers, loop->timer_capacity * sizeof(GreenThread *));
+        if (loop->timers == NULL) {
+            perror("Failed to allocate memory for timers");
+            exit(1);
+        }
+    }
+    thread->deadline_ms = deadline_ms;
+    thread->timer_index = loop->timer_count;
+    loop->timers[loop->timer_count++] = thread;
+    green_timer_sift(loop, thread->timer_index);
+}
+void green_timer_remove(GreenLoop *loop, GreenThread *thread) {
+    int i = thread->timer_index;
+    if (i < 0) return;
+    thread->timer_index = -1;
+    if (i == --loop->timer_count) return;
+    loop->timers[i] = loop->timers[loop->timer_count];
+    loop->timers[i]->timer_index = i;
+    green_timer_sift(loop, i);
+}
+// Returns to the loop; resumes when the loop switches back
+void green_yield(GreenLoop *loop) {
+    if (_setjmp(loop->current->context) == 0) _longjmp(loop->scheduler, 1);
+}
+void green_trampoline() {
+    GreenLoop *loop = green_loop;
+    GreenThread *thread = loop->current;
+    for (;;) {
+        thread->fn(thread->arg);
+        thread->finished = true;
+        // Resumed here with the next function when taken from the pool
+        green_yield(loop);
+    }
+}
+GreenThread *green_thread_create() {
+    GreenThread *thread = calloc(1, sizeof(GreenThread));
+    size_t page = sysconf(_SC_PAGESIZE);
+    // Pages are only committed as the stack grows into them
+    char *stack = mmap(NULL, GREEN_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (thread == NULL || stack == MAP_FAILED) {
+        perror("Failed to allocate green thread stack");
+        exit(1);
+    }
+    thread->stack = stack;
+    mprotect(stack, page, PROT_NONE);
+    getcontext(&thread->start);
+    thread->start.uc_stack.ss_sp = thread->stack + page;
+    thread->start.uc_stack.ss_size = GREEN_STACK_SIZE;
+    thread->start.uc_link = NULL;
+    makecontext(&thread->start, green_trampoline, 0);
+    for (int i = 0; i < GREEN_MAX_POLL_FDS; i++) {
+        thread->waiters[i].thread = thread;
+        thread->waiters[i].index = i;
+    }
+    thread->timer_index = -1;
+    return thread;
+}
+void green_thread_destroy(GreenThread *thread) {
+    munmap(thread->stack, GREEN_STACK_SIZE + sysconf(_SC_PAGESIZE));
+    free(thread);
+}
+void green_switch_to(GreenLoop *loop, GreenThread *thread) {
+    loop->current = thread;
+    __atomic_add_fetch(&loop->switches, 1, __ATOMIC_RELAXED);
+    if (_setjmp(loop->scheduler) == 0) {
+        if (thread->started) _longjmp(thread->context, 1);
+        // A new thread has no context to jump to yet
+        thread->started = true;
+        setcontext(&thread->start);
+    }
+    loop->current = NULL;
+    if (!thread->finished) return;
+    __atomic_sub_fetch(&loop->running, 1, __ATOMIC_RELAXED);
+    if (loop->pooled < GREEN_MAX_POOLED) {
+        thread->next = loop->pool;
+        loop->pool = thread;
+        __atomic_add_fetch(&loop->pooled, 1, __ATOMIC_RELAXED);
+    } else {
+        green_thread_destroy(thread);
+    }
+}
+void green_spawn(GreenLoop *loop, void (*fn)(void *), void *arg) {
+    GreenSpawn *spawn = malloc(sizeof(GreenSpawn));
+    spawn->fn = fn;
+    spawn->arg = arg;
+    pthread_mutex_lock(&loop->spawn_lock);
+    spawn->next = loop->spawns;
+    loop->spawns = spawn;
+    pthread_mutex_unlock(&loop->spawn_lock);
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Failed to wake event loop");
+    }
+}
+// Starts queued spawns in the order they were made
+void green_start_spawns(GreenLoop *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read event loop wakeup");
+    }
+    pthread_mutex_lock(&loop->spawn_lock);
+    GreenSpawn *spawns = loop->spawns;
+    loop->spawns = NULL;
+    pthread_mutex_unlock(&loop->spawn_lock);
+    GreenSpawn *ordered = NULL;
+    while (spawns != NULL) {
+        GreenSpawn *next = spawns->next;
+        spawns->next = ordered;
+        ordered = spawns;
+        spawns = next;
+    }
+    while (ordered != NULL) {
+        GreenSpawn *spawn = ordered;
+        ordered = spawn->next;
+        GreenThread *thread = loop->pool;
+        if (thread != NULL) {
+            loop->pool = thread->next;
+            __atomic_sub_fetch(&loop->pooled, 1, __ATOMIC_RELAXED);
+        } else {
+            thread = green_thread_create();
+        }
+        thread->fn = spawn->fn;
+        thread->arg = spawn->arg;
+        thread->finished = false;
+        free(spawn);
+        __atomic_add_fetch(&loop->running, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&loop->started, 1, __ATOMIC_RELAXED);
+        green_make_runnable(loop, thread);
+    }
+}
+void green_loop_run(GreenLoop *loop) {
+    green_loop = loop;
+    struct epoll_event events[GREEN_EVENT_BATCH];
+    for (;;) {
+        while (loop->run_head != NULL) {
+            GreenThread *thread = loop->run_head;
+            loop->run_head = thread->next;
+            if (loop->run_head == NULL) loop->run_tail = NULL;
+            thread->queued = false;
+            green_switch_to(loop, thread);
+        }
+        int timeout = -1;
+        if (loop->timer_count > 0) {
+            long wait = loop->timers[0]->deadline_ms - green_now_ms();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+        int count = epoll_wait(loop->epoll_fd, events, GREEN_EVENT_BATCH, timeout);
+        if (count < 0 && errno != EINTR) {
+            perror("Event loop wait failed");
+            exit(1);
+        }
+        bool spawned = false;
+        for (int i = 0; i < count; i++) {
+            GreenWaiter *waiter = events[i].data.ptr;
+            if (waiter == NULL) {
+                spawned = true;
+                continue;
+            }
+            // EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP equal their poll() bits
+            waiter->thread->fds[waiter->index].revents = events[i].events & 0xffff;
+            green_make_runnable(loop, waiter->thread);
+        }
+        if (loop->timer_count > 0) {
+            long now = green_now_ms();
+            while (loop->timer_count > 0 && loop->timers[0]->deadline_ms <= now) {
+                GreenThread *thread = loop->timers[0];
+                green_timer_remove(loop, thread);
+                green_make_runnable(loop, thread);
+            }
+        }
+        if (spawned) green_start_spawns(loop);
+    }
+}
+// Registers the descriptors with the loop's epoll set for the duration of
+// one wait; each fires at most once
+int green_poll(struct pollfd *fds, int count, int timeout_ms) {
+    GreenLoop *loop = green_loop;
+    if (!green_active() || timeout_ms == 0 || count > GREEN_MAX_POLL_FDS) {
+        return poll(fds, count, timeout_ms);
+    }
+    GreenThread *thread = loop->current;
+    int registered = 0;
+    for (; registered < count; registered++) {
+        struct pollfd *fd = &fds[registered];
+        fd->revents = 0;
+        if (fd->fd < 0) continue;
+        struct epoll_event event = {
+            .events = fd->events | EPOLLONESHOT,
+            .data.ptr = &thread->waiters[registered],
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd->fd, &event) < 0) break;
+    }
+    int ready = -1;
+    if (registered == count) {
+        thread->fds = fds;
+        if (timeout_ms > 0) green_timer_add(loop, thread, green_now_ms() + timeout_ms);
+        green_yield(loop);
+        green_timer_remove(loop, thread);
+        thread->fds = NULL;
+        ready = 0;
+        for (int i = 0; i < count; i++) {
+            if (fds[i].revents != 0) ready++;
+        }
+    }
+    int error = errno;
+    for (int i = 0; i < registered; i++) {
+        if (fds[i].fd >= 0) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+    }
+    errno = error;
+    return ready;
+}
+ssize_t green_recv(int fd, void *buf, size_t len, int flags, int timeout_ms) {
+    if (!green_active()) return recv(fd, buf, len, flags);
+    for (;;) {
+        ssize_t received = recv(fd, buf, len, flags | MSG_DONTWAIT);
+        if (received >= 0 || (flags & MSG_DONTWAIT) || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return received;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = green_poll(&pfd, 1, timeout_ms);
+        if (ready < 0) return -1;
+        if (ready == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+ssize_t green_send(int fd, const void *buf, size_t len, int flags) {
+    if (!green_active()) return send(fd, buf, len, flags);
+    for (;;) {
+        ssize_t sent = send(fd, buf, len, flags | MSG_DONTWAIT);
+        if (sent >= 0 || (flags & MSG_DONTWAIT) || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return sent;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (green_poll(&pfd, 1, -1) < 0) return -1;
+    }
+}
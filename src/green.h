@@ -0,0 +1,43 @@
+#ifndef GREEN_H
+#define GREEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/types.h>
+
+// Green threads: cooperative threads with small pooled stacks, run by an
+// event loop on one OS thread. A green thread runs until it would block on
+// a descriptor; it then yields to the loop, which resumes it once epoll
+// reports the descriptor ready. Code running on a green thread must not
+// hold a lock across green_poll(), green_recv() or green_send().
+
+#define GREEN_STACK_SIZE (64 * 1024)
+#define GREEN_MAX_POLL_FDS 4
+
+typedef struct GreenLoop GreenLoop;
+
+typedef struct {
+    unsigned long running;   // green threads started and not yet finished
+    unsigned long started;
+    unsigned long switches;  // into green threads
+    unsigned long pooled;    // finished threads kept for reuse with their stacks
+} GreenStats;
+
+GreenLoop *green_loop_create();
+// Runs the loop on the calling thread; does not return
+void green_loop_run(GreenLoop *loop);
+// Starts fn(arg) on a green thread of loop. Safe from any thread.
+void green_spawn(GreenLoop *loop, void (*fn)(void *), void *arg);
+void green_stats(GreenLoop *loop, GreenStats *stats);
+// True when called on a green thread
+bool green_active();
+
+// Behave as poll(), recv() and send(), except that on a green thread they
+// yield to the loop instead of blocking. green_recv() gives up after
+// timeout_ms (-1 for never) with EAGAIN, like a socket with SO_RCVTIMEO.
+int green_poll(struct pollfd *fds, int count, int timeout_ms);
+ssize_t green_recv(int fd, void *buf, size_t len, int flags, int timeout_ms);
+ssize_t green_send(int fd, const void *buf, size_t len, int flags);
+
+#endif
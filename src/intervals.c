@@ -0,0 +1,137 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intervals.h"
+#include "region.h"
+
+int compare_starts(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+size_t intervals_find(const uint32_t *starts, size_t count, uint32_t value) {
+    size_t low = 0, high = count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (starts[middle] <= value) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+size_t intervals_next_open(size_t *open, size_t i) {
+    while (open[i] != i) {
+        open[i] = open[open[i]];
+        i = open[i];
+    }
+    return i;
+}
+bool intervals_usable(const ClassifierRule *rule) {
+    return rule->ip_start <= rule->ip_end && rule->port_start <= rule->port_end;
+}
+// Walks each rule's intervals in rule order, counting candidates into
+// counts or, once first is known, placing them. False past the limit.
+bool place_candidates(IntervalIndex *index, const ClassifierRule *rules, int count,
+                      size_t *open, uint32_t *counts) {
+    for (size_t i = 0; i <= index->count; i++) open[i] = i;
+    size_t total = 0;
+    for (int r = 0; r < count; r++) {
+        const ClassifierRule *rule = &rules[r];
+        if (!intervals_usable(rule)) continue;
+        size_t low = intervals_find(index->starts, index->count, rule->ip_start);
+        size_t high = intervals_find(index->starts, index->count, rule->ip_end);
+        bool every_port = rule->port_start == 0 && rule->port_end == 65535;
+        // Intervals closed by a rule matching every port are skipped
+        for (size_t i = intervals_next_open(open, low); i <= high;
+             i = intervals_next_open(open, i + 1)) {
+            if (++total > INTERVALS_MAX_CANDIDATES) return false;
+            if (counts != NULL) {
+                counts[i]++;
+            } else {
+                IntervalCandidate *candidate = &index->candidates[index->first[i + 1]++];
+                candidate->port_start = rule->port_start;
+                candidate->port_end = rule->port_end;
+                candidate->rule = r;
+            }
+            if (every_port) open[i] = i + 1;
+        }
+    }
+    return true;
+}
+void *intervals_alloc(IntervalIndex *index, size_t size, int node) {
+    void *data = region_alloc(&size, node);
+    index->size += size;
+    return data;
+}
+void intervals_free(IntervalIndex *index) {
+    if (index == NULL) return;
+    region_free(index->starts);
+    region_free(index->first);
+    region_free(index->candidates);
+    stree_free(index->tree);
+    learned_free(index->model);
+    free(index);
+}
+uint32_t *intervals_cut(const ClassifierRule *rules, int count, size_t *start_count) {
+    uint32_t *starts = malloc((2 * (size_t)count + 1) * sizeof(uint32_t));
+    size_t total = 0;
+    starts[total++] = 0;
+    for (int r = 0; r < count; r++) {
+        if (!intervals_usable(&rules[r])) continue;
+        starts[total++] = rules[r].ip_start;
+        if (rules[r].ip_end != UINT32_MAX) starts[total++] = rules[r].ip_end + 1;
+    }
+    qsort(starts, total, sizeof(uint32_t), compare_starts);
+    size_t unique = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (unique == 0 || starts[i] != starts[unique - 1]) starts[unique++] = starts[i];
+    }
+    *start_count = unique;
+    return starts;
+}
+IntervalIndex *intervals_build(const ClassifierRule *rules, int count, int node, int search) {
+    size_t unique;
+    uint32_t *starts = intervals_cut(rules, count, &unique);
+    IntervalIndex *index = calloc(1, sizeof(IntervalIndex));
+    index->count = unique;
+    index->starts = intervals_alloc(index, unique * sizeof(uint32_t), node);
+    memcpy(index->starts, starts, unique * sizeof(uint32_t));
+    free(starts);
+    // Counted first, so each interval's candidates are contiguous
+    size_t *open = malloc((unique + 1) * sizeof(size_t));
+    uint32_t *counts = calloc(unique, sizeof(uint32_t));
+    bool ok = place_candidates(index, rules, count, open, counts);
+    if (ok) {
+        index->first = intervals_alloc(index, (unique + 1) * sizeof(uint32_t), node);
+        for (size_t i = 0; i < unique; i++) index->first[i + 1] = index->first[i] + counts[i];
+        index->candidates = intervals_alloc(index, (index->first[unique] + 1) *
+                                            sizeof(IntervalCandidate), node);
+        // Placing advances each first[i + 1] from the start of interval i
+        for (size_t i = unique; i > 0; i--) index->first[i] = index->first[i - 1];
+        place_candidates(index, rules, count, open, NULL);
+        if (search == INTERVALS_LEARNED) {
+            index->model = learned_build(index->starts, unique, node);
+            index->size += index->model->size;
+        } else {
+            index->tree = stree_build(index->starts, unique, node);
+            index->size += index->tree->size;
+        }
+    }
+    free(open);
+    free(counts);
+    if (!ok) {
+        intervals_free(index);
+        return NULL;
+    }
+    return index;
+}
+int intervals_match(const IntervalIndex *index, uint32_t ip, int port) {
+    // starts[0] is 0, so every address has an interval
+    size_t interval = (index->tree != NULL ? stree_rank(index->tree, ip) :
+                       learned_rank(index->model, ip)) - 1;
+    const IntervalCandidate *candidate = &index->candidates[index->first[interval]];
+    const IntervalCandidate *end = &index->candidates[index->first[interval + 1]];
+    for (; candidate < end; candidate++) {
+        if (port >= candidate->port_start && port <= candidate->port_end) return candidate->rule;
+    }
+    return -1;
+}
@@ -0,0 +1,59 @@
+#ifndef INTERVALS_H
+#define INTERVALS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "classifier.h"
+#include "stree.h"
+#include "learned.h"
+
+// Elementary intervals: the rules' address range ends cut the address
+// space into intervals that every rule either covers entirely or misses.
+// Each interval keeps the rules covering it, in rule order, with their
+// port ranges, and stops at the first rule matching every port. A lookup
+// finds the address's interval with a search over the sorted interval
+// starts, by S-tree or learned index, then scans that interval's
+// candidates for the port. A build whose candidate lists would exceed
+// INTERVALS_MAX_CANDIDATES entries in total gives up.
+
+#define INTERVALS_MAX_CANDIDATES (64 * 1024 * 1024)
+
+#define INTERVALS_STREE 0
+#define INTERVALS_LEARNED 1
+
+typedef struct {
+    uint16_t port_start;
+    uint16_t port_end;
+    int32_t rule;
+} IntervalCandidate;
+
+typedef struct {
+    uint32_t *starts;                 // interval starts, sorted, starts[0] == 0
+    uint32_t *first;                  // interval i's candidates are first[i] to first[i + 1]
+    IntervalCandidate *candidates;
+    size_t count;                     // intervals
+    StaticTree *tree;                 // over starts, with INTERVALS_STREE
+    LearnedIndex *model;              // over starts, with INTERVALS_LEARNED
+    size_t size;                      // bytes mapped for the tables
+} IntervalIndex;
+
+// The sorted, distinct interval starts of rules, beginning with 0, in a
+// malloc'd array
+uint32_t *intervals_cut(const ClassifierRule *rules, int count, size_t *start_count);
+// Interval of starts holding value
+size_t intervals_find(const uint32_t *starts, size_t count, uint32_t value);
+// False for rules that match nothing, with an inverted range
+bool intervals_usable(const ClassifierRule *rule);
+// Next slot at or after i still open, where open[j] is j for an open slot
+// and a later slot for a closed one (with path halving)
+size_t intervals_next_open(size_t *open, size_t i);
+
+// Builds the intervals of rules on node, found by search; NULL if they
+// would be too large
+IntervalIndex *intervals_build(const ClassifierRule *rules, int count, int node, int search);
+void intervals_free(IntervalIndex *index);
+// Index of the first rule matching ip and port, or -1
+int intervals_match(const IntervalIndex *index, uint32_t ip, int port);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "learned.h"
+#include "region.h"
+
+// Key i of a level: the keys themselves for level 0, else the first keys
+// of the level below's segments
+uint32_t level_key(const LearnedIndex *index, int level, size_t i) {
+    return level == 0 ? index->keys[i] : index->segments[level - 1][i].key;
+}
+size_t level_count(const LearnedIndex *index, int level) {
+    return level == 0 ? index->count : index->segment_counts[level - 1];
+}
+// Greedy fit: each segment is anchored at its first key and takes keys
+// while some slope keeps every one of them within LEARNED_EPSILON of its
+// position. Returns the number of segments written to segments.
+size_t fit_segments(const LearnedIndex *index, int level, LearnedSegment *segments) {
+    size_t count = level_count(index, level);
+    size_t segment_count = 0;
+    for (size_t first = 0; first < count; ) {
+        uint32_t anchor = level_key(index, level, first);
+        double low = 0, high = 1e300;
+        size_t i = first + 1;
+        for (; i < count; i++) {
+            double dx = (double)(level_key(index, level, i) - anchor);
+            double offset = (double)(i - first);
+            double new_low = (offset - LEARNED_EPSILON) / dx;
+            double new_high = (offset + LEARNED_EPSILON) / dx;
+            if (new_low > high || new_high < low) break;
+            if (new_low > low) low = new_low;
+            if (new_high < high) high = new_high;
+        }
+        LearnedSegment *segment = &segments[segment_count++];
+        segment->key = anchor;
+        segment->intercept = first;
+        segment->slope = i == first + 1 ? 0 : (low + high) / 2;
+        first = i;
+    }
+    return segment_count;
+}
+LearnedIndex *learned_build(const uint32_t *keys, size_t count, int node) {
+    LearnedIndex *index = calloc(1, sizeof(LearnedIndex));
+    index->keys = keys;
+    index->count = count;
+    LearnedSegment *segments = malloc((count + 1) * sizeof(LearnedSegment));
+    // Levels are added until one segment covers the level below
+    do {
+        int level = index->levels;
+        size_t segment_count = fit_segments(index, level, segments);
+        size_t size = segment_count * sizeof(LearnedSegment);
+        index->segments[level] = region_alloc(&size, node);
+        memcpy(index->segments[level], segments, segment_count * sizeof(LearnedSegment));
+        index->segment_counts[level] = segment_count;
+        index->size += size;
+        index->levels++;
+    } while (index->segment_counts[index->levels - 1] > 1 && index->levels < LEARNED_MAX_LEVELS);
+    free(segments);
+    return index;
+}
+void learned_free(LearnedIndex *index) {
+    if (index == NULL) return;
+    for (int level = 0; level < index->levels; level++) region_free(index->segments[level]);
+    free(index);
+}
+// Position of the last key of level not greater than key, searching only
+// around the prediction of the level's segment. A key between two of the
+// segment's keys is predicted between their positions, so within
+// LEARNED_EPSILON + 1; past its last key, the prediction is capped there.
+size_t search_level(const LearnedIndex *index, int level, size_t segment_index, uint32_t key) {
+    const LearnedSegment *segment = &index->segments[level][segment_index];
+    long last = segment_index + 1 < index->segment_counts[level] ?
+                segment[1].intercept - 1 : (long)level_count(index, level) - 1;
+    double predicted = segment->intercept + segment->slope * (double)(key - segment->key);
+    if (predicted > last) predicted = last;
+    long low = (long)predicted - LEARNED_EPSILON - 1;
+    long high = (long)predicted + LEARNED_EPSILON + 2;
+    if (low < segment->intercept) low = segment->intercept;
+    if (high > last + 1) high = last + 1;
+    // Last position in [low, high) with a key not greater than key
+    while (high - low > 1) {
+        long middle = low + (high - low) / 2;
+        if (level_key(index, level, middle) <= key) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+size_t learned_rank(const LearnedIndex *index, uint32_t key) {
+    if (index->count == 0 || key < index->keys[0]) return 0;
+    // The root level has one segment
+    size_t segment = 0;
+    for (int level = index->levels - 1; level > 0; level--) {
+        segment = search_level(index, level, segment, key);
+    }
+    return search_level(index, 0, segment, key) + 1;
+}
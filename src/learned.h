@@ -0,0 +1,40 @@
+#ifndef LEARNED_H
+#define LEARNED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Learned index over a sorted array of distinct keys, after the PGM-index:
+// the keys' positions are fitted by linear segments, each predicting the
+// position of any key in its range to within LEARNED_EPSILON. A search
+// predicts from the segment covering the key, then searches the few keys
+// around the prediction. Segments are found the same way, through levels
+// of segments fitted over the segments' first keys, up to a single root.
+// Regularly spaced keys need few segments, so the model stays small and
+// a search touches a few cache lines per level.
+
+#define LEARNED_EPSILON 32
+#define LEARNED_MAX_LEVELS 8
+
+typedef struct {
+    uint32_t key;       // first key covered
+    int32_t intercept;  // its position
+    double slope;
+} LearnedSegment;
+
+typedef struct {
+    const uint32_t *keys;  // not owned
+    size_t count;
+    LearnedSegment *segments[LEARNED_MAX_LEVELS];  // level 0 fits the keys
+    size_t segment_counts[LEARNED_MAX_LEVELS];
+    int levels;
+    size_t size;  // bytes mapped for segments
+} LearnedIndex;
+
+// Fits count sorted keys, which must outlive the index, on node
+LearnedIndex *learned_build(const uint32_t *keys, size_t count, int node);
+void learned_free(LearnedIndex *index);
+// Number of keys less than or equal to key
+size_t learned_rank(const LearnedIndex *index, uint32_t key);
+
+#endif
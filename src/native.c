@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "native.h"
+#include "intervals.h"
+
+extern char **environ;
+
+// A decision as steps: value applies from start up to the next step's
+// start. Port decisions yield rules, address decisions port decisions.
+typedef struct {
+    uint32_t start;
+    int32_t value;
+} NativeStep;
+
+// Distinct port decisions, interned through an open-addressing table
+typedef struct {
+    NativeStep *steps;
+    size_t step_count;
+    size_t step_capacity;
+    size_t *first;  // decision d is steps first[d] to first[d + 1]
+    size_t count;
+    size_t capacity;
+    int *slots;     // decision ids, -1 when empty
+    size_t slot_mask;
+} NativeDecisions;
+
+size_t native_hash(const NativeStep *steps, size_t count) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ steps[i].start) * 1099511628211ULL;
+        hash = (hash ^ (uint32_t)steps[i].value) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+bool native_same(const NativeDecisions *decisions, int id, const NativeStep *steps,
+                 size_t count) {
+    size_t first = decisions->first[id];
+    return decisions->first[id + 1] - first == count &&
+           memcmp(decisions->steps + first, steps, count * sizeof(NativeStep)) == 0;
+}
+void native_rehash(NativeDecisions *decisions) {
+    free(decisions->slots);
+    decisions->slot_mask = decisions->slot_mask * 2 + 1;
+    decisions->slots = malloc((decisions->slot_mask + 1) * sizeof(int));
+    memset(decisions->slots, -1, (decisions->slot_mask + 1) * sizeof(int));
+    for (size_t id = 0; id < decisions->count; id++) {
+        const NativeStep *steps = decisions->steps + decisions->first[id];
+        size_t slot = native_hash(steps, decisions->first[id + 1] - decisions->first[id]) &
+                      decisions->slot_mask;
+        while (decisions->slots[slot] >= 0) slot = (slot + 1) & decisions->slot_mask;
+        decisions->slots[slot] = id;
+    }
+}
+// Returns the id of the decision made of steps, adding it if new
+int native_intern(NativeDecisions *decisions, const NativeStep *steps, size_t count) {
+    size_t slot = native_hash(steps, count) & decisions->slot_mask;
+    for (; decisions->slots[slot] >= 0; slot = (slot + 1) & decisions->slot_mask) {
+        if (native_same(decisions, decisions->slots[slot], steps, count)) {
+            return decisions->slots[slot];
+        }
+    }
+    if (decisions->step_count + count > decisions->step_capacity) {
+        decisions->step_capacity = (decisions->step_count + count) * 2;
+        decisions->steps = realloc(decisions->steps, decisions->step_capacity * sizeof(NativeStep));
+    }
+    if (decisions->count + 2 > decisions->capacity) {
+        decisions->capacity = (decisions->count + 2) * 2;
+        decisions->first = realloc(decisions->first, decisions->capacity * sizeof(size_t));
+    }
+    int id = decisions->count++;
+    memcpy(decisions->steps + decisions->step_count, steps, count * sizeof(NativeStep));
+    decisions->step_count += count;
+    decisions->first[id + 1] = decisions->step_count;
+    decisions->slots[slot] = id;
+    if (decisions->count * 2 > decisions->slot_mask) native_rehash(decisions);
+    return id;
+}
+int native_compare_ports(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+// The port decision of one interval: at each boundary of its candidates,
+// the first candidate covering the port, merging equal neighbours
+size_t native_port_steps(const IntervalCandidate *candidates, size_t count, uint32_t *bounds,
+                         NativeStep *steps) {
+    size_t bound_count = 0;
+    bounds[bound_count++] = 0;
+    for (size_t c = 0; c < count; c++) {
+        bounds[bound_count++] = candidates[c].port_start;
+        if (candidates[c].port_end < 65535) bounds[bound_count++] = candidates[c].port_end + 1;
+    }
+    qsort(bounds, bound_count, sizeof(uint32_t), native_compare_ports);
+    size_t step_count = 0;
+    for (size_t b = 0; b < bound_count; b++) {
+        if (b > 0 && bounds[b] == bounds[b - 1]) continue;
+        int32_t rule = -1;
+        for (size_t c = 0; c < count && rule < 0; c++) {
+            if (bounds[b] >= candidates[c].port_start && bounds[b] <= candidates[c].port_end) {
+                rule = candidates[c].rule;
+            }
+        }
+        if (step_count == 0 || steps[step_count - 1].value != rule) {
+            steps[step_count++] = (NativeStep){ bounds[b], rule };
+        }
+    }
+    return step_count;
+}
+// Writes a balanced tree of comparisons choosing among steps low to high
+void native_emit_tree(FILE *out, const NativeStep *steps, size_t low, size_t high,
+                      const char *variable, const char *leaf, int depth) {
+    if (low == high) {
+        fprintf(out, "%*s", 4 * depth, "");
+        fprintf(out, leaf, steps[low].value);
+        fprintf(out, "\n");
+        return;
+    }
+    size_t middle = low + (high - low + 1) / 2;
+    fprintf(out, "%*sif (%s < %uu) {\n", 4 * depth, "", variable, steps[middle].start);
+    native_emit_tree(out, steps, low, middle - 1, variable, leaf, depth + 1);
+    fprintf(out, "%*s} else {\n", 4 * depth, "");
+    native_emit_tree(out, steps, middle, high, variable, leaf, depth + 1);
+    fprintf(out, "%*s}\n", 4 * depth, "");
+}
+// Writes the decisions as C; false if they need too many comparisons
+bool native_generate(const IntervalIndex *index, FILE *out) {
+    NativeDecisions decisions = { 0 };
+    decisions.slot_mask = 1023;
+    decisions.slots = malloc((decisions.slot_mask + 1) * sizeof(int));
+    memset(decisions.slots, -1, (decisions.slot_mask + 1) * sizeof(int));
+    decisions.capacity = 2;
+    decisions.first = calloc(decisions.capacity, sizeof(size_t));
+    NativeStep *address_steps = malloc(index->count * sizeof(NativeStep));
+    size_t address_count = 0;
+    size_t longest = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        size_t count = index->first[i + 1] - index->first[i];
+        if (count > longest) longest = count;
+    }
+    uint32_t *bounds = malloc((2 * longest + 1) * sizeof(uint32_t));
+    NativeStep *port_steps = malloc((2 * longest + 1) * sizeof(NativeStep));
+    bool ok = true;
+    for (size_t i = 0; i < index->count && ok; i++) {
+        size_t count = native_port_steps(index->candidates + index->first[i],
+                                         index->first[i + 1] - index->first[i], bounds,
+                                         port_steps);
+        int id = native_intern(&decisions, port_steps, count);
+        if (address_count == 0 || address_steps[address_count - 1].value != id) {
+            address_steps[address_count++] = (NativeStep){ index->starts[i], id };
+        }
+        ok = decisions.step_count + address_count <= NATIVE_MAX_BRANCHES;
+    }
+    if (ok) {
+        fprintf(out, "// Generated by the firewall server: do not edit\n\n");
+        for (size_t d = 0; d < decisions.count; d++) {
+            fprintf(out, "static int port_%zu(int port) {\n", d);
+            native_emit_tree(out, decisions.steps, decisions.first[d],
+                             decisions.first[d + 1] - 1, "port", "return %d;", 1);
+            fprintf(out, "}\n");
+        }
+        fprintf(out, "int fw_native_match(unsigned int ip, int port) {\n");
+        native_emit_tree(out, address_steps, 0, address_count - 1, "ip", "return port_%d(port);",
+                         1);
+        fprintf(out, "}\n");
+    }
+    free(port_steps);
+    free(bounds);
+    free(address_steps);
+    free(decisions.steps);
+    free(decisions.first);
+    free(decisions.slots);
+    return ok;
+}
+// Runs the compiler on source, writing library; false if it failed
+bool native_compile(const char *source, const char *library) {
+    const char *compiler = getenv("CC") != NULL ? getenv("CC") : "cc";
+    char *argv[] = { (char *)compiler, "-O2", "-shared", "-fPIC", "-o", (char *)library,
+                     (char *)source, NULL };
+    pid_t pid;
+    if (posix_spawnp(&pid, compiler, NULL, NULL, argv, environ) != 0) {
+        perror("Failed to run the compiler");
+        return false;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+NativeCode *native_build(const ClassifierRule *rules, int count) {
+    IntervalIndex *index = intervals_build(rules, count, -1, INTERVALS_STREE);
+    if (index == NULL) return NULL;
+    // A private directory, so no other user can swap in the library
+    // between compiling and loading it
+    const char *temporary = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char directory[4096], source[4096 + 16], library[4096 + 16];
+    snprintf(directory, sizeof(directory), "%s/fwnative-XXXXXX", temporary);
+    if (mkdtemp(directory) == NULL) {
+        perror("Failed to create a directory for generated code");
+        intervals_free(index);
+        return NULL;
+    }
+    snprintf(source, sizeof(source), "%s/rules.c", directory);
+    snprintf(library, sizeof(library), "%s/rules.so", directory);
+    FILE *out = fopen(source, "w");
+    bool ok = out != NULL && native_generate(index, out);
+    intervals_free(index);
+    if (out == NULL) perror("Failed to create generated source");
+    ok = out != NULL && fclose(out) == 0 && ok && native_compile(source, library);
+    NativeCode *code = NULL;
+    void *library_handle = ok ? dlopen(library, RTLD_NOW | RTLD_LOCAL) : NULL;
+    if (library_handle != NULL) {
+        code = calloc(1, sizeof(NativeCode));
+        code->library = library_handle;
+        code->match = (int (*)(uint32_t, int))dlsym(library_handle, "fw_native_match");
+        code->references = 1;
+        struct stat st;
+        if (stat(library, &st) == 0) code->size = st.st_size;
+        if (code->match == NULL) {
+            native_free(code);
+            code = NULL;
+        }
+    } else if (ok) {
+        fprintf(stderr, "Failed to load compiled rules: %s\n", dlerror());
+    }
+    // The loaded library stays mapped once its file is gone
+    unlink(source);
+    unlink(library);
+    rmdir(directory);
+    return code;
+}
+NativeCode *native_retain(NativeCode *code) {
+    __atomic_add_fetch(&code->references, 1, __ATOMIC_RELAXED);
+    return code;
+}
+void native_free(NativeCode *code) {
+    if (code == NULL || __atomic_sub_fetch(&code->references, 1, __ATOMIC_ACQ_REL) > 0) return;
+    dlclose(code->library);
+    free(code);
+}
+int native_match(const NativeCode *code, uint32_t ip, int port) {
+    return code->match(ip, port);
+}
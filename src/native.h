@@ -0,0 +1,36 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "classifier.h"
+
+// Rule sets compiled to machine code. The rules' elementary intervals (see
+// intervals.h) become a balanced tree of comparisons on the address, with
+// adjacent intervals that decide alike merged. Each leaf calls a function
+// deciding on the port the same way, written once per distinct decision.
+// The generated C is built into a shared object with the system compiler
+// ($CC, or cc) in a private temporary directory and loaded with dlopen(),
+// so a lookup is a few predictable compares. Compiling takes far longer
+// than building the other engines, so the server does it on a thread of
+// its own. A rule set needing more than NATIVE_MAX_BRANCHES comparisons is
+// not compiled.
+
+#define NATIVE_MAX_BRANCHES (256 * 1024)
+
+typedef struct {
+    void *library;
+    int (*match)(uint32_t ip, int port);
+    int references;
+    size_t size;  // bytes of the compiled library
+} NativeCode;
+
+// Compiles rules; NULL if they are too large or compiling failed
+NativeCode *native_build(const ClassifierRule *rules, int count);
+// Another reference to code, released by native_free()
+NativeCode *native_retain(NativeCode *code);
+void native_free(NativeCode *code);
+// Index of the first rule matching ip and port, or -1
+int native_match(const NativeCode *code, uint32_t ip, int port);
+
+#endif
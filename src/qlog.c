@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include "querylog.h"
+
+#define BUFFER_SIZE 1024
+
+// Reads the query log segments written by `server -q <dir>` and prints each
+// rule's history: the rule, then every accepted query in the order logged.
+
+typedef struct {
+    unsigned long id;
+    char rule[QUERY_LOG_RULE_SIZE];
+} History;
+
+typedef struct {
+    int history;
+    unsigned long sequence;
+    QueryLogRecord record;
+} Query;
+
+History *histories = NULL;
+int history_count = 0;
+int history_capacity = 0;
+// Each rule id's latest history, found by hashing the id; -1 for a free
+// slot. slot_count is a power of two, as slots are found by masking.
+int *history_slots = NULL;
+int history_slot_count = 0;
+int history_id_count = 0;
+Query *queries = NULL;
+unsigned long query_count = 0;
+unsigned long query_capacity = 0;
+
+int find_history_slot(unsigned long id) {
+    int mask = history_slot_count - 1;
+    int slot = (int)((id * 2654435761u) & mask);
+    while (history_slots[slot] >= 0 && histories[history_slots[slot]].id != id) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+// The history queries for id currently belong to. Rules are redefined at
+// the start of every segment; ids restart when a server starts without a
+// snapshot, so only a definition with different text opens a new history.
+int current_history(unsigned long id, const char *rule) {
+    if (history_id_count * 2 >= history_slot_count) {
+        // Keep the table at most half full. Histories are replayed in order,
+        // so each id's slot ends up with its latest.
+        free(history_slots);
+        history_slot_count = history_slot_count > 0 ? history_slot_count * 2 : 256;
+        history_slots = malloc(history_slot_count * sizeof(int));
+        memset(history_slots, -1, history_slot_count * sizeof(int));
+        for (int i = 0; i < history_count; i++) {
+            history_slots[find_history_slot(histories[i].id)] = i;
+        }
+    }
+    int slot = find_history_slot(id);
+    int latest = history_slots[slot];
+    if (latest >= 0 && (rule == NULL || strcmp(histories[latest].rule, rule) == 0)) {
+        return latest;
+    }
+    if (latest < 0) history_id_count++;
+    if (history_count == history_capacity) {
+        history_capacity = history_capacity > 0 ? history_capacity * 2 : 256;
+        histories = realloc(histories, history_capacity * sizeof(History));
+    }
+    histories[history_count].id = id;
+    strncpy(histories[history_count].rule, rule != NULL ? rule : "(unknown rule)",
+            QUERY_LOG_RULE_SIZE - 1);
+    histories[history_count].rule[QUERY_LOG_RULE_SIZE - 1] = '\0';
+    history_slots[slot] = history_count;
+    return history_count++;
+}
+int compare_segments(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+int compare_queries(const void *a, const void *b) {
+    const Query *x = a, *y = b;
+    if (x->history != y->history) return x->history < y->history ? -1 : 1;
+    return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+}
+bool read_segment(const char *path) {
+    FILE *file = fopen(path, "rb");
+    char magic[QUERY_LOG_MAGIC_SIZE];
+    if (file == NULL || fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, QUERY_LOG_MAGIC, QUERY_LOG_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Not a query log segment: %s\n", path);
+        if (file != NULL) fclose(file);
+        return false;
+    }
+    QueryLogRecord record;
+    char rule[QUERY_LOG_RULE_SIZE];
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.type == 'R') {
+            // A segment cut short by a crash ends at the last whole record
+            if (fread(rule, sizeof(rule), 1, file) != 1) break;
+            rule[QUERY_LOG_RULE_SIZE - 1] = '\0';
+            current_history(record.rule_id, rule);
+        } else if (record.type == 'Q') {
+            if (query_count == query_capacity) {
+                query_capacity = query_capacity > 0 ? query_capacity * 2 : 1024;
+                queries = realloc(queries, query_capacity * sizeof(Query));
+                if (queries == NULL) {
+                    perror("Failed to allocate memory for queries");
+                    exit(1);
+                }
+            }
+            queries[query_count].history = current_history(record.rule_id, NULL);
+            queries[query_count].sequence = query_count;
+            queries[query_count++].record = record;
+        } else {
+            fprintf(stderr, "Corrupt record in %s\n", path);
+            break;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <query_log_dir> [rule_id]\n", argv[0]);
+        return 1;
+    }
+    bool filtered = argc == 3;
+    unsigned long wanted = filtered ? strtoul(argv[2], NULL, 10) : 0;
+
+    DIR *dir = opendir(argv[1]);
+    if (dir == NULL) {
+        perror("Failed to open query log directory");
+        return 1;
+    }
+    // Segment names are zero-padded, so name order is write order
+    char **segments = NULL;
+    int segment_count = 0;
+    struct dirent *entry;
+    unsigned long number;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "queries-%lu.log", &number) != 1) continue;
+        segments = realloc(segments, (segment_count + 1) * sizeof(char *));
+        segments[segment_count] = malloc(BUFFER_SIZE);
+        snprintf(segments[segment_count++], BUFFER_SIZE, "%s/%s", argv[1], entry->d_name);
+    }
+    closedir(dir);
+    qsort(segments, segment_count, sizeof(char *), compare_segments);
+    for (int i = 0; i < segment_count; i++) {
+        read_segment(segments[i]);
+        free(segments[i]);
+    }
+    free(segments);
+
+    qsort(queries, query_count, sizeof(Query), compare_queries);
+    unsigned long next = 0;
+    for (int h = 0; h < history_count; h++) {
+        unsigned long first = next;
+        while (next < query_count && queries[next].history == h) next++;
+        if (filtered && histories[h].id != wanted) continue;
+        printf("Rule %lu: %s\n", histories[h].id, histories[h].rule);
+        for (unsigned long q = first; q < next; q++) {
+            QueryLogRecord *record = &queries[q].record;
+            struct in_addr addr = { .s_addr = htonl(record->ip) };
+            char ip[INET_ADDRSTRLEN], when[32];
+            time_t seconds = record->time_ms / 1000;
+            struct tm tm;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+            inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+            printf("  %s.%03lu %s %u\n", when, (unsigned long)(record->time_ms % 1000), ip,
+                   record->port);
+        }
+    }
+    free(queries);
+    free(histories);
+    free(history_slots);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+#include <stdint.h>
+
+// On-disk format of the persistent query log. A log directory holds
+// segments named queries-NNNNNN.log, written in increasing order and never
+// modified once closed. Each segment starts with QUERY_LOG_MAGIC followed by
+// records in host byte order:
+//   'R' a rule definition: the header, then QUERY_LOG_RULE_SIZE bytes of
+//       "<ip_range> <port_range>", NUL-padded. Written before any query
+//       for the rule.
+//   'Q' an accepted query: the header alone.
+// Rule ids restart at 1 when a server starts without a snapshot; a new
+// definition for an id starts a new history for it.
+
+#define QUERY_LOG_MAGIC "FWQLOG1\n"
+#define QUERY_LOG_MAGIC_SIZE 8
+#define QUERY_LOG_RULE_SIZE 80
+#define QUERY_LOG_SEGMENT_FORMAT "%s/queries-%06lu.log"
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t port;
+    uint32_t ip;        // host byte order
+    uint64_t rule_id;
+    uint64_t time_ms;   // milliseconds since the epoch
+} QueryLogRecord;
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rangetree.h"
+#include "intervals.h"
+#include "region.h"
+
+// A node's tables while building, before they are packed into regions
+typedef struct {
+    uint16_t *boundaries;  // port boundaries of the node's own rules
+    uint32_t boundary_count;
+    uint16_t *catalog;     // boundaries merged with every other child entry
+    uint32_t catalog_count;
+    int32_t *first_rule;   // boundary_count + 1 port intervals
+} RangeNode;
+
+int compare_ports(const void *a, const void *b) {
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+// Number of values not greater than value
+uint32_t port_rank(const uint16_t *values, uint32_t count, uint32_t value) {
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (values[middle] <= value) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+// Sorts and removes duplicates in place, returning the new count
+uint32_t sort_ports(uint16_t *values, uint32_t count) {
+    qsort(values, count, sizeof(uint16_t), compare_ports);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (unique == 0 || values[i] != values[unique - 1]) values[unique++] = values[i];
+    }
+    return unique;
+}
+// Rules are taken in order, so each port interval keeps the first rule
+// covering it; intervals already taken are skipped
+void paint_first_rules(RangeNode *node, const ClassifierRule *rules, const int *node_rules,
+                       int rule_count, size_t *open) {
+    uint32_t intervals = node->boundary_count + 1;
+    node->first_rule = malloc(intervals * sizeof(int32_t));
+    for (uint32_t i = 0; i <= intervals; i++) open[i] = i;
+    for (uint32_t i = 0; i < intervals; i++) node->first_rule[i] = -1;
+    for (int j = 0; j < rule_count; j++) {
+        const ClassifierRule *rule = &rules[node_rules[j]];
+        uint32_t low = port_rank(node->boundaries, node->boundary_count, rule->port_start);
+        uint32_t high = port_rank(node->boundaries, node->boundary_count, rule->port_end);
+        for (size_t i = intervals_next_open(open, low); i <= high;
+             i = intervals_next_open(open, i + 1)) {
+            node->first_rule[i] = node_rules[j];
+            open[i] = i + 1;
+        }
+    }
+}
+// Adds every other entry of child to the catalog, which has room
+void sample_child(RangeNode *node, const RangeNode *child) {
+    for (uint32_t i = 1; i < child->catalog_count; i += 2) {
+        node->catalog[node->catalog_count++] = child->catalog[i];
+    }
+}
+// Ranks, for catalog rank r, of catalog entry r - 1 in values; 0 for r = 0
+void rank_catalog(const RangeNode *node, const uint16_t *values, uint32_t count,
+                  uint32_t *ranks) {
+    ranks[0] = 0;
+    uint32_t rank = 0;
+    for (uint32_t r = 1; r <= node->catalog_count; r++) {
+        while (rank < count && values[rank] <= node->catalog[r - 1]) rank++;
+        ranks[r] = rank;
+    }
+}
+void *rangetree_alloc(RangeTree *tree, size_t size, int node) {
+    void *data = region_alloc(&size, node);
+    tree->size += size;
+    return data;
+}
+void rangetree_free(RangeTree *tree) {
+    if (tree == NULL) return;
+    stree_free(tree->leaves);
+    region_free(tree->starts);
+    region_free(tree->catalog_first);
+    region_free(tree->catalog_count);
+    region_free(tree->catalog);
+    region_free(tree->own_rank);
+    region_free(tree->left_rank);
+    region_free(tree->right_rank);
+    region_free(tree->first_rule_at);
+    region_free(tree->first_rule);
+    free(tree);
+}
+// Calls visit for each canonical node of the leaves low to high
+void for_each_cover(const RangeTree *tree, size_t low, size_t high, int rule,
+                    void (*visit)(size_t node, int rule, void *arg), void *arg) {
+    size_t left = low + tree->size_power, right = high + tree->size_power + 1;
+    for (; left < right; left >>= 1, right >>= 1) {
+        if (left & 1) visit(left++, rule, arg);
+        if (right & 1) visit(--right, rule, arg);
+    }
+}
+typedef struct {
+    uint32_t *counts;
+    uint32_t *first;  // filled when placing
+    int *rules;
+} RulePlacement;
+
+void count_cover(size_t node, int rule, void *arg) {
+    ((RulePlacement *)arg)->counts[node]++;
+}
+void place_cover(size_t node, int rule, void *arg) {
+    RulePlacement *placement = arg;
+    placement->rules[placement->first[node] + placement->counts[node]++] = rule;
+}
+RangeTree *rangetree_build(const ClassifierRule *rules, int count, int node) {
+    RangeTree *tree = calloc(1, sizeof(RangeTree));
+    uint32_t *starts = intervals_cut(rules, count, &tree->leaf_count);
+    tree->size_power = 1;
+    while (tree->size_power < tree->leaf_count) {
+        tree->size_power *= 2;
+        tree->depth++;
+    }
+    size_t node_count = 2 * tree->size_power;
+    // Each rule's nodes, in rule order per node
+    RulePlacement placement;
+    placement.counts = calloc(node_count, sizeof(uint32_t));
+    placement.first = calloc(node_count + 1, sizeof(uint32_t));
+    for (int pass = 0; pass < 2; pass++) {
+        for (int r = 0; r < count; r++) {
+            if (!intervals_usable(&rules[r])) continue;
+            size_t low = intervals_find(starts, tree->leaf_count, rules[r].ip_start);
+            size_t high = intervals_find(starts, tree->leaf_count, rules[r].ip_end);
+            for_each_cover(tree, low, high, r, pass == 0 ? count_cover : place_cover, &placement);
+        }
+        if (pass == 1) break;
+        for (size_t v = 0; v < node_count; v++) {
+            placement.first[v + 1] = placement.first[v] + placement.counts[v];
+        }
+        placement.rules = malloc((placement.first[node_count] + 1) * sizeof(int));
+        memset(placement.counts, 0, node_count * sizeof(uint32_t));
+    }
+    // Children before parents, as catalogs take entries from below
+    RangeNode *nodes = calloc(node_count, sizeof(RangeNode));
+    size_t *open = malloc((2 * (size_t)count + 2) * sizeof(size_t));
+    size_t entries = 0;
+    for (size_t v = node_count - 1; v >= 1 && entries <= RANGETREE_MAX_ENTRIES; v--) {
+        RangeNode *current = &nodes[v];
+        const int *node_rules = placement.rules + placement.first[v];
+        int rule_count = placement.counts[v];
+        current->boundaries = malloc((2 * (size_t)rule_count + 1) * sizeof(uint16_t));
+        for (int j = 0; j < rule_count; j++) {
+            const ClassifierRule *rule = &rules[node_rules[j]];
+            current->boundaries[current->boundary_count++] = rule->port_start;
+            if (rule->port_end < 65535) {
+                current->boundaries[current->boundary_count++] = rule->port_end + 1;
+            }
+        }
+        current->boundary_count = sort_ports(current->boundaries, current->boundary_count);
+        paint_first_rules(current, rules, node_rules, rule_count, open);
+        uint32_t room = current->boundary_count + 1;
+        if (v < tree->size_power) {
+            room += nodes[2 * v].catalog_count / 2 + nodes[2 * v + 1].catalog_count / 2;
+        }
+        current->catalog = malloc(room * sizeof(uint16_t));
+        memcpy(current->catalog, current->boundaries, current->boundary_count * sizeof(uint16_t));
+        current->catalog_count = current->boundary_count;
+        if (v < tree->size_power) {
+            sample_child(current, &nodes[2 * v]);
+            sample_child(current, &nodes[2 * v + 1]);
+        }
+        current->catalog_count = sort_ports(current->catalog, current->catalog_count);
+        entries += current->catalog_count + current->boundary_count + 2;
+    }
+    bool ok = entries <= RANGETREE_MAX_ENTRIES;
+    if (ok) {
+        // Packed with one slot more per node than its catalog and intervals
+        size_t catalog_total = 0, interval_total = 0;
+        for (size_t v = 1; v < node_count; v++) {
+            catalog_total += nodes[v].catalog_count;
+            interval_total += nodes[v].boundary_count + 1;
+        }
+        tree->starts = rangetree_alloc(tree, tree->leaf_count * sizeof(uint32_t), node);
+        memcpy(tree->starts, starts, tree->leaf_count * sizeof(uint32_t));
+        tree->leaves = stree_build(tree->starts, tree->leaf_count, node);
+        tree->size += tree->leaves->size;
+        tree->catalog_first = rangetree_alloc(tree, node_count * sizeof(uint32_t), node);
+        tree->catalog_count = rangetree_alloc(tree, node_count * sizeof(uint32_t), node);
+        tree->first_rule_at = rangetree_alloc(tree, node_count * sizeof(uint32_t), node);
+        tree->catalog = rangetree_alloc(tree, (catalog_total + 1) * sizeof(uint16_t), node);
+        size_t rank_size = (catalog_total + node_count) * sizeof(uint32_t);
+        tree->own_rank = rangetree_alloc(tree, rank_size, node);
+        tree->left_rank = rangetree_alloc(tree, rank_size, node);
+        tree->right_rank = rangetree_alloc(tree, rank_size, node);
+        tree->first_rule = rangetree_alloc(tree, interval_total * sizeof(int32_t), node);
+        uint32_t catalog_at = 0, interval_at = 0;
+        for (size_t v = 1; v < node_count; v++) {
+            const RangeNode *current = &nodes[v];
+            tree->catalog_first[v] = catalog_at;
+            tree->catalog_count[v] = current->catalog_count;
+            tree->first_rule_at[v] = interval_at;
+            memcpy(tree->catalog + catalog_at, current->catalog,
+                   current->catalog_count * sizeof(uint16_t));
+            size_t ranks = catalog_at + v;
+            rank_catalog(current, current->boundaries, current->boundary_count,
+                         tree->own_rank + ranks);
+            if (v < tree->size_power) {
+                rank_catalog(current, nodes[2 * v].catalog, nodes[2 * v].catalog_count,
+                             tree->left_rank + ranks);
+                rank_catalog(current, nodes[2 * v + 1].catalog, nodes[2 * v + 1].catalog_count,
+                             tree->right_rank + ranks);
+            }
+            memcpy(tree->first_rule + interval_at, current->first_rule,
+                   (current->boundary_count + 1) * sizeof(int32_t));
+            catalog_at += current->catalog_count;
+            interval_at += current->boundary_count + 1;
+        }
+    }
+    for (size_t v = 1; v < node_count; v++) {
+        free(nodes[v].boundaries);
+        free(nodes[v].catalog);
+        free(nodes[v].first_rule);
+    }
+    free(nodes);
+    free(open);
+    free(placement.counts);
+    free(placement.first);
+    free(placement.rules);
+    free(starts);
+    if (!ok) {
+        rangetree_free(tree);
+        return NULL;
+    }
+    return tree;
+}
+int rangetree_match(const RangeTree *tree, uint32_t ip, int port) {
+    size_t leaf = stree_rank(tree->leaves, ip) - 1;
+    size_t v = 1;
+    uint32_t rank = port_rank(tree->catalog, tree->catalog_count[1], port);
+    int best = -1;
+    for (int level = 0; ; level++) {
+        size_t ranks = tree->catalog_first[v] + v + rank;
+        int rule = tree->first_rule[tree->first_rule_at[v] + tree->own_rank[ranks]];
+        if (rule >= 0 && (best < 0 || rule < best)) best = rule;
+        if (level == tree->depth) break;
+        // The child's rank is off by at most one: between two catalog
+        // entries lies at most one child entry that was not sampled
+        bool right = (leaf >> (tree->depth - level - 1)) & 1;
+        size_t child = 2 * v + right;
+        rank = right ? tree->right_rank[ranks] : tree->left_rank[ranks];
+        if (rank < tree->catalog_count[child] &&
+            tree->catalog[tree->catalog_first[child] + rank] <= port) {
+            rank++;
+        }
+        v = child;
+    }
+    return best;
+}
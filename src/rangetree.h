@@ -0,0 +1,53 @@
+#ifndef RANGETREE_H
+#define RANGETREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "classifier.h"
+#include "stree.h"
+
+// Two-level range tree for stabbing queries over IP x port rectangles, with
+// a worst-case bound whatever the rules look like. The first level is a
+// segment tree over the elementary address intervals: each rule is stored
+// at the O(log n) nodes that exactly cover its address range. Each node's
+// rules cut the port space into intervals, each with the first of those
+// rules covering it. A lookup walks from the root to the address's leaf,
+// taking the first rule found at any node, so it visits log n nodes.
+//
+// Finding the port's interval at every node would cost a binary search per
+// node. With fractional cascading, each node's catalog also holds every
+// other port boundary of its children's catalogs, with each entry's rank
+// in the node's own boundaries and in both children's catalogs. One search
+// at the root then gives the rank at each node below in constant time, so
+// a lookup is O(log n) in all. A build past RANGETREE_MAX_ENTRIES catalog
+// entries gives up.
+
+#define RANGETREE_MAX_ENTRIES (64 * 1024 * 1024)
+
+typedef struct {
+    StaticTree *leaves;     // over the elementary interval starts
+    uint32_t *starts;
+    size_t leaf_count;
+    size_t size_power;      // leaves rounded up to a power of two; node 1 is the root
+    int depth;
+    uint32_t *catalog_first;  // node v's catalog is catalog[catalog_first[v]...]
+    uint32_t *catalog_count;
+    uint16_t *catalog;        // port boundaries, strictly increasing per node
+    // Per catalog rank r (catalog_first[v] + v + r, 0 <= r <= count): the
+    // rank of catalog entry r - 1 in the node's boundaries and children's
+    // catalogs
+    uint32_t *own_rank;
+    uint32_t *left_rank;
+    uint32_t *right_rank;
+    uint32_t *first_rule_at;  // node v's port intervals are first_rule[first_rule_at[v]...]
+    int32_t *first_rule;      // first rule per port interval, -1 for none
+    size_t size;              // bytes mapped for the tables
+} RangeTree;
+
+// Builds the tree for rules on node; NULL if it would be too large
+RangeTree *rangetree_build(const ClassifierRule *rules, int count, int node);
+void rangetree_free(RangeTree *tree);
+// Index of the first rule matching ip and port, or -1
+int rangetree_match(const RangeTree *tree, uint32_t ip, int port);
+
+#endif
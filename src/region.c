@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <numaif.h>
+#include "region.h"
+
+// Every region starts with this header, padded to a cache line so the data
+// after it stays aligned. Regions are listed for free() and for stats.
+typedef struct Region {
+    size_t mapped;
+    size_t usable;
+    bool hugetlb;
+    struct Region *prev;
+    struct Region *next;
+} Region;
+
+#define REGION_HEADER_SIZE 64
+
+bool region_huge = false;
+pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+Region *region_list = NULL;
+
+void region_use_huge_pages(bool enabled) {
+    region_huge = enabled;
+}
+bool region_huge_pages() {
+    return region_huge;
+}
+// Transparent huge pages only back 2 MB-aligned ranges, so map one huge
+// page extra and trim the ends
+void *region_map_aligned(size_t length) {
+    char *mapping = mmap(NULL, length + REGION_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)mapping + REGION_HUGE_PAGE_SIZE - 1) &
+                             ~(uintptr_t)(REGION_HUGE_PAGE_SIZE - 1));
+    if (aligned > mapping) munmap(mapping, aligned - mapping);
+    munmap(aligned + length, mapping + REGION_HUGE_PAGE_SIZE - aligned);
+    // Fails harmlessly when transparent huge pages are disabled
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+void *region_alloc(size_t *size, int node) {
+    bool huge = region_huge && *size >= REGION_HUGE_MIN_SIZE;
+    size_t page = huge ? REGION_HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (*size + REGION_HEADER_SIZE + page - 1) / page * page;
+    bool hugetlb = false;
+    void *mapping = MAP_FAILED;
+    if (huge) {
+        mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        hugetlb = mapping != MAP_FAILED;
+        if (!hugetlb) {
+            mapping = region_map_aligned(length);
+            if (mapping == NULL) mapping = MAP_FAILED;
+        }
+    } else {
+        mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map memory region");
+        exit(1);
+    }
+    if (node >= 0) {
+        unsigned long mask[16] = {0};
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, mapping, length, MPOL_PREFERRED, mask,
+                    8 * sizeof(mask) + 1, 0) != 0) {
+            perror("Failed to place memory region");
+        }
+    }
+    Region *region = mapping;
+    region->mapped = length;
+    region->usable = length - REGION_HEADER_SIZE;
+    region->hugetlb = hugetlb;
+    pthread_mutex_lock(&region_lock);
+    region->prev = NULL;
+    region->next = region_list;
+    if (region_list != NULL) region_list->prev = region;
+    region_list = region;
+    pthread_mutex_unlock(&region_lock);
+    *size = region->usable;
+    return (char *)mapping + REGION_HEADER_SIZE;
+}
+void *region_realloc(void *data, size_t *size, int node) {
+    void *moved = region_alloc(size, node);
+    if (data != NULL) {
+        Region *region = (Region *)((char *)data - REGION_HEADER_SIZE);
+        memcpy(moved, data, region->usable < *size ? region->usable : *size);
+        region_free(data);
+    }
+    return moved;
+}
+void region_free(void *data) {
+    if (data == NULL) return;
+    Region *region = (Region *)((char *)data - REGION_HEADER_SIZE);
+    pthread_mutex_lock(&region_lock);
+    if (region->prev != NULL) region->prev->next = region->next;
+    else region_list = region->next;
+    if (region->next != NULL) region->next->prev = region->prev;
+    pthread_mutex_unlock(&region_lock);
+    munmap(region, region->mapped);
+}
+// Transparent huge page backing is only visible per mapping in smaps, so
+// sum AnonHugePages over the mappings that start inside a region
+void region_stats(RegionStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&region_lock);
+    for (Region *region = region_list; region != NULL; region = region->next) {
+        stats->regions++;
+        stats->mapped += region->mapped;
+        if (region->hugetlb) stats->hugetlb += region->mapped;
+    }
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps != NULL) {
+        char line[512];
+        bool ours = false;
+        unsigned long start, end, kb;
+        while (fgets(line, sizeof(line), smaps) != NULL) {
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                ours = false;
+                for (Region *region = region_list; region != NULL && !ours; region = region->next) {
+                    uintptr_t first = (uintptr_t)region;
+                    ours = !region->hugetlb && start >= first && start < first + region->mapped;
+                }
+            } else if (ours && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+                stats->transparent += kb * 1024;
+            }
+        }
+        fclose(smaps);
+    }
+    pthread_mutex_unlock(&region_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Page-backed memory for the server's large tables: the rule table,
+// classifier tables and query log buffers. Each region is a mapping of its
+// own, optionally bound to a NUMA node. With huge pages enabled, regions of
+// at least REGION_HUGE_MIN_SIZE are rounded to 2 MB and taken from the
+// hugetlb pool (MAP_HUGETLB) when it has room, or else mapped 2 MB-aligned
+// and marked for transparent huge pages. Smaller regions stay on regular
+// pages, so tiny tables do not each take a huge page.
+
+#define REGION_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define REGION_HUGE_MIN_SIZE (1024 * 1024)
+
+typedef struct {
+    size_t regions;
+    size_t mapped;     // bytes mapped for regions
+    size_t hugetlb;    // of which from the hugetlb pool
+    size_t transparent;  // of which currently backed by transparent huge pages
+} RegionStats;
+
+// Affects regions allocated afterwards
+void region_use_huge_pages(bool enabled);
+bool region_huge_pages();
+
+// Allocates at least *size zeroed bytes on node (-1 for no placement) and
+// sets *size to the usable size, which may be larger
+void *region_alloc(size_t *size, int node);
+// Moves data into a region of at least *size bytes, keeping its contents;
+// data may be NULL
+void *region_realloc(void *data, size_t *size, int node);
+void region_free(void *data);
+void region_stats(RegionStats *stats);
+
+#endif
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfc.h"
+#include "region.h"
+
+#define RFC_CHUNK_VALUES 65536
+// Bitmaps of equivalence classes are only kept while building
+#define RFC_MAX_CLASS_BYTES (256 * 1024 * 1024)
+
+// Equivalence classes as the distinct bitmaps of matching items, interned
+// through an open-addressing hash table
+typedef struct {
+    int words;
+    uint64_t *bits;  // count bitmaps of words each
+    int count;
+    int capacity;
+    int *slots;      // class ids, -1 when empty
+    size_t slot_mask;
+} ClassSet;
+
+typedef struct {
+    uint32_t position;
+    int item;
+    bool starts;
+} RfcEvent;
+
+void class_set_init(ClassSet *set, int words) {
+    memset(set, 0, sizeof(*set));
+    set->words = words;
+    set->slot_mask = 1023;
+    set->slots = malloc((set->slot_mask + 1) * sizeof(int));
+    memset(set->slots, -1, (set->slot_mask + 1) * sizeof(int));
+}
+void class_set_free(ClassSet *set) {
+    free(set->bits);
+    free(set->slots);
+}
+size_t class_hash(const uint64_t *bitmap, int words) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < words; i++) {
+        hash = (hash ^ bitmap[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+// Returns the class of bitmap, adding it if new, or -1 past the size limit
+int class_intern(ClassSet *set, const uint64_t *bitmap) {
+    size_t bytes = set->words * sizeof(uint64_t);
+    size_t slot = class_hash(bitmap, set->words) & set->slot_mask;
+    for (; set->slots[slot] >= 0; slot = (slot + 1) & set->slot_mask) {
+        if (memcmp(set->bits + (size_t)set->slots[slot] * set->words, bitmap, bytes) == 0) {
+            return set->slots[slot];
+        }
+    }
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity > 0 ? set->capacity * 2 : 64;
+        if ((size_t)set->capacity * bytes > RFC_MAX_CLASS_BYTES) return -1;
+        set->bits = realloc(set->bits, (size_t)set->capacity * bytes);
+        if (set->bits == NULL) {
+            perror("Failed to allocate memory for classes");
+            exit(1);
+        }
+    }
+    int id = set->count++;
+    memcpy(set->bits + (size_t)id * set->words, bitmap, bytes);
+    set->slots[slot] = id;
+    if ((size_t)set->count * 2 > set->slot_mask) {
+        // Rehash at half load
+        free(set->slots);
+        set->slot_mask = set->slot_mask * 2 + 1;
+        set->slots = malloc((set->slot_mask + 1) * sizeof(int));
+        memset(set->slots, -1, (set->slot_mask + 1) * sizeof(int));
+        for (int i = 0; i < set->count; i++) {
+            size_t s = class_hash(set->bits + (size_t)i * set->words, set->words) & set->slot_mask;
+            while (set->slots[s] >= 0) s = (s + 1) & set->slot_mask;
+            set->slots[s] = i;
+        }
+    }
+    return id;
+}
+int compare_events(const void *a, const void *b) {
+    const RfcEvent *x = a, *y = b;
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+// Phase 0: sweeps the chunk's values, where the set of items whose
+// [first, last] range covers a value changes only at range ends
+bool rfc_phase0(const uint32_t *first, const uint32_t *last, int count, ClassSet *set,
+                uint32_t *table) {
+    RfcEvent *events = malloc((2 * (size_t)count + 1) * sizeof(RfcEvent));
+    int event_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (first[i] > last[i]) continue;
+        events[event_count++] = (RfcEvent){ first[i], i, true };
+        events[event_count++] = (RfcEvent){ last[i] + 1, i, false };
+    }
+    qsort(events, event_count, sizeof(RfcEvent), compare_events);
+    uint64_t *current = calloc(set->words, sizeof(uint64_t));
+    bool ok = true;
+    int e = 0;
+    for (uint32_t value = 0; value < RFC_CHUNK_VALUES && ok; ) {
+        for (; e < event_count && events[e].position == value; e++) {
+            uint64_t bit = 1ULL << (events[e].item % 64);
+            if (events[e].starts) current[events[e].item / 64] |= bit;
+            else current[events[e].item / 64] &= ~bit;
+        }
+        uint32_t next = e < event_count && events[e].position < RFC_CHUNK_VALUES ?
+                        events[e].position : RFC_CHUNK_VALUES;
+        int id = class_intern(set, current);
+        ok = id >= 0;
+        for (; value < next; value++) table[value] = id;
+    }
+    free(current);
+    free(events);
+    return ok;
+}
+uint32_t *rfc_alloc_table(RfcTable *table, size_t entries, int node) {
+    size_t size = entries * sizeof(uint32_t);
+    uint32_t *data = region_alloc(&size, node);
+    table->size += size;
+    return data;
+}
+void rfc_free(RfcTable *table) {
+    if (table == NULL) return;
+    for (int i = 0; i < 3; i++) region_free(table->chunks[i]);
+    region_free(table->address);
+    region_free(table->result);
+    free(table);
+}
+RfcTable *rfc_build(const ClassifierRule *rules, int count, int node) {
+    // An address range is cut at 64K boundaries into at most three boxes,
+    // each a range of high halves by a range of low halves
+    int pieces = 0;
+    uint32_t *high_first = malloc(3 * (size_t)count * sizeof(uint32_t) + 1);
+    uint32_t *high_last = malloc(3 * (size_t)count * sizeof(uint32_t) + 1);
+    uint32_t *low_first = malloc(3 * (size_t)count * sizeof(uint32_t) + 1);
+    uint32_t *low_last = malloc(3 * (size_t)count * sizeof(uint32_t) + 1);
+    int *rule_of = malloc(3 * (size_t)count * sizeof(int) + 1);
+    uint32_t *port_first = malloc((size_t)count * sizeof(uint32_t) + 1);
+    uint32_t *port_last = malloc((size_t)count * sizeof(uint32_t) + 1);
+    for (int i = 0; i < count; i++) {
+        const ClassifierRule *rule = &rules[i];
+        port_first[i] = rule->port_start;
+        port_last[i] = rule->port_end;
+        if (rule->ip_start > rule->ip_end) continue;
+        uint32_t hs = rule->ip_start >> 16, he = rule->ip_end >> 16;
+        uint32_t ls = rule->ip_start & 0xffff, le = rule->ip_end & 0xffff;
+        uint32_t boxes[3][4] = {
+            { hs, hs, ls, hs == he ? le : 0xffff },
+            { hs + 1, he - 1, 0, 0xffff },
+            { he, he, 0, le },
+        };
+        int box_count = hs == he ? 1 : 3;
+        for (int b = 0; b < box_count; b++) {
+            if (b == 1 && he - hs < 2) continue;
+            high_first[pieces] = boxes[b][0];
+            high_last[pieces] = boxes[b][1];
+            low_first[pieces] = boxes[b][2];
+            low_last[pieces] = boxes[b][3];
+            rule_of[pieces++] = i;
+        }
+    }
+    int piece_words = pieces / 64 + 1, rule_words = count / 64 + 1;
+    ClassSet high, low, address, port;
+    class_set_init(&high, piece_words);
+    class_set_init(&low, piece_words);
+    class_set_init(&address, rule_words);
+    class_set_init(&port, rule_words);
+    RfcTable *table = calloc(1, sizeof(RfcTable));
+    uint64_t *rule_bits = malloc(rule_words * sizeof(uint64_t));
+    for (int i = 0; i < 3; i++) table->chunks[i] = rfc_alloc_table(table, RFC_CHUNK_VALUES, node);
+    bool ok = rfc_phase0(high_first, high_last, pieces, &high, table->chunks[0]) &&
+              rfc_phase0(low_first, low_last, pieces, &low, table->chunks[1]) &&
+              rfc_phase0(port_first, port_last, count, &port, table->chunks[2]) &&
+              (size_t)high.count * low.count <= RFC_MAX_ENTRIES &&
+              (size_t)high.count * low.count * piece_words <= RFC_MAX_WORK;
+    // Phase 1: the pieces in both halves' classes, reduced to their rules
+    if (ok) table->address = rfc_alloc_table(table, (size_t)high.count * low.count, node);
+    for (int h = 0; ok && h < high.count; h++) {
+        const uint64_t *high_bits = high.bits + (size_t)h * piece_words;
+        for (int l = 0; ok && l < low.count; l++) {
+            const uint64_t *low_bits = low.bits + (size_t)l * piece_words;
+            memset(rule_bits, 0, rule_words * sizeof(uint64_t));
+            for (int w = 0; w < piece_words; w++) {
+                for (uint64_t both = high_bits[w] & low_bits[w]; both != 0; both &= both - 1) {
+                    int rule = rule_of[w * 64 + __builtin_ctzll(both)];
+                    rule_bits[rule / 64] |= 1ULL << (rule % 64);
+                }
+            }
+            int id = class_intern(&address, rule_bits);
+            ok = id >= 0;
+            table->address[(size_t)h * low.count + l] = id;
+        }
+    }
+    ok = ok && (size_t)address.count * port.count <= RFC_MAX_ENTRIES &&
+         (size_t)address.count * port.count * rule_words <= RFC_MAX_WORK;
+    // Phase 2: the lowest rule in both classes
+    if (ok) {
+        table->result = (int32_t *)rfc_alloc_table(table, (size_t)address.count * port.count, node);
+        table->low_classes = low.count;
+        table->port_classes = port.count;
+    }
+    for (int a = 0; ok && a < address.count; a++) {
+        const uint64_t *address_bits = address.bits + (size_t)a * rule_words;
+        for (int p = 0; p < port.count; p++) {
+            const uint64_t *port_bits = port.bits + (size_t)p * rule_words;
+            int first = -1;
+            for (int w = 0; w < rule_words && first < 0; w++) {
+                uint64_t both = address_bits[w] & port_bits[w];
+                if (both != 0) first = w * 64 + __builtin_ctzll(both);
+            }
+            table->result[(size_t)a * port.count + p] = first;
+        }
+    }
+    free(rule_bits);
+    class_set_free(&high);
+    class_set_free(&low);
+    class_set_free(&address);
+    class_set_free(&port);
+    free(high_first);
+    free(high_last);
+    free(low_first);
+    free(low_last);
+    free(rule_of);
+    free(port_first);
+    free(port_last);
+    if (!ok) {
+        rfc_free(table);
+        return NULL;
+    }
+    return table;
+}
+int rfc_match(const RfcTable *table, uint32_t ip, int port) {
+    uint32_t high = table->chunks[0][ip >> 16];
+    uint32_t low = table->chunks[1][ip & 0xffff];
+    uint32_t address = table->address[(size_t)high * table->low_classes + low];
+    return table->result[(size_t)address * table->port_classes + table->chunks[2][port]];
+}
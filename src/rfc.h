@@ -0,0 +1,35 @@
+#ifndef RFC_H
+#define RFC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "classifier.h"
+
+// Recursive Flow Classification: a lookup is five table reads whatever the
+// number of rules. Phase 0 maps the address's high and low 16 bits and the
+// port to equivalence classes: values matched by the same set of rules share
+// a class. Phase 1 combines the two address classes into an address class,
+// and phase 2 combines that with the port class into the first matching
+// rule. Tables grow with the product of class counts, and filling one costs
+// a bitmap AND per entry, so a build that would exceed RFC_MAX_ENTRIES
+// entries or RFC_MAX_WORK bitmap words in a table gives up.
+
+#define RFC_MAX_ENTRIES (32 * 1024 * 1024)
+#define RFC_MAX_WORK (1024UL * 1024 * 1024)
+
+typedef struct {
+    uint32_t *chunks[3];  // phase 0: address high half, address low half, port
+    uint32_t *address;    // phase 1: high class * low_classes + low class
+    int32_t *result;      // phase 2: address class * port_classes + port class
+    uint32_t low_classes;
+    uint32_t port_classes;
+    size_t size;          // bytes mapped for the tables
+} RfcTable;
+
+// Builds tables for rules on node; NULL if they would be too large
+RfcTable *rfc_build(const ClassifierRule *rules, int count, int node);
+void rfc_free(RfcTable *table);
+// Index of the first rule matching ip and port, or -1
+int rfc_match(const RfcTable *table, uint32_t ip, int port);
+
+#endif
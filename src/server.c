@@ -1,25 +1,113 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sched.h>
+#include "fwclient.h"
+#include "querylog.h"
+#include "classifier.h"
+#include "region.h"
+#include "green.h"
 
 #define MAX_REQUESTS 100
 #define INITIAL_CAPACITY 100
 #define BUFFER_SIZE 1024
 #define IP_RANGE_SIZE 64  
 #define PORT_RANGE_SIZE 16 
+#define CONN_BUFFER_SIZE (16 * BUFFER_SIZE)
+#define CONN_IDLE_TIMEOUT 10  // seconds, for connections that have not subscribed
+#define ONE_SHOT_GRACE_MS 20
+#define DATAGRAM_BATCH 64
+#define MUTATION_LOG_SIZE 4096
+#define LEADER_TIMEOUT_MS 5000
+#define HIT_REPORT_INTERVAL_US 50000
+#define HIT_REPORT_LINE_SIZE 960
+#define MAX_PENDING_HITS (1024 * 1024)
+#define MAX_SHARDS 64
+#define SHARD_TIMEOUT_MS 5000
+#define ROUTE_BATCH 256
+#define DRAIN_TIMEOUT_S 30
+#define SNAPSHOT_BUFFER_SIZE (64 * 1024)
+#define QUERY_LOG_INITIAL_BUFFER (64 * 1024)
+#define QUERY_LOG_MAX_BUFFER (64 * 1024 * 1024)
+#define QUERY_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define QUERY_LOG_FLUSH_INTERVAL_US 100000
+#define QUERY_LOG_MAX_SPARES 64
+#define MAX_NODES 64
+#define BUSY_POLL_MIN_SPIN_NS 1000
+#define BUSY_POLL_MAX_SPIN_NS 200000
+#define BUSY_POLL_PERIOD_NS 100000000L
+#define MAX_IDLE_WORKERS 64
+#define MAX_LINGERING 256
+#define LINGER_TIMEOUT_S 10
+#define CORE_QUEUE_SIZE 1024
+#define MAX_LOCK_STRIPES 4096
+#define MAX_POOL_THREADS 1024
+#define POOL_DEQUE_SIZE 1024
+#define POOL_STACK_SIZE (256 * 1024)
+#define MAX_GREEN_LOOPS 256
+#define INLINE_DECLINED 0
+#define INLINE_ANSWERED 1
+#define INLINE_CLOSED 2
 
 pthread_mutex_t lock;
 void process_request(const char *request, char *response);
-void handle_network_mode(int port);
-void *handle_client(void *socket_desc);
+void handle_network_mode(int port, bool datagrams, int server_fd, int datagram_fd);
+void start_follower(const char *leader);
+void start_router(const char *shards);
+void take_over(const char *path, int *server_fd, int *datagram_fd);
+bool reload_rules_file();
+void load_snapshot_file();
+void start_query_log();
+void configure_affinity(const char *list, bool replicate);
+void start_pool();
+void start_green_loops();
+void start_core_replicas();
+void start_lock_stripes();
+void write_lock_rules();
+void write_unlock_rules();
+void sync_cores();
+void rebuild_classifiers();
+void start_classifier_builder();
+bool answer_unlocked(const char *request, char *response);
+const char *strip_deadline(const char *request, bool *expired);
+long peek_deadline(int sock);
+void lock_cores();
+void unlock_cores();
+void flush_query_logs();
+void log_query(unsigned long rule_id, const char *ip, int port);
+void log_rule(unsigned long id, const char *ip_range, const char *port_range);
+void *watch_rules_file(void *arg);
+void *handle_client(void *arg);
+void end_connection();
+bool send_all(int sock, const char *data, size_t len);
+void *handle_datagrams(void *socket_desc);
 
 typedef struct {
+    unsigned long id;
     char ip_range[IP_RANGE_SIZE];
     char port_range[PORT_RANGE_SIZE];
     struct {
@@ -30,68 +118,529 @@ typedef struct {
     int query_capacity;
 } FirewallRule;
 
+void record_rule_query(FirewallRule *rule, const char *ip, int port);
+
+// Per-connection state for the pipelined protocol: requests are
+// newline-terminated, responses are NUL-terminated. Frames pushed by the
+// server on its own initiative start with '!'.
+typedef struct ClientConnection {
+    int sock;
+    char in[CONN_BUFFER_SIZE];
+    size_t in_len;
+    bool discarding;
+    char out[CONN_BUFFER_SIZE];
+    size_t out_len;
+    // Subscribers get pushes queued by other threads and written by their
+    // own handler, which is woken through wake_fd. Catch-up frames for a
+    // new watch are larger than the push buffer and go out via backlog.
+    bool subscribed;
+    bool wants_invalidations;
+    bool wants_mutations;
+    char *backlog;
+    size_t backlog_len;
+    int wake_fd;
+    pthread_mutex_t push_lock;
+    char *pushes;   // allocated on subscribing, growing as needed
+    char *sending;  // swapped with pushes to be written out
+    size_t push_capacity;
+    size_t sending_capacity;
+    size_t push_len;
+    size_t push_frames;
+    bool push_overflow;
+    struct ClientConnection *next_subscriber;
+} ClientConnection;
+
+// One rule-set change, as replayed to watchers catching up
+typedef struct {
+    unsigned long version;
+    char op;
+    unsigned long id;
+    char ip_range[IP_RANGE_SIZE];
+    char port_range[PORT_RANGE_SIZE];
+} Mutation;
+
 FirewallRule *rules;
 int rule_count = 0;
 int rule_capacity = INITIAL_CAPACITY;
 
+// Bumped on every rule-set change; guarded by lock like the rules themselves.
+// The last MUTATION_LOG_SIZE changes are kept, indexed by version.
+unsigned long rule_version = 0;
+unsigned long next_rule_id = 1;
+Mutation mutation_log[MUTATION_LOG_SIZE];
+unsigned long log_floor = 0;  // versions at or below this cannot be replayed
+ClientConnection *subscribers = NULL;
+
+// Follower mode: rules mirror the leader's mutation stream, writes and
+// listings go to the leader, and accepted checks are reported back to it
+FwConnection *leader_watch = NULL;
+FwPool *leader_pool = NULL;
+pthread_cond_t mutation_applied = PTHREAD_COND_INITIALIZER;
+unsigned long snapshot_remaining = 0;
+char *pending_hits = NULL;
+size_t pending_hits_len = 0;
+unsigned long dropped_hits = 0;
+
+// Router mode: the IPv4 space is split into equal contiguous ranges, one per
+// shard. Rules are kept here for validation and listing, and installed on
+// every shard they overlap, cut at shard boundaries. Two rules can cut to the
+// same piece, so pieces installed on shards are reference counted.
+typedef struct {
+    int shard;
+    char ip_range[IP_RANGE_SIZE];
+    char port_range[PORT_RANGE_SIZE];
+    int refs;
+} ShardRule;
+
+FwPool *shard_pools[MAX_SHARDS];
+int shard_count = 0;
+ShardRule *shard_rules = NULL;
+int shard_rule_count = 0;
+int shard_rule_capacity = 0;
+pthread_mutex_t route_write_lock = PTHREAD_MUTEX_INITIALIZER;  // taken before lock
+
+// Background snapshots: a forked child writes the state it inherited to
+// snapshot_path while this process keeps serving. The child reports
+// progress through a page shared with the parent.
+typedef struct {
+    volatile int rules_written;
+    volatile int rule_total;
+    volatile long bytes;
+} SnapshotProgress;
+
+const char *snapshot_path = NULL;
+SnapshotProgress *snapshot_progress = NULL;
+pid_t snapshot_pid = 0;
+struct timespec snapshot_started;
+unsigned long snapshot_version = 0;
+unsigned long snapshots_completed = 0;
+unsigned long snapshots_failed = 0;
+long last_fork_us = 0;
+long last_snapshot_ms = 0;
+long last_snapshot_bytes = 0;
+
+// Restarts: a server started with a handoff path gives its listening
+// sockets and state to a successor that connects there, then drains
+const char *handoff_path = NULL;
+int active_connections = 0;
+pthread_cond_t connections_drained = PTHREAD_COND_INITIALIZER;
+// Set while the snapshot goes to a successor: writes wait for the outcome
+// and accepted checks are queued as hits, as on a follower
+bool handing_off = false;
+pthread_cond_t handoff_finished = PTHREAD_COND_INITIALIZER;
+
+// Rules file: the rule set is replaced by the file's contents at start,
+// on SIGHUP and whenever the file is rewritten
+const char *rules_path = NULL;
+
+// Query log persistence: accepted queries are appended as binary records
+// to a buffer owned by the recording thread, and a flusher thread moves all
+// buffers to segment files in query_log_dir, with one fdatasync per round
+typedef struct QueryLogBuffer {
+    pthread_mutex_t lock;
+    char *data;
+    size_t len;
+    size_t capacity;
+    unsigned long dropped;
+    bool orphaned;  // the owning thread has exited
+    struct QueryLogBuffer *next;
+} QueryLogBuffer;
+
+const char *query_log_dir = NULL;
+pthread_key_t query_log_key;
+pthread_mutex_t query_log_lock = PTHREAD_MUTEX_INITIALIZER;  // list and counters
+QueryLogBuffer *query_log_buffers = NULL;
+QueryLogBuffer query_log_rules = { .lock = PTHREAD_MUTEX_INITIALIZER };  // definitions
+int query_log_fd = -1;
+unsigned long query_log_segment = 0;
+size_t query_log_segment_size = 0;
+unsigned long query_log_records = 0;
+unsigned long query_log_dropped = 0;
+long query_log_flush_us = 0;
+// Flushed buffer memory kept for reuse, so steady logging does not map and
+// unmap a region per buffer every round. Each spare's first bytes link it.
+typedef struct QueryLogSpare {
+    struct QueryLogSpare *next;
+    size_t capacity;
+} QueryLogSpare;
+pthread_mutex_t query_log_spare_lock = PTHREAD_MUTEX_INITIALIZER;
+QueryLogSpare *query_log_spares = NULL;
+int query_log_spare_count = 0;
+
+// Checks are answered from classifier tables mirroring rules[]: one, or
+// with -n one per NUMA node of the worker CPUs, each read only by threads
+// on that node. All of them are updated together under lock.
+Classifier *classifiers[MAX_NODES];
+int classifier_count = 0;
+// Index builds wanted (see run_classifier_builder); guarded by lock
+bool build_requested = false;
+pthread_cond_t build_wake = PTHREAD_COND_INITIALIZER;
+__thread int thread_replica = 0;
+int worker_cpus[CPU_SETSIZE];
+int worker_cpu_count = 0;
+int next_worker_cpu = 0;  // taken atomically: pool threads start subscriber threads too
+int cpu_replica[CPU_SETSIZE];
+
+// Shared-nothing mode (-P): every worker CPU owns a replica of the rules,
+// its own classifier and the queries accepted on it, so checks take no
+// shared lock and touch no shared lines. Rule changes, made under lock as
+// ever, are queued to each replica on a single-producer single-consumer
+// ring and applied by whichever thread next holds the replica's lock; a
+// change is acknowledged only once every replica has applied it.
+typedef struct {
+    char op;  // 'A' append, 'D' delete index, 'X' rebuild, 'K' keep index, 'F' rebuilt
+    int index;
+    unsigned long id;
+    ClassifierRule rule;
+} CoreMutation;
+
+typedef struct {
+    pthread_mutex_t lock;  // threads on this CPU, and writers catching it up
+    int node;
+    Classifier *classifier;
+    FirewallRule *rules;  // id and queries only, in rule order
+    int rule_count;
+    int rule_capacity;
+    FirewallRule *previous;  // rules being carried over by a rebuild
+    int previous_count;
+    unsigned long applied;  // guarded by lock
+    unsigned long head __attribute__((aligned(64)));  // consumer
+    unsigned long tail __attribute__((aligned(64)));  // producer
+    CoreMutation queue[CORE_QUEUE_SIZE];
+} CoreReplica;
+
+bool shared_nothing = false;
+CoreReplica *core_replicas[CPU_SETSIZE];
+__thread CoreReplica *thread_core = NULL;
+CoreReplica *core_list[CPU_SETSIZE];
+int core_count = 0;
+unsigned long core_sequence = 0;  // mutations queued so far; guarded by lock
+
+void queue_core_mutation(const CoreMutation *m);
+
+// Striped locking (-k): checks take rule_set_lock for reading and the
+// stripe of the matched rule's id to record the query, so checks hitting
+// different rules run in parallel. Rule-set changes still run under lock
+// and take rule_set_lock for writing; query histories are read under lock
+// and the rule's stripe.
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long acquired;   // guarded by lock
+    unsigned long contended;  // acquisitions that had to wait
+} __attribute__((aligned(64))) LockStripe;
+
+int lock_stripes = 0;
+LockStripe *stripes = NULL;
+pthread_rwlock_t rule_set_lock;
+unsigned long rule_set_exclusive = 0;  // write acquisitions; guarded by lock
+
+// Busy-poll mode (-b): before blocking, threads spin on what they are about
+// to wait for, for a window that adapts to how soon work has been arriving.
+// Spinning is capped at busy_poll_budget percent of each thread's time.
+// Connection threads then wait for another connection instead of exiting.
+typedef struct {
+    long window_ns;
+    long spun_ns;  // in the current accounting period
+    struct timespec period_start;
+} SpinState;
+
+// A connection handed to a thread. It is pipelined if a request was
+// already answered on it, so its next data cannot be a one-shot request.
+typedef struct {
+    int sock;
+    bool pipelined;
+    long deadline_ms;  // of its first request, 0 if none was seen
+} NewConnection;
+
+typedef struct IdleWorker {
+    int sock;  // handed over by the accept thread, -1 until then
+    bool pipelined;
+    pthread_cond_t wake;
+    struct IdleWorker *next;
+} IdleWorker;
+
+int busy_poll_budget = 0;  // percent, 0 when off
+__thread SpinState spin_state;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+IdleWorker *idle_workers = NULL;
+int idle_worker_count = 0;
+
+// Thread pool (-p): a fixed set of threads serve connections, each taking
+// accepted sockets from its own deque and stealing from the others' when
+// that is empty. The accept thread adds a thread, up to pool_max, only
+// when none is idle. Connections whose first request carries a deadline
+// are kept apart in a heap and served earliest deadline first, ahead of
+// the rest. Once taken, a connection keeps its thread until it closes, so
+// the ordering only applies to that first request.
+typedef struct {
+    pthread_mutex_t lock;
+    NewConnection items[POOL_DEQUE_SIZE];  // ring
+    int head;
+    int count;
+    NewConnection urgent[POOL_DEQUE_SIZE];  // min-heap on deadline_ms
+    int urgent_count;
+} WorkerDeque;
+
+WorkerDeque *pool_deques = NULL;
+int pool_size = 0;  // threads started
+int pool_max = 0;   // 0 when there is no pool
+int pool_next = 0;  // accept thread only
+int pool_idle = 0;
+int pool_queued = 0;
+int pool_urgent = 0;  // queued in heaps
+unsigned long pool_steals = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;  // parking only
+pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+__thread bool pool_thread = false;
+
+// Green threads (-G): connections run as green threads spread over a set
+// of event loop threads, so a quiet connection costs a small stack rather
+// than an OS thread
+GreenLoop **green_loops = NULL;
+int green_loop_count = 0;
+int green_next = 0;  // accept thread only
+
+// Requests may carry a deadline: "@<ms since the epoch> <request>". One
+// that has passed by the time the request is reached is answered with
+// DEADLINE_EXCEEDED instead of being evaluated.
+#define DEADLINE_EXCEEDED "Deadline exceeded"
+bool deadlines_seen = false;
+unsigned long deadline_expired = 0;
+
+// Inline fast path (-x): a new connection whose first request is a check
+// that has already arrived is answered on the accept thread
+bool inline_checks = false;
+
 char **requests;
 int request_count = 0;
 int request_capacity = INITIAL_CAPACITY;
 
 void ensure_rule_capacity();
+FirewallRule *allocate_rule_table(FirewallRule *table, int *capacity);
 void ensure_request_capacity();
 void trim_whitespace(char *str);
 
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s -i | %s [-u] [-f leader_host:port | -r host:port,...] "
+            "[-H handoff_path] [-T takeover_path] [-c rules_file] [-s snapshot_file] [-q query_log_dir] [-a cpu_list [-n]] [-l] [-b cpu_budget] [-x] [-p threads[:max]] [-G loops] [-P] [-k stripes] [-e engine] <port>\n", program, program);
+}
+
 int main(int argc, char *argv[]) {
     pthread_mutex_init(&lock, NULL);
     
-    rule_capacity = INITIAL_CAPACITY;
-    rules = malloc(rule_capacity * sizeof(FirewallRule));
     request_capacity = INITIAL_CAPACITY;
     requests = malloc(request_capacity * sizeof(char*));
     
-    if (argc == 2 && strcmp(argv[1], "-i") == 0) {
+    bool interactive = false;
+    bool datagrams = false;
+    const char *leader = NULL;
+    const char *shards = NULL;
+    const char *takeover_path = NULL;
+    const char *cpus = NULL;
+    bool replicate = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "iuf:r:H:T:c:s:q:a:nlb:xp:G:Pk:e:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interactive = true;
+            break;
+        case 'u':
+            datagrams = true;
+            break;
+        case 'f':
+            leader = optarg;
+            break;
+        case 'r':
+            shards = optarg;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'T':
+            takeover_path = optarg;
+            break;
+        case 'c':
+            rules_path = optarg;
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'q':
+            query_log_dir = optarg;
+            break;
+        case 'a':
+            cpus = optarg;
+            break;
+        case 'n':
+            replicate = true;
+            break;
+        case 'l':
+            region_use_huge_pages(true);
+            break;
+        case 'x':
+            inline_checks = true;
+            break;
+        case 'P':
+            shared_nothing = true;
+            break;
+        case 'k':
+            lock_stripes = atoi(optarg);
+            if (lock_stripes < 1 || lock_stripes > MAX_LOCK_STRIPES) {
+                fprintf(stderr, "Stripe count must be from 1 to %d\n", MAX_LOCK_STRIPES);
+                return 1;
+            }
+            break;
+        case 'p':
+            pool_max = 0;
+            if (sscanf(optarg, "%d:%d", &pool_size, &pool_max) < 1 || pool_size < 1 ||
+                (pool_max != 0 && pool_max < pool_size) || pool_size > MAX_POOL_THREADS ||
+                pool_max > MAX_POOL_THREADS) {
+                fprintf(stderr, "Thread pool must be <threads>[:<max_threads>], at most %d\n",
+                        MAX_POOL_THREADS);
+                return 1;
+            }
+            if (pool_max == 0) pool_max = pool_size;
+            break;
+        case 'e':
+            if (classifier_engine_named(optarg) < 0) {
+                fprintf(stderr, "Unknown classifier engine: %s\n", optarg);
+                return 1;
+            }
+            classifier_use_engine(classifier_engine_named(optarg));
+            break;
+        case 'G':
+            green_loop_count = atoi(optarg);
+            if (green_loop_count < 1 || green_loop_count > MAX_GREEN_LOOPS) {
+                fprintf(stderr, "Event loop count must be from 1 to %d\n", MAX_GREEN_LOOPS);
+                return 1;
+            }
+            break;
+        case 'b':
+            busy_poll_budget = atoi(optarg);
+            if (busy_poll_budget < 1 || busy_poll_budget > 100) {
+                fprintf(stderr, "CPU budget must be a percentage from 1 to 100\n");
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    // Allocated once options are known, so -l applies to them
+    rule_capacity = INITIAL_CAPACITY;
+    rules = allocate_rule_table(NULL, &rule_capacity);
+    classifiers[classifier_count++] = classifier_create(-1);
+
+    if (rules_path != NULL && (leader != NULL || shards != NULL)) {
+        fprintf(stderr, "A rules file cannot be used with -f or -r\n");
+        return 1;
+    }
+    if (replicate && cpus == NULL) {
+        fprintf(stderr, "-n needs a CPU list given with -a\n");
+        return 1;
+    }
+    if (shared_nothing && (cpus == NULL || leader != NULL || shards != NULL)) {
+        fprintf(stderr, "-P needs a CPU list given with -a and cannot be used with -f or -r\n");
+        return 1;
+    }
+    if (green_loop_count > 0 && pool_max > 0) {
+        fprintf(stderr, "-G and -p cannot be used together\n");
+        return 1;
+    }
+    // A router or follower waits on other servers, which would hold up
+    // every connection on the loop
+    if (green_loop_count > 0 && (leader != NULL || shards != NULL)) {
+        fprintf(stderr, "-G cannot be used with -f or -r\n");
+        return 1;
+    }
+    if (rules_path != NULL) {
+        // Reloads are triggered by SIGHUP, taken by the watcher thread alone,
+        // so it is blocked before any other thread starts
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    }
+    if (cpus != NULL) configure_affinity(cpus, replicate);
+    if (shared_nothing) start_core_replicas();
+    start_lock_stripes();
+    start_classifier_builder();
+    
+    if (interactive && optind == argc) {
+        if (snapshot_path != NULL) load_snapshot_file();
+        if (query_log_dir != NULL) start_query_log();
+        if (rules_path != NULL && !reload_rules_file()) return 1;
         char request[BUFFER_SIZE];
         char response[BUFFER_SIZE];
         
         while (fgets(request, sizeof(request), stdin) != NULL) {
             request[strcspn(request, "\n")] = 0;
+            bool expired;
+            const char *body = strip_deadline(request, &expired);
             pthread_mutex_lock(&lock);
-            process_request(request, response);
+            if (expired) {
+                strcpy(response, DEADLINE_EXCEEDED);
+            } else {
+                process_request(body, response);
+            }
             pthread_mutex_unlock(&lock);
             printf("%s\n", response);
         }
-    } else if (argc == 2) {
-        int port = atoi(argv[1]);
+        if (query_log_dir != NULL) flush_query_logs();
+    } else if (!interactive && optind == argc - 1 && (leader == NULL || shards == NULL)) {
+        int port = atoi(argv[optind]);
         if (port > 0 && port <= 65535) {
-            handle_network_mode(port);
+            int server_fd = -1, datagram_fd = -1;
+            if (takeover_path != NULL) {
+                take_over(takeover_path, &server_fd, &datagram_fd);
+            } else if (snapshot_path != NULL) {
+                load_snapshot_file();
+            }
+            if (query_log_dir != NULL) start_query_log();
+            if (rules_path != NULL) {
+                if (!reload_rules_file()) return 1;
+                pthread_t watcher;
+                pthread_create(&watcher, NULL, watch_rules_file, NULL);
+                pthread_detach(watcher);
+            }
+            if (leader != NULL) start_follower(leader);
+            if (shards != NULL) start_router(shards);
+            if (pool_max > 0) start_pool();
+            if (green_loop_count > 0) start_green_loops();
+            handle_network_mode(port, datagrams, server_fd, datagram_fd);
         } else {
             fprintf(stderr, "Invalid port number.\n");
             return 1;
         }
     } else {
-        fprintf(stderr, "Usage: %s -i | %s <port>\n", argv[0], argv[0]);
+        print_usage(argv[0]);
         return 1;
     }
     pthread_mutex_destroy(&lock);
     for (int i = 0; i < rule_count; i++) {
         free(rules[i].queries);
     }
-    free(rules);
+    region_free(rules);
     for (int i = 0; i < request_count; i++) {
         free(requests[i]);
     }
     free(requests);
     return 0;
 }
+// Rule tables live in regions, on huge pages with -l; capacity is raised to
+// whatever the region holds
+FirewallRule *allocate_rule_table(FirewallRule *table, int *capacity) {
+    size_t size = *capacity * sizeof(FirewallRule);
+    table = region_realloc(table, &size, -1);
+    *capacity = size / sizeof(FirewallRule);
+    return table;
+}
 void ensure_rule_capacity() {
     if (rule_count >= rule_capacity) {
         rule_capacity *= 2;
-        rules = realloc(rules, rule_capacity * sizeof(FirewallRule));
-        if (rules == NULL) {
-            perror("Failed to allocate memory for rules");
-            exit(1);
-        }
+        rules = allocate_rule_table(rules, &rule_capacity);
     }
 }
 void ensure_request_capacity() {
@@ -181,49 +730,68 @@ bool ip_to_integer(const char *ip, unsigned int *result) {
     }
     return false;
 }
-bool is_within_ip_range(const char *ip, const char *range) {
-    unsigned int ip_int, start_int, end_int;
-    if (!ip_to_integer(ip, &ip_int)) {
-        return false;
+void wake_subscriber(ClientConnection *conn) {
+    uint64_t one = 1;
+    if (write(conn->wake_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to wake subscriber");
     }
-    char ip_start[IP_RANGE_SIZE], ip_end[IP_RANGE_SIZE];
-    if (strchr(range, '-') == NULL) {
-        if (!ip_to_integer(range, &start_int)) {
-            return false;
-        }
-        return ip_int == start_int;
-    } else {
-        sscanf(range, "%63[^-]-%63s", ip_start, ip_end);
-        if (!ip_to_integer(ip_start, &start_int) || !ip_to_integer(ip_end, 
-&end_int)) {
-            return false;
+}
+void queue_push(ClientConnection *conn, const char *frame) {
+    size_t len = strlen(frame) + 1;
+    pthread_mutex_lock(&conn->push_lock);
+    // The queue grows for bursts such as a reload. A subscriber behind by
+    // more changes than the mutation log holds (two frames at most each)
+    // is dropped; it must resync on reconnect.
+    if (conn->push_frames >= 2 * MUTATION_LOG_SIZE) {
+        conn->push_overflow = true;
+    } else if (!conn->push_overflow) {
+        if (conn->push_len + len > conn->push_capacity) {
+            conn->push_capacity = 2 * (conn->push_len + len);
+            conn->pushes = realloc(conn->pushes, conn->push_capacity);
         }
-        return (ip_int >= start_int && ip_int <= end_int);
+        memcpy(conn->pushes + conn->push_len, frame, len);
+        conn->push_len += len;
+        conn->push_frames++;
     }
+    pthread_mutex_unlock(&conn->push_lock);
+    wake_subscriber(conn);
 }
-bool is_within_port_range(int port, const char *range) {
-    int start, end;
-    if (strchr(range, '-') == NULL) {
-        return port == atoi(range);
-    }
-    sscanf(range, "%d-%d", &start, &end);
-    return port >= start && port <= end;
+int format_mutation(char *frame, size_t size, const Mutation *m) {
+    return snprintf(frame, size, "!E %lu %c %lu %s %s", m->version, m->op, m->id,
+                    m->ip_range, m->port_range);
 }
-void add_rule(const char *ip_range, const char *port_range, char *response) {
-    ensure_rule_capacity();
-    if (!is_valid_ip_range(ip_range) || !is_valid_port_range(port_range)) {
-        strncpy(response, "Invalid rule", BUFFER_SIZE - 1);
-        response[BUFFER_SIZE - 1] = '\0';
-        return;
+// Records a rule-set change and pushes it to subscribers: watchers get the
+// mutation itself, caching clients the range whose verdicts may have
+// changed. Called with lock held.
+void publish_mutation(char op, unsigned long id, const char *ip_range, const char *port_range) {
+    if (op == 'A' && query_log_dir != NULL) log_rule(id, ip_range, port_range);
+    Mutation *m = &mutation_log[++rule_version % MUTATION_LOG_SIZE];
+    m->version = rule_version;
+    m->op = op;
+    m->id = id;
+    strcpy(m->ip_range, ip_range);
+    strcpy(m->port_range, port_range);
+    char mutation[BUFFER_SIZE], invalidation[BUFFER_SIZE];
+    format_mutation(mutation, sizeof(mutation), m);
+    snprintf(invalidation, sizeof(invalidation), "!I %lu %s %s", rule_version,
+             ip_range, port_range);
+    for (ClientConnection *conn = subscribers; conn != NULL; conn = conn->next_subscriber) {
+        if (conn->wants_mutations) queue_push(conn, mutation);
+        if (conn->wants_invalidations) queue_push(conn, invalidation);
     }
+}
+int find_rule(const char *ip_range, const char *port_range) {
     for (int i = 0; i < rule_count; i++) {
         if (strcmp(rules[i].ip_range, ip_range) == 0 && strcmp(rules[i].port_range,
 port_range) == 0) {
-            strncpy(response, "Rule already exists", BUFFER_SIZE - 1);
-            response[BUFFER_SIZE - 1] = '\0';
-            return;
+            return i;
         }
     }
+    return -1;
+}
+FirewallRule *append_rule(const char *ip_range, const char *port_range, unsigned long id) {
+    write_lock_rules();
+    ensure_rule_capacity();
     FirewallRule *rule = &rules[rule_count++];
     strncpy(rule->ip_range, ip_range, IP_RANGE_SIZE - 1);
     strncpy(rule->port_range, port_range, PORT_RANGE_SIZE - 1);
@@ -232,36 +800,114 @@ port_range) == 0) {
     rule->query_count = 0;
     rule->query_capacity = INITIAL_CAPACITY;
     rule->queries = malloc(rule->query_capacity * sizeof(*rule->queries));
+    rule->id = id;
+    ClassifierRule decoded;
+    classifier_decode(rule->ip_range, rule->port_range, &decoded);
+    for (int i = 0; i < classifier_count; i++) {
+        classifier_append(classifiers[i], &decoded);
+    }
+    CoreMutation m = { .op = 'A', .id = id, .rule = decoded };
+    queue_core_mutation(&m);
+    write_unlock_rules();
+    return rule;
+}
+void remove_rule(int index) {
+    write_lock_rules();
+    free(rules[index].queries);
+    for (int j = index; j < rule_count - 1; j++) {
+        rules[j] = rules[j + 1];
+    }
+    rule_count--;
+    for (int i = 0; i < classifier_count; i++) {
+        classifier_remove(classifiers[i], index);
+    }
+    CoreMutation m = { .op = 'D', .index = index };
+    queue_core_mutation(&m);
+    write_unlock_rules();
+}
+void add_rule(const char *ip_range, const char *port_range, char *response) {
+    if (!is_valid_ip_range(ip_range) || !is_valid_port_range(port_range)) {
+        strncpy(response, "Invalid rule", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    if (find_rule(ip_range, port_range) >= 0) {
+        strncpy(response, "Rule already exists", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    FirewallRule *rule = append_rule(ip_range, port_range, next_rule_id++);
+    publish_mutation('A', rule->id, rule->ip_range, rule->port_range);
+    sync_cores();
+    rebuild_classifiers();
     strncpy(response, "Rule added", BUFFER_SIZE - 1);
     response[BUFFER_SIZE - 1] = '\0';
 }
+int find_matching_rule(const char *ip, int port) {
+    unsigned int ip_int;
+    if (!ip_to_integer(ip, &ip_int)) {
+        return -1;
+    }
+    return classifier_match(classifiers[thread_replica], ip_int, port);
+}
+void record_query(FirewallRule *rule, const char *ip, int port) {
+    if (rule->query_count >= rule->query_capacity) {
+        rule->query_capacity *= 2;
+        rule->queries = realloc(rule->queries, rule->query_capacity * 
+sizeof(*rule->queries));
+    }
+    strncpy(rule->queries[rule->query_count].ip, ip, INET_ADDRSTRLEN - 1);
+    rule->queries[rule->query_count].ip[INET_ADDRSTRLEN - 1] = '\0';
+    rule->queries[rule->query_count++].port = port;
+}
+// Followers keep no query logs of their own; accepted checks are queued
+// for the hit reporter, which sends them to the leader. So are checks
+// answered while a handoff is under way.
+void record_accepted(int index, const char *ip, int port) {
+    if (leader_pool == NULL && !handing_off) {
+        record_rule_query(&rules[index], ip, port);
+        if (query_log_dir != NULL) log_query(rules[index].id, ip, port);
+        return;
+    }
+    if (pending_hits == NULL) pending_hits = malloc(MAX_PENDING_HITS);
+    if (pending_hits_len + INET_ADDRSTRLEN + 8 > MAX_PENDING_HITS) {
+        dropped_hits++;
+        return;
+    }
+    pending_hits_len += sprintf(pending_hits + pending_hits_len, "%s %d ", ip, port);
+}
 void check_connection(const char *ip, int port, char *response) {
     if (!is_valid_ip(ip) || port < 0 || port > 65535) {
         strncpy(response, "Illegal IP address or port specified", BUFFER_SIZE - 1);
         response[BUFFER_SIZE - 1] = '\0';
         return;
     }
-    for (int i = 0; i < rule_count; i++) {
-        bool ip_match = is_within_ip_range(ip, rules[i].ip_range);
-        bool port_match = is_within_port_range(port, rules[i].port_range);
-        if (ip_match && port_match) {
-            FirewallRule *rule = &rules[i];
-            if (rule->query_count >= rule->query_capacity) {
-                rule->query_capacity *= 2;
-                rule->queries = realloc(rule->queries, rule->query_capacity * 
-sizeof(*rule->queries));
-            }
-            strncpy(rule->queries[rule->query_count].ip, ip, INET_ADDRSTRLEN - 1);
-            rule->queries[rule->query_count].ip[INET_ADDRSTRLEN - 1] = '\0';
-            rule->queries[rule->query_count++].port = port;
-            strncpy(response, "Connection accepted", BUFFER_SIZE - 1);
-            response[BUFFER_SIZE - 1] = '\0';
-            return;
-        }
+    int index = find_matching_rule(ip, port);
+    if (index >= 0) {
+        record_accepted(index, ip, port);
+        strncpy(response, "Connection accepted", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
     }
     strncpy(response, "Connection rejected", BUFFER_SIZE - 1);
     response[BUFFER_SIZE - 1] = '\0';
 }
+// Logs accepted checks that a client answered from its decision cache. Pairs
+// that no longer match any rule are dropped, as the cache entry was stale.
+void record_hits(const char *hits, char *response) {
+    char ip[INET_ADDRSTRLEN];
+    int port, consumed;
+    while (sscanf(hits, "%15s %d%n", ip, &port, &consumed) == 2) {
+        hits += consumed;
+        if (!is_valid_ip(ip) || port < 0 || port > 65535) continue;
+        int index = find_matching_rule(ip, port);
+        if (index >= 0) {
+            record_accepted(index, ip, port);
+        }
+    }
+    strncpy(response, "Hits recorded", BUFFER_SIZE - 1);
+    response[BUFFER_SIZE - 1] = '\0';
+}
 void delete_rule(const char *ip_range, const char *port_range, char *response) {
     // First check if the rule format is valid
     if (!is_valid_ip_range(ip_range) || !is_valid_port_range(port_range)) {
@@ -271,18 +917,15 @@ void delete_rule(const char *ip_range, const char *port_range, char *response) {
     }
     
     // Rule is valid, now check if it exists
-    for (int i = 0; i < rule_count; i++) {
-        if (strcmp(rules[i].ip_range, ip_range) == 0 && strcmp(rules[i].port_range,
-port_range) == 0) {
-            free(rules[i].queries);
-            for (int j = i; j < rule_count - 1; j++) {
-                rules[j] = rules[j + 1];
-            }
-            rule_count--;
-            strncpy(response, "Rule deleted", BUFFER_SIZE - 1);
-            response[BUFFER_SIZE - 1] = '\0';
-            return;
-        }
+    int index = find_rule(ip_range, port_range);
+    if (index >= 0) {
+        publish_mutation('D', rules[index].id, ip_range, port_range);
+        remove_rule(index);
+        sync_cores();
+        rebuild_classifiers();
+        strncpy(response, "Rule deleted", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
     }
     strncpy(response, "Rule not found", BUFFER_SIZE - 1);
     response[BUFFER_SIZE - 1] = '\0';
@@ -290,6 +933,8 @@ port_range) == 0) {
 void list_rules(char *response) {
     char temp[BUFFER_SIZE];
     response[0] = '\0';
+    write_lock_rules();
+    lock_cores();
     for (int i = 0; i < rule_count; i++) {
         snprintf(temp, BUFFER_SIZE - 1, "Rule: %s %s\n", rules[i].ip_range, 
 rules[i].port_range);
@@ -299,11 +944,33 @@ rules[i].port_range);
 rules[i].queries[j].ip, rules[i].queries[j].port);
             strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
         }
+        // Queries accepted on each replica's CPU, after those from before
+        for (int c = 0; c < core_count; c++) {
+            FirewallRule *rule = &core_list[c]->rules[i];
+            for (int j = 0; j < rule->query_count; j++) {
+                snprintf(temp, BUFFER_SIZE - 1, "Query: %s %d\n", rule->queries[j].ip,
+                         rule->queries[j].port);
+                strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+            }
+        }
     }
+    unlock_cores();
+    write_unlock_rules();
     if (rule_count == 0) {
         strncat(response, "No rules found\n", BUFFER_SIZE - strlen(response) - 1);
     }
 }
+void record_request(const char *request) {
+    // Hit reports are bookkeeping, and '!' is reserved for pushed frames
+    if (request_count < MAX_REQUESTS && strcmp(request, "R") != 0 &&
+        strncmp(request, "H ", 2) != 0 && request[0] != '!') {
+        ensure_request_capacity();
+        requests[request_count] = malloc(BUFFER_SIZE);
+        strncpy(requests[request_count], request, BUFFER_SIZE - 1);
+        requests[request_count][BUFFER_SIZE - 1] = '\0';
+        request_count++;
+    }
+}
 void list_requests(char *response) {
     response[0] = '\0';
     char temp[BUFFER_SIZE];
@@ -316,115 +983,2966 @@ void list_requests(char *response) {
 1);
     }
 }
-void handle_network_mode(int port) {
-    int server_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+// A rule set parsed from the rules file, indexed by (ip_range, port_range).
+// Built without lock; only the swap into rules[] holds it.
+typedef struct {
+    FirewallRule *rules;
+    int count;
+    int capacity;
+    int *slots;  // open addressing, -1 when empty
+    int slot_count;
+    Classifier *classifiers[MAX_NODES];  // the rules decoded, one per classifiers[]
+} RuleSet;
+
+unsigned long hash_rule(const char *ip_range, const char *port_range) {
+    unsigned long hash = 14695981039346656037UL;
+    for (const char *p = ip_range; *p != '\0'; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+    hash = (hash ^ ' ') * 1099511628211UL;
+    for (const char *p = port_range; *p != '\0'; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+    return hash;
+}
+// Returns the rule's slot: either the one holding it or the empty one where
+// it belongs
+int find_rule_slot(const RuleSet *set, const char *ip_range, const char *port_range) {
+    int slot = hash_rule(ip_range, port_range) & (set->slot_count - 1);
+    while (set->slots[slot] >= 0) {
+        FirewallRule *rule = &set->rules[set->slots[slot]];
+        if (strcmp(rule->ip_range, ip_range) == 0 && strcmp(rule->port_range, port_range) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (set->slot_count - 1);
     }
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    return slot;
+}
+void free_rule_set(RuleSet *set) {
+    region_free(set->rules);
+    free(set->slots);
+}
+// Reads "<ip_range> <port_range>" lines; blank lines and # comments are
+// skipped and repeated rules kept once. Any invalid line fails the load.
+bool parse_rules_file(const char *path, RuleSet *set) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open rules file");
+        return false;
     }
-    if (listen(server_fd, 128) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    set->count = 0;
+    set->capacity = INITIAL_CAPACITY;
+    set->rules = allocate_rule_table(NULL, &set->capacity);
+    set->slot_count = 256;  // a power of two, as slots are found by masking
+    set->slots = malloc(set->slot_count * sizeof(int));
+    memset(set->slots, -1, set->slot_count * sizeof(int));
+    char line[BUFFER_SIZE], extra[2];
+    char ip_range[IP_RANGE_SIZE], port_range[PORT_RANGE_SIZE];
+    int line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        trim_whitespace(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (sscanf(line, "%63s %15s %1s", ip_range, port_range, extra) != 2 ||
+            !is_valid_ip_range(ip_range) || !is_valid_port_range(port_range)) {
+            fprintf(stderr, "Invalid rule on line %d of %s\n", line_number, path);
+            ok = false;
+            break;
+        }
+        if (set->count * 2 >= set->slot_count) {
+            // Keep the table at most half full
+            free(set->slots);
+            set->slot_count *= 2;
+            set->slots = malloc(set->slot_count * sizeof(int));
+            memset(set->slots, -1, set->slot_count * sizeof(int));
+            for (int i = 0; i < set->count; i++) {
+                set->slots[find_rule_slot(set, set->rules[i].ip_range, set->rules[i].port_range)] = i;
+            }
+        }
+        int slot = find_rule_slot(set, ip_range, port_range);
+        if (set->slots[slot] >= 0) continue;
+        if (set->count >= set->capacity) {
+            set->capacity *= 2;
+            set->rules = allocate_rule_table(set->rules, &set->capacity);
+        }
+        FirewallRule *rule = &set->rules[set->count];
+        memset(rule, 0, sizeof(*rule));
+        strcpy(rule->ip_range, ip_range);
+        strcpy(rule->port_range, port_range);
+        set->slots[slot] = set->count++;
     }
-    printf("Server started\n");
-    int new_socket;
-    while ((new_socket = accept(server_fd, (struct sockaddr *)&address, 
-(socklen_t*)&addrlen)) >= 0) {
-        printf("Accepted connection: socket %d\n", new_socket);
-        pthread_t client_thread;
-        int *socket_ptr = malloc(sizeof(int));
-        *socket_ptr = new_socket;
-        if (pthread_create(&client_thread, NULL, handle_client, (void*)socket_ptr) 
-< 0) {
-            perror("Thread creation failed");
-            free(socket_ptr);
-            close(new_socket);
+    fclose(file);
+    if (!ok) free_rule_set(set);
+    return ok;
+}
+// Replaces rules[] with the parsed set. Rules present in both keep their id
+// and query log; the others are published as deletions and additions.
+// Called with lock held; takes ownership of the set's rules and
+// classifiers.
+void swap_rule_set(RuleSet *set, int *added, int *deleted) {
+    *added = *deleted = 0;
+    write_lock_rules();
+    int *kept_from = malloc((set->count > 0 ? set->count : 1) * sizeof(int));
+    memset(kept_from, -1, set->count * sizeof(int));
+    for (int i = 0; i < rule_count; i++) {
+        int index = set->slots[find_rule_slot(set, rules[i].ip_range, rules[i].port_range)];
+        if (index >= 0) {
+            kept_from[index] = i;
+            FirewallRule *rule = &set->rules[index];
+            rule->id = rules[i].id;
+            rule->queries = rules[i].queries;
+            rule->query_count = rules[i].query_count;
+            rule->query_capacity = rules[i].query_capacity;
         } else {
-            pthread_detach(client_thread);
-            printf("Thread created for socket %d\n", new_socket);
+            publish_mutation('D', rules[i].id, rules[i].ip_range, rules[i].port_range);
+            free(rules[i].queries);
+            (*deleted)++;
         }
     }
-    close(server_fd);
-}
-void process_request(const char *request, char *response) {
-    response[0] = '\0';
-    char trimmed_request[BUFFER_SIZE] = {0};
-    strncpy(trimmed_request, request, BUFFER_SIZE - 1);
-    trim_whitespace(trimmed_request);
-    if (request_count < MAX_REQUESTS && strcmp(trimmed_request, "R") != 0) {
-        ensure_request_capacity();
-        requests[request_count] = malloc(BUFFER_SIZE);
-        strncpy(requests[request_count], trimmed_request, BUFFER_SIZE - 1);
-        request_count++;
+    for (int i = 0; i < set->count; i++) {
+        FirewallRule *rule = &set->rules[i];
+        if (rule->queries != NULL) continue;
+        rule->id = next_rule_id++;
+        rule->query_capacity = INITIAL_CAPACITY;
+        rule->queries = malloc(rule->query_capacity * sizeof(*rule->queries));
+        publish_mutation('A', rule->id, rule->ip_range, rule->port_range);
+        (*added)++;
     }
-    if (strncmp(trimmed_request, "A ", 2) == 0) {
-        char ip_range[IP_RANGE_SIZE] = {0};
-        char port_range[PORT_RANGE_SIZE] = {0};
-        if (sscanf(trimmed_request + 2, "%63s %15s", ip_range, port_range) == 2) {
-            add_rule(ip_range, port_range, response);
-        } else {
-            strncpy(response, "Invalid rule format", BUFFER_SIZE - 1);
+    region_free(rules);
+    rules = set->rules;
+    rule_count = set->count;
+    rule_capacity = set->capacity;
+    free(set->slots);
+    Classifier *replaced[MAX_NODES];
+    for (int i = 0; i < classifier_count; i++) {
+        replaced[i] = classifiers[i];
+        classifiers[i] = set->classifiers[i];
+    }
+    if (shared_nothing) {
+        // Replicas rebuild in the new order, carrying kept rules' queries
+        CoreMutation m = { .op = 'X' };
+        queue_core_mutation(&m);
+        for (int j = 0; j < rule_count; j++) {
+            m.op = kept_from[j] >= 0 ? 'K' : 'A';
+            m.index = kept_from[j];
+            m.id = rules[j].id;
+            classifier_decode(rules[j].ip_range, rules[j].port_range, &m.rule);
+            queue_core_mutation(&m);
         }
-    } else if (strncmp(trimmed_request, "C ", 2) == 0) {
-        char ip[INET_ADDRSTRLEN] = {0};
-        int port;
-        if (sscanf(trimmed_request + 2, "%15s %d", ip, &port) == 2) {
-            check_connection(ip, port, response);
-        } else {
-            strncpy(response, "Illegal IP address or port specified", BUFFER_SIZE -
-1);
+        m.op = 'F';
+        queue_core_mutation(&m);
+        sync_cores();
+    }
+    free(kept_from);
+    write_unlock_rules();
+    for (int i = 0; i < classifier_count; i++) classifier_destroy(replaced[i]);
+}
+// Decodes the set into fresh classifiers for the nodes in use, indexed
+// unless the engine is left to the builder thread. Runs without lock:
+// only the reloading thread replaces classifiers[].
+void decode_rule_set(RuleSet *set) {
+    for (int i = 0; i < classifier_count; i++) {
+        Classifier *classifier = classifier_create(classifiers[i]->node);
+        for (int j = 0; j < set->count; j++) {
+            ClassifierRule decoded;
+            classifier_decode(set->rules[j].ip_range, set->rules[j].port_range, &decoded);
+            classifier_append(classifier, &decoded);
         }
-    } else if (strncmp(trimmed_request, "D ", 2) == 0) {
-        char ip_range[IP_RANGE_SIZE] = {0};
-        char port_range[PORT_RANGE_SIZE] = {0};
-        if (sscanf(trimmed_request + 2, "%63s %15s", ip_range, port_range) == 2) {
-            delete_rule(ip_range, port_range, response);
-        } else {
-            strncpy(response, "Invalid rule format", BUFFER_SIZE - 1);
+        if (!classifier_engine_background(classifier->engine)) {
+            classifier_install(classifier, classifier_build(classifier));
         }
-    } else if (strcmp(trimmed_request, "R") == 0) {
-        list_requests(response);
-    } else if (strcmp(trimmed_request, "L") == 0) {
-        list_rules(response);
+        set->classifiers[i] = classifier;
+    }
+}
+// Parses, decodes and indexes the rules file without lock, so checks carry
+// on against the current rules, then swaps the result in
+void wait_for_handoff();
+bool reload_rules_file() {
+    RuleSet set;
+    if (!parse_rules_file(rules_path, &set)) {
+        fprintf(stderr, "Keeping current rules\n");
+        return false;
+    }
+    decode_rule_set(&set);
+    int added, deleted;
+    pthread_mutex_lock(&lock);
+    wait_for_handoff();
+    swap_rule_set(&set, &added, &deleted);
+    rebuild_classifiers();
+    unsigned long version = rule_version;
+    int count = rule_count;
+    pthread_mutex_unlock(&lock);
+    printf("Loaded %d rules from %s (%d added, %d deleted) at version %lu\n",
+           count, rules_path, added, deleted, version);
+    return true;
+}
+// Reloads on SIGHUP, which is blocked in every thread and read here, and
+// when the file is rewritten in place or replaced by a rename
+void *watch_rules_file(void *arg) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    int signal_fd = signalfd(-1, &mask, 0);
+    char directory[BUFFER_SIZE];
+    strncpy(directory, rules_path, BUFFER_SIZE - 1);
+    directory[BUFFER_SIZE - 1] = '\0';
+    char *slash = strrchr(directory, '/');
+    const char *name = slash != NULL ? rules_path + (slash - directory) + 1 : rules_path;
+    if (slash != NULL) {
+        slash[slash == directory ? 1 : 0] = '\0';
     } else {
-        strncpy(response, "Illegal request", BUFFER_SIZE - 1);
+        strcpy(directory, ".");
     }
-    response[BUFFER_SIZE - 1] = '\0';
+    int inotify_fd = inotify_init1(IN_NONBLOCK);
+    if (inotify_fd >= 0 &&
+        inotify_add_watch(inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("Failed to watch rules file");
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    struct pollfd fds[2] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = inotify_fd, .events = POLLIN },
+    };
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Rules file watch failed");
+            break;
+        }
+        bool reload = false;
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            reload = read(signal_fd, &info, sizeof(info)) == sizeof(info);
+        }
+        if (fds[1].revents & POLLIN) {
+            ssize_t len;
+            while ((len = read(inotify_fd, events, sizeof(events))) > 0) {
+                for (char *p = events; p < events + len; ) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    if (event->len > 0 && strcmp(event->name, name) == 0) reload = true;
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+        if (reload) reload_rules_file();
+    }
+    return NULL;
 }
-void *handle_client(void *socket_desc) {
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-    int sock = *(int*)socket_desc;
-    free(socket_desc);
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    // Process exactly one request (matching client behavior)
-    int recv_len = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    if (recv_len > 0) {
-        buffer[recv_len] = '\0';  // Properly null-terminate
-        buffer[strcspn(buffer, "\n")] = '\0';  // Remove newlines
-        pthread_mutex_lock(&lock);
-        process_request(buffer, response);
-        pthread_mutex_unlock(&lock);
-        send(sock, response, strlen(response), 0);
-        printf("Thread for socket %d completed request\n", sock);
+// Buffered writer for snapshots. Uses no heap, so it is also safe in a
+// forked child.
+typedef struct {
+    int fd;
+    size_t len;
+    bool failed;
+    SnapshotProgress *progress;
+    char buffer[SNAPSHOT_BUFFER_SIZE];
+} SnapshotWriter;
+
+void snapshot_flush(SnapshotWriter *w) {
+    size_t done = 0;
+    while (!w->failed && done < w->len) {
+        ssize_t n = write(w->fd, w->buffer + done, w->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) w->failed = true;
+        else done += n;
     }
-    close(sock);
-    printf("Thread for socket %d closed socket and exiting\n", sock);
+    if (w->progress != NULL) w->progress->bytes += done;
+    w->len = 0;
+}
+// Lines are put together by hand rather than with printf, which may take
+// locks or allocate and so is not safe in a forked child
+void snapshot_text(SnapshotWriter *w, const char *text) {
+    for (; *text != '\0'; text++) {
+        if (w->len == SNAPSHOT_BUFFER_SIZE) snapshot_flush(w);
+        w->buffer[w->len++] = *text;
+    }
+}
+void snapshot_number(SnapshotWriter *w, unsigned long n) {
+    char digits[24];
+    int i = sizeof(digits) - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    snapshot_text(w, digits + i);
+}
+// Writes the rule set, query logs and request history as text lines:
+//   V <rule_version> <next_rule_id>, then per rule A <id> <ip_range>
+//   <port_range> followed by a Q <ip> <port> line per query, then a
+//   R <request> line per request, and E at the end.
+// Called with lock held and replicas locked, or in a forked child. progress,
+// if not NULL, is advanced as rules are written.
+bool write_snapshot(int fd, SnapshotProgress *progress) {
+    static SnapshotWriter w;
+    w.fd = fd;
+    w.len = 0;
+    w.failed = false;
+    w.progress = progress;
+    snapshot_text(&w, "V ");
+    snapshot_number(&w, rule_version);
+    snapshot_text(&w, " ");
+    snapshot_number(&w, next_rule_id);
+    snapshot_text(&w, "\n");
+    for (int i = 0; i < rule_count; i++) {
+        if (progress != NULL) progress->rules_written = i;
+        snapshot_text(&w, "A ");
+        snapshot_number(&w, rules[i].id);
+        snapshot_text(&w, " ");
+        snapshot_text(&w, rules[i].ip_range);
+        snapshot_text(&w, " ");
+        snapshot_text(&w, rules[i].port_range);
+        snapshot_text(&w, "\n");
+        for (int c = -1; c < core_count; c++) {
+            FirewallRule *rule = c < 0 ? &rules[i] : &core_list[c]->rules[i];
+            for (int j = 0; j < rule->query_count; j++) {
+                snapshot_text(&w, "Q ");
+                snapshot_text(&w, rule->queries[j].ip);
+                snapshot_text(&w, " ");
+                snapshot_number(&w, rule->queries[j].port);
+                snapshot_text(&w, "\n");
+            }
+        }
+    }
+    for (int i = 0; i < request_count; i++) {
+        snapshot_text(&w, "R ");
+        snapshot_text(&w, requests[i]);
+        snapshot_text(&w, "\n");
+    }
+    snapshot_text(&w, "E\n");
+    snapshot_flush(&w);
+    return !w.failed;
+}
+// Loads a snapshot into an empty server. Changes from before it cannot be
+// replayed to watchers. Called with lock held.
+bool read_snapshot(FILE *in) {
+    char line[BUFFER_SIZE + 8];
+    char ip[INET_ADDRSTRLEN], ip_range[IP_RANGE_SIZE], port_range[PORT_RANGE_SIZE];
+    unsigned long id;
+    int port;
+    FirewallRule *rule = NULL;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "V %lu %lu", &rule_version, &next_rule_id) == 2) {
+            log_floor = rule_version;
+        } else if (sscanf(line, "A %lu %63s %15s", &id, ip_range, port_range) == 3) {
+            rule = append_rule(ip_range, port_range, id);
+        } else if (rule != NULL && sscanf(line, "Q %15s %d", ip, &port) == 2) {
+            record_rule_query(rule, ip, port);
+        } else if (strncmp(line, "R ", 2) == 0) {
+            record_request(line + 2);
+        } else if (strcmp(line, "E") == 0) {
+            sync_cores();
+            rebuild_classifiers();
+            return true;
+        }
+    }
+    sync_cores();
+    rebuild_classifiers();
+    return false;
+}
+long elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+// Runs in the forked child: writes to a temporary file and renames it over
+// snapshot_path once it is on disk
+bool save_snapshot_file() {
+    // Also run in a forked child, so no printf here either
+    char temp_path[BUFFER_SIZE];
+    size_t len = strlen(snapshot_path);
+    if (len + sizeof(".tmp") > sizeof(temp_path)) return false;
+    memcpy(temp_path, snapshot_path, len);
+    memcpy(temp_path + len, ".tmp", sizeof(".tmp"));
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_snapshot(fd, snapshot_progress) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    return ok && rename(temp_path, snapshot_path) == 0;
+}
+void *wait_for_snapshot(void *arg) {
+    pid_t pid = (pid_t)(intptr_t)arg;
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    pthread_mutex_lock(&lock);
+    last_snapshot_ms = elapsed_us(&snapshot_started) / 1000;
+    last_snapshot_bytes = snapshot_progress->bytes;
+    if (ok) {
+        snapshots_completed++;
+    } else {
+        snapshots_failed++;
+    }
+    snapshot_pid = 0;
+    pthread_mutex_unlock(&lock);
+    printf("Snapshot at version %lu %s after %ld ms\n", snapshot_version,
+           ok ? "saved" : "failed", last_snapshot_ms);
     return NULL;
-}
\ No newline at end of file
+}
+// Forks a child to save the current state. The fork is the only cost to
+// the serving threads; the child sees a copy-on-write image frozen at this
+// point. Called with lock held, which keeps that image consistent.
+void start_snapshot(char *response) {
+    if (snapshot_path == NULL) {
+        strncpy(response, "Snapshots not configured", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    if (snapshot_pid > 0) {
+        strncpy(response, "Snapshot already running", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    if (snapshot_progress == NULL) {
+        snapshot_progress = mmap(NULL, sizeof(SnapshotProgress), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (snapshot_progress == MAP_FAILED) {
+            snapshot_progress = NULL;
+            strncpy(response, "Snapshot failed", BUFFER_SIZE - 1);
+            response[BUFFER_SIZE - 1] = '\0';
+            return;
+        }
+    }
+    snapshot_progress->rules_written = 0;
+    snapshot_progress->rule_total = rule_count;
+    snapshot_progress->bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &snapshot_started);
+    // Checks and replicas are held still across the fork so the child sees
+    // every query history whole
+    write_lock_rules();
+    lock_cores();
+    pid_t pid = fork();
+    if (pid != 0) {
+        unlock_cores();
+        write_unlock_rules();
+    }
+    if (pid == 0) {
+        // Only this thread exists in the child, and other threads may have
+        // held heap or stdio locks at the fork: stick to plain syscalls and
+        // the hand-formatting in write_snapshot
+        _exit(save_snapshot_file() ? 0 : 1);
+    }
+    if (pid < 0) {
+        strncpy(response, "Snapshot failed", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    last_fork_us = elapsed_us(&snapshot_started);
+    snapshot_pid = pid;
+    snapshot_version = rule_version;
+    pthread_t waiter;
+    pthread_create(&waiter, NULL, wait_for_snapshot, (void *)(intptr_t)pid);
+    pthread_detach(waiter);
+    snprintf(response, BUFFER_SIZE, "Snapshot started at version %lu", rule_version);
+}
+// Restores the last saved snapshot, if there is one, before serving
+void load_snapshot_file() {
+    FILE *file = fopen(snapshot_path, "r");
+    if (file == NULL) return;
+    pthread_mutex_lock(&lock);
+    bool loaded = read_snapshot(file);
+    int count = rule_count;
+    unsigned long version = rule_version;
+    pthread_mutex_unlock(&lock);
+    fclose(file);
+    if (!loaded) {
+        fprintf(stderr, "Snapshot %s is incomplete\n", snapshot_path);
+        exit(EXIT_FAILURE);
+    }
+    printf("Restored %d rules at version %lu from %s\n", count, version, snapshot_path);
+}
+// Server state and counters. Called with lock held.
+void show_info(char *response) {
+    char temp[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "Rules: %d\nVersion: %lu\nConnections: %d\n",
+             rule_count, rule_version, active_connections);
+    if (snapshot_pid > 0) {
+        int total = snapshot_progress->rule_total;
+        snprintf(temp, sizeof(temp), "Snapshot: running, %d%% of rules, %ld bytes, %ld ms\n",
+                 total > 0 ? snapshot_progress->rules_written * 100 / total : 100,
+                 (long)snapshot_progress->bytes, elapsed_us(&snapshot_started) / 1000);
+    } else {
+        snprintf(temp, sizeof(temp), "Snapshot: idle\n");
+    }
+    strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    snprintf(temp, sizeof(temp), "Snapshots: %lu completed, %lu failed\n",
+             snapshots_completed, snapshots_failed);
+    strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    if (worker_cpu_count > 0) {
+        snprintf(temp, sizeof(temp), "Workers: pinned to %d CPUs, %d classifier %s\n",
+                 worker_cpu_count, classifier_count, classifier_count == 1 ? "copy" : "replicas");
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (classifiers[0]->engine != CLASSIFIER_LINEAR) {
+        // An engine that declined to index the rules leaves them scanned
+        if (classifiers[0]->index != NULL) {
+            snprintf(temp, sizeof(temp), "Classifier: %s engine, %zu KB index\n",
+                     classifier_engine_name(classifiers[0]->engine),
+                     classifier_index_size(classifiers[0]) / 1024);
+        } else {
+            snprintf(temp, sizeof(temp), "Classifier: %s engine, scanning without index\n",
+                     classifier_engine_name(classifiers[0]->engine));
+        }
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (shared_nothing) {
+        snprintf(temp, sizeof(temp), "Shared-nothing: %d replicas at change %lu\n",
+                 core_count, core_sequence);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (lock_stripes > 0) {
+        // Read without the stripe locks: close enough for tuning
+        unsigned long acquired = 0, contended = 0, busiest = 0;
+        for (int i = 0; i < lock_stripes; i++) {
+            acquired += stripes[i].acquired;
+            contended += stripes[i].contended;
+            if (stripes[i].acquired > busiest) busiest = stripes[i].acquired;
+        }
+        snprintf(temp, sizeof(temp), "Stripes: %d, %lu acquired, %lu contended (%.2f%%), "
+                 "busiest %.2f%% of acquisitions, %lu exclusive\n", lock_stripes, acquired,
+                 contended, acquired > 0 ? 100.0 * contended / acquired : 0.0,
+                 acquired > 0 ? 100.0 * busiest / acquired : 0.0, rule_set_exclusive);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (busy_poll_budget > 0) {
+        pthread_mutex_lock(&idle_lock);
+        snprintf(temp, sizeof(temp), "Busy poll: %d%% CPU budget, %d idle threads\n",
+                 busy_poll_budget, idle_worker_count);
+        pthread_mutex_unlock(&idle_lock);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (deadlines_seen) {
+        snprintf(temp, sizeof(temp), "Deadlines: %lu requests expired unanswered\n",
+                 __atomic_load_n(&deadline_expired, __ATOMIC_RELAXED));
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (green_loop_count > 0) {
+        GreenStats total = {0}, loop;
+        for (int i = 0; i < green_loop_count; i++) {
+            green_stats(green_loops[i], &loop);
+            total.running += loop.running;
+            total.started += loop.started;
+            total.switches += loop.switches;
+            total.pooled += loop.pooled;
+        }
+        snprintf(temp, sizeof(temp), "Green threads: %lu running on %d loops, %lu started, "
+                 "%lu switches, %lu stacks pooled\n", total.running, green_loop_count,
+                 total.started, total.switches, total.pooled);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (pool_max > 0) {
+        snprintf(temp, sizeof(temp), "Pool: %d of up to %d threads, %d idle, %d queued, %lu stolen\n",
+                 __atomic_load_n(&pool_size, __ATOMIC_ACQUIRE), pool_max,
+                 __atomic_load_n(&pool_idle, __ATOMIC_ACQUIRE),
+                 __atomic_load_n(&pool_queued, __ATOMIC_ACQUIRE),
+                 __atomic_load_n(&pool_steals, __ATOMIC_RELAXED));
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    RegionStats regions;
+    region_stats(&regions);
+    snprintf(temp, sizeof(temp), "Memory: %zu regions, %zu KB mapped, %zu KB on huge pages "
+             "(%zu KB hugetlb, %zu KB transparent)%s\n", regions.regions, regions.mapped / 1024,
+             (regions.hugetlb + regions.transparent) / 1024, regions.hugetlb / 1024,
+             regions.transparent / 1024, region_huge_pages() ? "" : ", huge pages off");
+    strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    if (query_log_dir != NULL) {
+        pthread_mutex_lock(&query_log_lock);
+        snprintf(temp, sizeof(temp), "Query log: segment %lu, %lu records, %lu dropped, "
+                 "last flush %ld us\n", query_log_segment, query_log_records,
+                 query_log_dropped, query_log_flush_us);
+        pthread_mutex_unlock(&query_log_lock);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+    if (snapshots_completed + snapshots_failed > 0) {
+        snprintf(temp, sizeof(temp), "Last snapshot: version %lu, %ld bytes, fork %ld us, %ld ms\n",
+                 snapshot_version, last_snapshot_bytes, last_fork_us, last_snapshot_ms);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+    }
+}
+void orphan_query_log(void *arg) {
+    QueryLogBuffer *buffer = arg;
+    pthread_mutex_lock(&buffer->lock);
+    buffer->orphaned = true;
+    pthread_mutex_unlock(&buffer->lock);
+}
+uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+// Appends to a buffer in memory only; records that would grow it past
+// QUERY_LOG_MAX_BUFFER are counted as dropped rather than blocking
+void append_query_log(QueryLogBuffer *buffer, const void *data, size_t len) {
+    pthread_mutex_lock(&buffer->lock);
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : QUERY_LOG_INITIAL_BUFFER;
+        if (capacity > QUERY_LOG_MAX_BUFFER) {
+            buffer->dropped++;
+            pthread_mutex_unlock(&buffer->lock);
+            return;
+        }
+        pthread_mutex_lock(&query_log_spare_lock);
+        QueryLogSpare *spare = buffer->data == NULL ? query_log_spares : NULL;
+        if (spare != NULL) {
+            query_log_spares = spare->next;
+            query_log_spare_count--;
+        }
+        pthread_mutex_unlock(&query_log_spare_lock);
+        if (spare != NULL) {
+            capacity = spare->capacity;
+            buffer->data = (char *)spare;
+        } else {
+            buffer->data = region_realloc(buffer->data, &capacity, -1);
+        }
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    pthread_mutex_unlock(&buffer->lock);
+}
+// The calling thread's buffer, registered with the flusher on first use
+QueryLogBuffer *thread_query_log() {
+    QueryLogBuffer *buffer = pthread_getspecific(query_log_key);
+    if (buffer == NULL) {
+        buffer = calloc(1, sizeof(QueryLogBuffer));
+        pthread_mutex_init(&buffer->lock, NULL);
+        pthread_setspecific(query_log_key, buffer);
+        pthread_mutex_lock(&query_log_lock);
+        buffer->next = query_log_buffers;
+        query_log_buffers = buffer;
+        pthread_mutex_unlock(&query_log_lock);
+    }
+    return buffer;
+}
+void log_query(unsigned long rule_id, const char *ip, int port) {
+    QueryLogRecord record = { .type = 'Q', .port = port, .rule_id = rule_id, .time_ms = now_ms() };
+    ip_to_integer(ip, &record.ip);
+    append_query_log(thread_query_log(), &record, sizeof(record));
+}
+void log_rule(unsigned long id, const char *ip_range, const char *port_range) {
+    struct {
+        QueryLogRecord header;
+        char rule[QUERY_LOG_RULE_SIZE];
+    } record;
+    memset(&record, 0, sizeof(record));
+    record.header.type = 'R';
+    record.header.rule_id = id;
+    record.header.time_ms = now_ms();
+    snprintf(record.rule, sizeof(record.rule), "%s %s", ip_range, port_range);
+    append_query_log(&query_log_rules, &record, sizeof(record));
+}
+// Defines every current rule, so each segment can be read on its own.
+// Takes lock.
+void log_current_rules() {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < rule_count; i++) {
+        log_rule(rules[i].id, rules[i].ip_range, rules[i].port_range);
+    }
+    pthread_mutex_unlock(&lock);
+}
+bool open_query_log_segment() {
+    char path[BUFFER_SIZE];
+    if (query_log_fd >= 0) close(query_log_fd);
+    // Another process handing off to or from this one may share the
+    // directory, so never reuse a segment that exists
+    do {
+        snprintf(path, sizeof(path), QUERY_LOG_SEGMENT_FORMAT, query_log_dir, ++query_log_segment);
+        query_log_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    } while (query_log_fd < 0 && errno == EEXIST);
+    if (query_log_fd < 0 || write(query_log_fd, QUERY_LOG_MAGIC, QUERY_LOG_MAGIC_SIZE) !=
+                            QUERY_LOG_MAGIC_SIZE) {
+        perror("Failed to open query log segment");
+        return false;
+    }
+    query_log_segment_size = QUERY_LOG_MAGIC_SIZE;
+    return true;
+}
+// Moves every buffer to the current segment with one fdatasync. Queries are
+// taken before rule definitions: a query's definition was appended before
+// it, so it is written in the same round or an earlier one.
+void flush_query_logs() {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int taken_count = 0, taken_capacity = 16;
+    struct { char *data; size_t len, capacity; } *taken = malloc(taken_capacity * sizeof(*taken));
+    unsigned long records = 0, dropped = 0;
+    pthread_mutex_lock(&query_log_lock);
+    for (QueryLogBuffer **p = &query_log_buffers; ; ) {
+        QueryLogBuffer *buffer = *p != NULL ? *p : &query_log_rules;
+        pthread_mutex_lock(&buffer->lock);
+        if (taken_count == taken_capacity) {
+            taken_capacity *= 2;
+            taken = realloc(taken, taken_capacity * sizeof(*taken));
+        }
+        taken[taken_count].data = buffer->data;
+        taken[taken_count].capacity = buffer->capacity;
+        taken[taken_count++].len = buffer->len;
+        if (buffer != &query_log_rules) records += buffer->len / sizeof(QueryLogRecord);
+        dropped += buffer->dropped;
+        buffer->data = NULL;
+        buffer->len = buffer->capacity = buffer->dropped = 0;
+        bool orphaned = buffer->orphaned;
+        pthread_mutex_unlock(&buffer->lock);
+        if (buffer == &query_log_rules) break;
+        if (orphaned) {
+            // Its thread is gone and nothing more can be appended
+            *p = buffer->next;
+            pthread_mutex_destroy(&buffer->lock);
+            free(buffer);
+        } else {
+            p = &buffer->next;
+        }
+    }
+    pthread_mutex_unlock(&query_log_lock);
+    size_t written = 0;
+    bool failed = false;
+    for (int i = taken_count - 1; i >= 0; i--) {
+        for (size_t done = 0; !failed && done < taken[i].len; ) {
+            ssize_t n = write(query_log_fd, taken[i].data + done, taken[i].len - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) failed = true;
+            else done += n;
+        }
+        written += taken[i].len;
+        if (taken[i].data == NULL) continue;
+        pthread_mutex_lock(&query_log_spare_lock);
+        if (query_log_spare_count < QUERY_LOG_MAX_SPARES) {
+            QueryLogSpare *spare = (QueryLogSpare *)taken[i].data;
+            spare->capacity = taken[i].capacity;
+            spare->next = query_log_spares;
+            query_log_spares = spare;
+            query_log_spare_count++;
+            taken[i].data = NULL;
+        }
+        pthread_mutex_unlock(&query_log_spare_lock);
+        region_free(taken[i].data);
+    }
+    free(taken);
+    if (written > 0 && (failed || fdatasync(query_log_fd) != 0)) {
+        perror("Failed to write query log");
+    }
+    pthread_mutex_lock(&query_log_lock);
+    query_log_records += records;
+    query_log_dropped += dropped;
+    query_log_segment_size += written;
+    if (written > 0) query_log_flush_us = elapsed_us(&started);
+    bool rotate = query_log_segment_size >= QUERY_LOG_SEGMENT_SIZE;
+    pthread_mutex_unlock(&query_log_lock);
+    if (rotate && open_query_log_segment()) log_current_rules();
+}
+void *run_query_log_flusher(void *arg) {
+    for (;;) {
+        usleep(QUERY_LOG_FLUSH_INTERVAL_US);
+        flush_query_logs();
+    }
+    return NULL;
+}
+// Starts a new segment after any already in the directory
+void start_query_log() {
+    if (mkdir(query_log_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create query log directory");
+        exit(EXIT_FAILURE);
+    }
+    DIR *dir = opendir(query_log_dir);
+    struct dirent *entry;
+    unsigned long segment;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "queries-%lu.log", &segment) == 1 && segment > query_log_segment) {
+            query_log_segment = segment;
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    pthread_key_create(&query_log_key, orphan_query_log);
+    if (!open_query_log_segment()) exit(EXIT_FAILURE);
+    log_current_rules();
+    pthread_t flusher;
+    pthread_create(&flusher, NULL, run_query_log_flusher, NULL);
+    pthread_detach(flusher);
+    printf("Logging queries to %s from segment %lu\n", query_log_dir, query_log_segment);
+}
+// Applies one change from the leader's stream, keeping the leader's version
+// numbers so this server can in turn be watched. Runs on the watch
+// connection's reader thread.
+void apply_leader_mutation(const FwMutation *m, void *arg) {
+    pthread_mutex_lock(&lock);
+    if (m->op == 'R') {
+        // Starting over from a snapshot: the current rules follow as
+        // additions at this version. Our own subscribers can no longer be
+        // caught up incrementally, so they are dropped and resync.
+        while (rule_count > 0) remove_rule(rule_count - 1);
+        rule_version = log_floor = m->version;
+        snapshot_remaining = m->id;
+        for (ClientConnection *conn = subscribers; conn != NULL; conn = conn->next_subscriber) {
+            pthread_mutex_lock(&conn->push_lock);
+            conn->push_overflow = true;
+            pthread_mutex_unlock(&conn->push_lock);
+            wake_subscriber(conn);
+        }
+    } else if (m->version <= rule_version) {
+        // Part of a snapshot
+        if (m->op == 'A' && find_rule(m->ip_range, m->port_range) < 0) {
+            append_rule(m->ip_range, m->port_range, m->id);
+        }
+        if (snapshot_remaining > 0) snapshot_remaining--;
+    } else {
+        int index = find_rule(m->ip_range, m->port_range);
+        if (m->op == 'A' && index < 0) {
+            append_rule(m->ip_range, m->port_range, m->id);
+        } else if (m->op == 'D' && index >= 0) {
+            remove_rule(index);
+        }
+        rule_version = m->version - 1;
+        publish_mutation(m->op, m->id, m->ip_range, m->port_range);
+    }
+    // Snapshots arrive a rule at a time; index them once complete
+    if (snapshot_remaining == 0) rebuild_classifiers();
+    pthread_cond_broadcast(&mutation_applied);
+    pthread_mutex_unlock(&lock);
+}
+void ignore_response(int status, const char *response, void *arg) {
+}
+// Sends queued hits to the leader as H requests, so that its query logs
+// cover checks answered here. With wait set, returns once they are logged.
+void send_hits(char *hits, bool wait) {
+    pthread_mutex_lock(&lock);
+    size_t len = pending_hits_len;
+    if (len > 0) memcpy(hits, pending_hits, len);
+    pending_hits_len = 0;
+    pthread_mutex_unlock(&lock);
+    char line[HIT_REPORT_LINE_SIZE + 3], response[BUFFER_SIZE];
+    size_t start = 0;
+    while (start < len) {
+        // Hits are "<ip> <port> " pairs: cut after the last whole pair
+        // that fits in one request
+        size_t end = start, cut = start;
+        int spaces = 0;
+        while (end < len && end - start < HIT_REPORT_LINE_SIZE) {
+            if (hits[end++] == ' ' && ++spaces % 2 == 0) cut = end;
+        }
+        snprintf(line, sizeof(line), "H %.*s", (int)(cut - start), hits + start);
+        if (wait) {
+            fw_pool_call(leader_pool, line, response, sizeof(response), LEADER_TIMEOUT_MS);
+        } else {
+            fw_call_async(fw_pool_get(leader_pool), line, LEADER_TIMEOUT_MS,
+                          ignore_response, NULL);
+        }
+        start = cut;
+    }
+}
+void *report_hits(void *arg) {
+    char *hits = malloc(MAX_PENDING_HITS);
+    for (;;) {
+        usleep(HIT_REPORT_INTERVAL_US);
+        send_hits(hits, false);
+    }
+    return NULL;
+}
+// Passes a write or listing to the leader. Called with lock held; the lock
+// is released for the round trip so local checks carry on meanwhile.
+void forward_to_leader(const char *request, char *response) {
+    pthread_mutex_unlock(&lock);
+    int status = fw_pool_call(leader_pool, request, response, BUFFER_SIZE, LEADER_TIMEOUT_MS);
+    pthread_mutex_lock(&lock);
+    if (status != FW_OK) {
+        strncpy(response, "Leader unavailable", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    // Read-your-writes: give the change a moment to arrive through the
+    // stream before answering, so a following check here sees it
+    char ip_range[IP_RANGE_SIZE], port_range[PORT_RANGE_SIZE];
+    bool added = strcmp(response, "Rule added") == 0;
+    bool deleted = strcmp(response, "Rule deleted") == 0;
+    if ((!added && !deleted) ||
+        sscanf(request + 2, "%63s %15s", ip_range, port_range) != 2) {
+        return;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    while ((find_rule(ip_range, port_range) >= 0) != added) {
+        if (pthread_cond_timedwait(&mutation_applied, &lock, &deadline) != 0) break;
+    }
+}
+// Replicates the leader's rule set before this server starts serving
+void start_hit_reporter();
+void start_follower(const char *leader) {
+    char host[256];
+    int port;
+    if (sscanf(leader, "%255[^:]:%d", host, &port) != 2) {
+        fprintf(stderr, "Invalid leader address: %s\n", leader);
+        exit(EXIT_FAILURE);
+    }
+    leader_pool = fw_pool_create(host, port, 2);
+    leader_watch = fw_connect(host, port, LEADER_TIMEOUT_MS);
+    unsigned long leader_version;
+    if (leader_pool == NULL || leader_watch == NULL ||
+        fw_watch(leader_watch, 0, apply_leader_mutation, NULL, LEADER_TIMEOUT_MS,
+                 &leader_version) != FW_OK) {
+        fprintf(stderr, "Failed to follow leader %s\n", leader);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&lock);
+    while (rule_version < leader_version || snapshot_remaining > 0) {
+        pthread_cond_wait(&mutation_applied, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    start_hit_reporter();
+    printf("Following leader %s at version %lu\n", leader, leader_version);
+}
+int shard_of(unsigned int ip) {
+    return (int)(((uint64_t)ip * shard_count) >> 32);
+}
+unsigned int shard_first_ip(int shard) {
+    return (unsigned int)((((uint64_t)shard << 32) + shard_count - 1) / shard_count);
+}
+void format_ip(unsigned int ip, char *out) {
+    struct in_addr addr = { .s_addr = htonl(ip) };
+    inet_ntop(AF_INET, &addr, out, INET_ADDRSTRLEN);
+}
+// Cuts a rule's IP range at shard boundaries, returning the number of
+// pieces. A range that fits one shard is kept exactly as written.
+int split_rule(const char *ip_range, int *shards, char pieces[][IP_RANGE_SIZE]) {
+    unsigned int start, end;
+    char ip_start[IP_RANGE_SIZE], ip_end[IP_RANGE_SIZE];
+    if (strchr(ip_range, '-') == NULL) {
+        ip_to_integer(ip_range, &start);
+        end = start;
+    } else {
+        sscanf(ip_range, "%63[^-]-%63s", ip_start, ip_end);
+        ip_to_integer(ip_start, &start);
+        ip_to_integer(ip_end, &end);
+    }
+    if (start > end || shard_of(start) == shard_of(end)) {
+        // An inverted range matches nothing; it lives with its start
+        shards[0] = shard_of(start);
+        strcpy(pieces[0], ip_range);
+        return 1;
+    }
+    int count = 0;
+    for (int shard = shard_of(start); shard <= shard_of(end); shard++) {
+        unsigned int first = shard_first_ip(shard);
+        unsigned int last = shard == shard_count - 1 ? UINT32_MAX : shard_first_ip(shard + 1) - 1;
+        char piece_start[INET_ADDRSTRLEN], piece_end[INET_ADDRSTRLEN];
+        format_ip(start > first ? start : first, piece_start);
+        format_ip(end < last ? end : last, piece_end);
+        shards[count] = shard;
+        snprintf(pieces[count++], IP_RANGE_SIZE, "%s-%s", piece_start, piece_end);
+    }
+    return count;
+}
+int find_shard_rule(int shard, const char *ip_range, const char *port_range) {
+    for (int i = 0; i < shard_rule_count; i++) {
+        if (shard_rules[i].shard == shard && strcmp(shard_rules[i].ip_range, ip_range) == 0 &&
+            strcmp(shard_rules[i].port_range, port_range) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+void retain_shard_rule(int shard, const char *ip_range, const char *port_range) {
+    int index = find_shard_rule(shard, ip_range, port_range);
+    if (index >= 0) {
+        shard_rules[index].refs++;
+        return;
+    }
+    if (shard_rule_count >= shard_rule_capacity) {
+        shard_rule_capacity = shard_rule_capacity > 0 ? shard_rule_capacity * 2 : INITIAL_CAPACITY;
+        shard_rules = realloc(shard_rules, shard_rule_capacity * sizeof(ShardRule));
+        if (shard_rules == NULL) {
+            perror("Failed to allocate memory for shard rules");
+            exit(1);
+        }
+    }
+    ShardRule *piece = &shard_rules[shard_rule_count++];
+    piece->shard = shard;
+    strcpy(piece->ip_range, ip_range);
+    strcpy(piece->port_range, port_range);
+    piece->refs = 1;
+}
+void release_shard_rule(int shard, const char *ip_range, const char *port_range) {
+    int index = find_shard_rule(shard, ip_range, port_range);
+    if (index >= 0 && --shard_rules[index].refs == 0) {
+        shard_rules[index] = shard_rules[--shard_rule_count];
+    }
+}
+// Sends "op piece port_range" for every selected piece, all in flight at
+// once. Records in done which shards now reflect the change, and in changed
+// which of them this call actually changed. Called without lock.
+bool update_shards(char op, const int *shards, char pieces[][IP_RANGE_SIZE],
+                   const char *port_range, const bool *selected, bool *done,
+                   bool *changed, int count) {
+    FwFuture *futures[MAX_SHARDS] = {0};
+    char request[BUFFER_SIZE], response[BUFFER_SIZE];
+    for (int i = 0; i < count; i++) {
+        if (!selected[i]) continue;
+        snprintf(request, sizeof(request), "%c %s %s", op, pieces[i], port_range);
+        futures[i] = fw_submit(fw_pool_get(shard_pools[shards[i]]), request, SHARD_TIMEOUT_MS);
+    }
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        done[i] = changed[i] = false;
+        if (!selected[i]) continue;
+        if (futures[i] != NULL &&
+            fw_future_wait(futures[i], response, sizeof(response)) == FW_OK) {
+            // Pieces the shard already had (or already lacked) count as done,
+            // but not as changed
+            changed[i] = strcmp(response, op == 'A' ? "Rule added" : "Rule deleted") == 0;
+            done[i] = changed[i] ||
+                      strcmp(response, op == 'A' ? "Rule already exists" : "Rule not found") == 0;
+        }
+        ok = ok && done[i];
+    }
+    return ok;
+}
+// Adds or deletes a rule on every shard it overlaps, undoing the pieces it
+// changed if any shard fails. Called with lock held; writes are
+// serialised by route_write_lock and lock is released for the round trips.
+void route_update(char op, const char *ip_range, const char *port_range, char *response) {
+    bool adding = op == 'A';
+    if (!is_valid_ip_range(ip_range) || !is_valid_port_range(port_range)) {
+        strncpy(response, adding ? "Invalid rule" : "Rule invalid", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock(&route_write_lock);
+    pthread_mutex_lock(&lock);
+    int index = find_rule(ip_range, port_range);
+    if (adding == (index >= 0)) {
+        strncpy(response, adding ? "Rule already exists" : "Rule not found", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        pthread_mutex_unlock(&route_write_lock);
+        return;
+    }
+    int shards[MAX_SHARDS];
+    char pieces[MAX_SHARDS][IP_RANGE_SIZE];
+    bool selected[MAX_SHARDS], done[MAX_SHARDS], changed[MAX_SHARDS];
+    bool undone[MAX_SHARDS], unchanged[MAX_SHARDS];
+    int count = split_rule(ip_range, shards, pieces);
+    for (int i = 0; i < count; i++) {
+        // Only the first rule to use a piece installs it, only the last removes it
+        int piece = find_shard_rule(shards[i], pieces[i], port_range);
+        selected[i] = adding ? piece < 0 : piece >= 0 && shard_rules[piece].refs == 1;
+    }
+    pthread_mutex_unlock(&lock);
+    bool ok = update_shards(op, shards, pieces, port_range, selected, done, changed, count);
+    if (!ok) {
+        update_shards(adding ? 'D' : 'A', shards, pieces, port_range, changed, undone,
+                      unchanged, count);
+    }
+    pthread_mutex_lock(&lock);
+    if (ok) {
+        for (int i = 0; i < count; i++) {
+            if (adding) {
+                retain_shard_rule(shards[i], pieces[i], port_range);
+            } else {
+                release_shard_rule(shards[i], pieces[i], port_range);
+            }
+        }
+        if (adding) {
+            FirewallRule *rule = append_rule(ip_range, port_range, next_rule_id++);
+            publish_mutation('A', rule->id, rule->ip_range, rule->port_range);
+        } else {
+            publish_mutation('D', rules[index].id, ip_range, port_range);
+            remove_rule(index);
+        }
+        rebuild_classifiers();
+    }
+    strncpy(response, !ok ? "Shard unavailable" : adding ? "Rule added" : "Rule deleted",
+            BUFFER_SIZE - 1);
+    response[BUFFER_SIZE - 1] = '\0';
+    pthread_mutex_unlock(&route_write_lock);
+}
+// Asks the shard owning ip. Called with lock held; released for the round trip.
+void route_check(const char *ip, int port, char *response) {
+    unsigned int ip_int;
+    if (!ip_to_integer(ip, &ip_int) || port < 0 || port > 65535) {
+        strncpy(response, "Illegal IP address or port specified", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return;
+    }
+    char request[BUFFER_SIZE];
+    snprintf(request, sizeof(request), "C %s %d", ip, port);
+    pthread_mutex_unlock(&lock);
+    int status = fw_pool_call(shard_pools[shard_of(ip_int)], request, response,
+                              BUFFER_SIZE, SHARD_TIMEOUT_MS);
+    pthread_mutex_lock(&lock);
+    if (status != FW_OK) {
+        strncpy(response, "Shard unavailable", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+    }
+}
+// Lists every rule with the queries its pieces logged across the shards.
+// A piece shared by several rules is credited to the first of them, which
+// is the rule a single server would have matched. Called with lock held.
+void route_list(char *response) {
+    char (*listings)[BUFFER_SIZE + 1] = malloc(shard_count * sizeof(*listings));
+    FwFuture *futures[MAX_SHARDS];
+    pthread_mutex_unlock(&lock);
+    for (int shard = 0; shard < shard_count; shard++) {
+        futures[shard] = fw_submit(fw_pool_get(shard_pools[shard]), "L", SHARD_TIMEOUT_MS);
+    }
+    bool ok = true;
+    for (int shard = 0; shard < shard_count; shard++) {
+        // A leading newline lets every header be found as "\nRule: ..."
+        listings[shard][0] = '\n';
+        if (futures[shard] == NULL ||
+            fw_future_wait(futures[shard], listings[shard] + 1, BUFFER_SIZE) != FW_OK) {
+            ok = false;
+        }
+    }
+    pthread_mutex_lock(&lock);
+    response[0] = '\0';
+    if (!ok) {
+        strncpy(response, "Shard unavailable", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        free(listings);
+        return;
+    }
+    char temp[BUFFER_SIZE];
+    int shards[MAX_SHARDS];
+    char pieces[MAX_SHARDS][IP_RANGE_SIZE];
+    for (int i = 0; i < rule_count; i++) {
+        snprintf(temp, BUFFER_SIZE - 1, "Rule: %s %s\n", rules[i].ip_range, rules[i].port_range);
+        strncat(response, temp, BUFFER_SIZE - strlen(response) - 1);
+        int count = split_rule(rules[i].ip_range, shards, pieces);
+        for (int j = 0; j < count; j++) {
+            snprintf(temp, BUFFER_SIZE - 1, "\nRule: %s %s\n", pieces[j], rules[i].port_range);
+            char *header = strstr(listings[shards[j]], temp);
+            if (header == NULL) continue;
+            // Claim the piece so that later rules sharing it skip its queries
+            header[1] = '#';
+            char *line = header + strlen(temp);
+            while (strncmp(line, "Query: ", 7) == 0) {
+                char *next = strchr(line, '\n');
+                size_t len = next != NULL ? (size_t)(next - line + 1) : strlen(line);
+                size_t room = BUFFER_SIZE - strlen(response) - 1;
+                strncat(response, line, len < room ? len : room);
+                if (next == NULL) break;
+                line = next + 1;
+            }
+        }
+    }
+    if (rule_count == 0) {
+        strncat(response, "No rules found\n", BUFFER_SIZE - strlen(response) - 1);
+    }
+    free(listings);
+}
+// Splits a hit report by owning shard. Called with lock held.
+void route_hits(const char *hits, char *response) {
+    char (*lines)[BUFFER_SIZE] = malloc(shard_count * sizeof(*lines));
+    for (int shard = 0; shard < shard_count; shard++) {
+        strcpy(lines[shard], "H");
+    }
+    char ip[INET_ADDRSTRLEN];
+    unsigned int ip_int;
+    int port, consumed;
+    while (sscanf(hits, "%15s %d%n", ip, &port, &consumed) == 2) {
+        hits += consumed;
+        if (!ip_to_integer(ip, &ip_int) || port < 0 || port > 65535) continue;
+        char *line = lines[shard_of(ip_int)];
+        size_t len = strlen(line);
+        snprintf(line + len, BUFFER_SIZE - len, " %s %d", ip, port);
+    }
+    pthread_mutex_unlock(&lock);
+    for (int shard = 0; shard < shard_count; shard++) {
+        if (lines[shard][1] != '\0') {
+            fw_call_async(fw_pool_get(shard_pools[shard]), lines[shard], SHARD_TIMEOUT_MS,
+                          ignore_response, NULL);
+        }
+    }
+    free(lines);
+    pthread_mutex_lock(&lock);
+    strncpy(response, "Hits recorded", BUFFER_SIZE - 1);
+    response[BUFFER_SIZE - 1] = '\0';
+}
+// Handles the requests a router passes on to its shards. Returns false for
+// anything else, including malformed requests, which are answered locally.
+bool route_request(const char *request, char *response) {
+    char ip_range[IP_RANGE_SIZE] = {0};
+    char port_range[PORT_RANGE_SIZE] = {0};
+    char ip[INET_ADDRSTRLEN] = {0};
+    int port;
+    if ((request[0] == 'A' || request[0] == 'D') && request[1] == ' ' &&
+        sscanf(request + 2, "%63s %15s", ip_range, port_range) == 2) {
+        route_update(request[0], ip_range, port_range, response);
+    } else if (strncmp(request, "C ", 2) == 0 &&
+               sscanf(request + 2, "%15s %d", ip, &port) == 2) {
+        route_check(ip, port, response);
+    } else if (strcmp(request, "L") == 0) {
+        route_list(response);
+    } else if (strncmp(request, "H ", 2) == 0) {
+        route_hits(request + 2, response);
+    } else {
+        return false;
+    }
+    return true;
+}
+// Sends a check to the shard owning its address without waiting for the
+// answer; *future is NULL if it could not be sent. Returns false for
+// anything but a well-formed check. Called with lock held.
+bool submit_routed_check(const char *request, FwFuture **future) {
+    char trimmed_request[BUFFER_SIZE] = {0};
+    strncpy(trimmed_request, request, BUFFER_SIZE - 1);
+    trim_whitespace(trimmed_request);
+    char ip[INET_ADDRSTRLEN] = {0};
+    unsigned int ip_int;
+    int port;
+    if (strncmp(trimmed_request, "C ", 2) != 0 ||
+        sscanf(trimmed_request + 2, "%15s %d", ip, &port) != 2 ||
+        !ip_to_integer(ip, &ip_int) || port < 0 || port > 65535) {
+        return false;
+    }
+    record_request(trimmed_request);
+    char check[BUFFER_SIZE];
+    snprintf(check, sizeof(check), "C %s %d", ip, port);
+    pthread_mutex_unlock(&lock);
+    *future = fw_submit(fw_pool_get(shard_pools[shard_of(ip_int)]), check, SHARD_TIMEOUT_MS);
+    pthread_mutex_lock(&lock);
+    return true;
+}
+// Connects to the shards, which must start out empty: each owns an equal
+// share of the IPv4 space, in the order given
+void start_router(const char *shards) {
+    char list[BUFFER_SIZE];
+    strncpy(list, shards, BUFFER_SIZE - 1);
+    list[BUFFER_SIZE - 1] = '\0';
+    char *saveptr;
+    for (char *shard = strtok_r(list, ",", &saveptr); shard != NULL;
+         shard = strtok_r(NULL, ",", &saveptr)) {
+        char host[256], response[BUFFER_SIZE];
+        int port;
+        if (shard_count == MAX_SHARDS || sscanf(shard, "%255[^:]:%d", host, &port) != 2) {
+            fprintf(stderr, "Invalid shard address: %s\n", shard);
+            exit(EXIT_FAILURE);
+        }
+        FwPool *pool = fw_pool_create(host, port, 2);
+        if (pool == NULL ||
+            fw_pool_call(pool, "R", response, sizeof(response), SHARD_TIMEOUT_MS) != FW_OK) {
+            fprintf(stderr, "Failed to reach shard %s\n", shard);
+            exit(EXIT_FAILURE);
+        }
+        shard_pools[shard_count++] = pool;
+    }
+    if (shard_count == 0) {
+        fprintf(stderr, "No shards given\n");
+        exit(EXIT_FAILURE);
+    }
+    // Rules inherited through a takeover are already on the shards
+    int pieces_shards[MAX_SHARDS];
+    char pieces[MAX_SHARDS][IP_RANGE_SIZE];
+    for (int i = 0; i < rule_count; i++) {
+        int count = split_rule(rules[i].ip_range, pieces_shards, pieces);
+        for (int j = 0; j < count; j++) {
+            retain_shard_rule(pieces_shards[j], pieces[j], rules[i].port_range);
+        }
+    }
+    printf("Routing to %d shards\n", shard_count);
+}
+int open_handoff_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int handoff_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);  // left behind by a predecessor
+    if (handoff_fd < 0 || bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(handoff_fd, 1) < 0) {
+        perror("Handoff socket setup failed");
+        exit(EXIT_FAILURE);
+    }
+    // A successor dying mid-snapshot must not take this process with it
+    signal(SIGPIPE, SIG_IGN);
+    return handoff_fd;
+}
+// Receives the listening sockets and state of the server whose handoff
+// socket is at path. That server keeps serving until the state is loaded.
+void take_over(const char *path, int *server_fd, int *datagram_fd) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Takeover connect failed");
+        exit(EXIT_FAILURE);
+    }
+    char tag;
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg;
+    if (recvmsg(sock, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Takeover handshake failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+    *server_fd = fds[0];
+    *datagram_fd = received > 1 ? fds[1] : -1;
+    FILE *in = fdopen(sock, "r");
+    pthread_mutex_lock(&lock);
+    bool loaded = in != NULL && read_snapshot(in);
+    unsigned long version = rule_version;
+    int count = rule_count;
+    pthread_mutex_unlock(&lock);
+    // The predecessor stops accepting once it has the acknowledgement
+    if (!loaded || write(sock, "K", 1) != 1) {
+        fprintf(stderr, "Takeover snapshot incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+    printf("Took over at version %lu with %d rules\n", version, count);
+}
+void start_hit_reporter() {
+    pthread_t reporter;
+    pthread_create(&reporter, NULL, report_hits, NULL);
+    pthread_detach(reporter);
+}
+// Writes wait while a handoff is under way, and are then forwarded if it
+// succeeded. Called with lock held.
+void wait_for_handoff() {
+    while (handing_off) pthread_cond_wait(&handoff_finished, &lock);
+}
+// Sends all of data, or gives up once timeout_ms have passed
+bool send_within(int sock, const char *data, size_t len, int timeout_ms) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    while (len > 0) {
+        long remaining = timeout_ms - elapsed_us(&started) / 1000;
+        struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+        int ready = remaining > 0 ? poll(&pfd, 1, remaining) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready != 1) return false;
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+// Copies the snapshot into an anonymous file, so it can be sent without
+// holding any lock. Returns its mapping, or NULL.
+char *capture_snapshot(size_t *len) {
+    int image = memfd_create("handoff", MFD_CLOEXEC);
+    if (image < 0) return NULL;
+    write_lock_rules();
+    lock_cores();
+    bool written = write_snapshot(image, NULL);
+    unlock_cores();
+    write_unlock_rules();
+    off_t size = lseek(image, 0, SEEK_CUR);
+    char *data = written && size > 0 ?
+        mmap(NULL, size, PROT_READ, MAP_SHARED, image, 0) : MAP_FAILED;
+    close(image);
+    if (data == MAP_FAILED) return NULL;
+    *len = size;
+    return data;
+}
+// Gives the listening sockets and a snapshot to the successor connected on
+// sock, and returns whether it loaded them. Writes wait until
+// finish_handoff. Runs on a thread of its own, so accepting carries on.
+bool hand_off(int sock, int server_fd, int datagram_fd) {
+    int fds[2] = { server_fd, datagram_fd };
+    int count = datagram_fd >= 0 ? 2 : 1;
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    char tag = 'F';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                          .msg_controllen = CMSG_SPACE(count * sizeof(int)) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    // No writes may land here between the snapshot and the switch to
+    // forwarding, so they wait until the successor has loaded it. Checks
+    // carry on meanwhile; their hits follow the snapshot.
+    pthread_mutex_lock(&lock);
+    handing_off = true;
+    size_t len = 0;
+    char *image = capture_snapshot(&len);
+    pthread_mutex_unlock(&lock);
+    char ack = 0;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    bool ok = image != NULL && sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 &&
+              send_within(sock, image, len, LEADER_TIMEOUT_MS) &&
+              poll(&pfd, 1, LEADER_TIMEOUT_MS) == 1 && read(sock, &ack, 1) == 1 && ack == 'K';
+    if (image != NULL) munmap(image, len);
+    close(sock);
+    return ok;
+}
+// Lets writes through again once the successor has answered. After a
+// handoff this process serves its remaining connections as a follower of
+// the successor, so writes and query logs end up there. Runs on the accept
+// thread once it has stopped accepting, so that the connections to the
+// successor are not accepted here.
+void finish_handoff(bool ok, int server_fd) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    getsockname(server_fd, (struct sockaddr *)&address, &addrlen);
+    pthread_mutex_lock(&lock);
+    bool follow = ok && leader_pool == NULL;
+    if (follow) {
+        leader_pool = fw_pool_create("127.0.0.1", ntohs(address.sin_port), 2);
+    }
+    if (ok) {
+        // Subscribers reconnect to the successor and resume from there
+        for (ClientConnection *conn = subscribers; conn != NULL; conn = conn->next_subscriber) {
+            pthread_mutex_lock(&conn->push_lock);
+            conn->push_overflow = true;
+            pthread_mutex_unlock(&conn->push_lock);
+            wake_subscriber(conn);
+        }
+    }
+    handing_off = false;
+    if (!ok && leader_pool == NULL && pending_hits_len > 0) {
+        // Still the leader: the queued hits are logged here after all
+        char *hits = strndup(pending_hits, pending_hits_len);
+        char ignored[BUFFER_SIZE];
+        pending_hits_len = 0;
+        record_hits(hits, ignored);
+        free(hits);
+    }
+    pthread_cond_broadcast(&handoff_finished);
+    unsigned long version = rule_version;
+    pthread_mutex_unlock(&lock);
+    if (!ok) {
+        fprintf(stderr, "Handoff failed, still serving\n");
+        return;
+    }
+    if (follow) {
+        leader_watch = fw_connect("127.0.0.1", ntohs(address.sin_port), LEADER_TIMEOUT_MS);
+        if (leader_watch == NULL || fw_watch(leader_watch, version, apply_leader_mutation, NULL,
+                                             LEADER_TIMEOUT_MS, NULL) != FW_OK) {
+            fprintf(stderr, "Failed to follow successor\n");
+        }
+        start_hit_reporter();
+    }
+    printf("Handed off at version %lu, draining\n", version);
+}
+typedef struct {
+    int sock;
+    int server_fd;
+    int datagram_fd;
+    int done_fd;  // eventfd: 1 once handed off, 2 if this process carries on
+} Handoff;
+
+void *run_handoff(void *arg) {
+    Handoff *handoff = arg;
+    uint64_t result = hand_off(handoff->sock, handoff->server_fd, handoff->datagram_fd) ? 1 : 2;
+    if (write(handoff->done_fd, &result, sizeof(result)) < 0) {
+        perror("Failed to report handoff");
+    }
+    free(handoff);
+    return NULL;
+}
+// Starts handing off to a successor connecting on handoff_fd. The accept
+// loop then watches done_fd, rather than handoff_fd, for the outcome.
+bool start_handoff(int handoff_fd, int done_fd, int server_fd, int datagram_fd) {
+    int sock = accept(handoff_fd, NULL, NULL);
+    if (sock < 0) return false;
+    Handoff *handoff = malloc(sizeof(Handoff));
+    *handoff = (Handoff){ sock, server_fd, datagram_fd, done_fd };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_handoff, handoff) != 0) {
+        close(sock);
+        free(handoff);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+// NUMA node of a CPU, from sysfs; 0 when the kernel reports none
+int node_of_cpu(int cpu) {
+    char path[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    int node = 0;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+    }
+    if (dir != NULL) closedir(dir);
+    return node;
+}
+// Parses a list like "0-3,8" into worker_cpus and, with replicate set,
+// creates a classifier replica for each NUMA node among them
+void configure_affinity(const char *list, bool replicate) {
+    char copy[BUFFER_SIZE];
+    strncpy(copy, list, BUFFER_SIZE - 1);
+    copy[BUFFER_SIZE - 1] = '\0';
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        int first, last;
+        int fields = sscanf(item, "%d-%d", &first, &last);
+        if (fields == 1) last = first;
+        if (fields < 1 || first < 0 || last < first || last >= CPU_SETSIZE) {
+            fprintf(stderr, "Invalid CPU list: %s\n", list);
+            exit(EXIT_FAILURE);
+        }
+        for (int cpu = first; cpu <= last && worker_cpu_count < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed)) {
+                fprintf(stderr, "CPU %d is offline or not available to this process\n", cpu);
+                exit(EXIT_FAILURE);
+            }
+            worker_cpus[worker_cpu_count++] = cpu;
+        }
+    }
+    if (replicate) {
+        // Replicas replace the unplaced default table
+        classifier_destroy(classifiers[0]);
+        classifier_count = 0;
+    }
+    int replica_nodes[MAX_NODES];
+    for (int i = 0; i < worker_cpu_count; i++) {
+        int cpu = worker_cpus[i];
+        cpu_replica[cpu] = 0;
+        if (!replicate) continue;
+        int node = node_of_cpu(cpu);
+        int replica = 0;
+        while (replica < classifier_count && replica_nodes[replica] != node) replica++;
+        if (replica == MAX_NODES) {
+            replica = 0;
+        } else if (replica == classifier_count) {
+            replica_nodes[replica] = node;
+            classifiers[classifier_count++] = classifier_create(node);
+        }
+        cpu_replica[cpu] = replica;
+    }
+    printf("Pinning workers to %d CPUs with %d classifier %s\n", worker_cpu_count,
+           classifier_count, classifier_count == 1 ? "copy" : "replicas");
+}
+// Spreads connection threads over the configured CPUs, round robin
+void init_worker_attr(pthread_attr_t *attr, bool first_cpu) {
+    pthread_attr_init(attr);
+    if (worker_cpu_count == 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int next = first_cpu ? 0 : __atomic_fetch_add(&next_worker_cpu, 1, __ATOMIC_RELAXED);
+    CPU_SET(worker_cpus[next % worker_cpu_count], &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+// Selects the classifier replica on the calling thread's node
+void place_thread() {
+    int cpu = sched_getcpu();
+    if (worker_cpu_count > 0 && cpu >= 0 && cpu < CPU_SETSIZE) {
+        thread_replica = cpu_replica[cpu];
+        thread_core = core_replicas[cpu];
+    }
+}
+void grow_core_rules(CoreReplica *core) {
+    core->rule_capacity = core->rule_capacity > 0 ? core->rule_capacity * 2 : INITIAL_CAPACITY;
+    size_t size = core->rule_capacity * sizeof(FirewallRule);
+    core->rules = region_realloc(core->rules, &size, core->node);
+    core->rule_capacity = size / sizeof(FirewallRule);
+}
+// Each replica, with its rule table and classifier, is placed on its CPU's
+// node
+void start_core_replicas() {
+    for (int i = 0; i < worker_cpu_count; i++) {
+        int cpu = worker_cpus[i];
+        if (core_replicas[cpu] != NULL) continue;
+        int node = node_of_cpu(cpu);
+        size_t size = sizeof(CoreReplica);
+        CoreReplica *core = region_alloc(&size, node);
+        pthread_mutex_init(&core->lock, NULL);
+        core->node = node;
+        core->classifier = classifier_create(node);
+        grow_core_rules(core);
+        core_replicas[cpu] = core;
+        core_list[core_count++] = core;
+    }
+    printf("Shared-nothing replicas on %d CPUs\n", core_count);
+}
+// Applies the replica's queued changes. Called with its lock held.
+void catch_up_core(CoreReplica *core) {
+    unsigned long tail = __atomic_load_n(&core->tail, __ATOMIC_ACQUIRE);
+    for (; core->head < tail; core->applied++) {
+        CoreMutation *m = &core->queue[core->head % CORE_QUEUE_SIZE];
+        if (m->op == 'A' || m->op == 'K') {
+            if (core->rule_count == core->rule_capacity) grow_core_rules(core);
+            FirewallRule *rule = &core->rules[core->rule_count++];
+            if (m->op == 'K') {
+                *rule = core->previous[m->index];
+                core->previous[m->index].queries = NULL;
+            } else {
+                memset(rule, 0, sizeof(*rule));
+                rule->id = m->id;
+                rule->query_capacity = INITIAL_CAPACITY;
+                rule->queries = malloc(rule->query_capacity * sizeof(*rule->queries));
+            }
+            classifier_append(core->classifier, &m->rule);
+        } else if (m->op == 'D') {
+            free(core->rules[m->index].queries);
+            memmove(&core->rules[m->index], &core->rules[m->index + 1],
+                    (core->rule_count - m->index - 1) * sizeof(FirewallRule));
+            core->rule_count--;
+            classifier_remove(core->classifier, m->index);
+        } else if (m->op == 'X') {
+            core->previous = core->rules;
+            core->previous_count = core->rule_count;
+            core->rules = NULL;
+            core->rule_count = core->rule_capacity = 0;
+            grow_core_rules(core);
+            classifier_clear(core->classifier);
+        } else if (m->op == 'F') {
+            for (int i = 0; i < core->previous_count; i++) free(core->previous[i].queries);
+            region_free(core->previous);
+            core->previous = NULL;
+            core->previous_count = 0;
+        }
+        __atomic_store_n(&core->head, core->head + 1, __ATOMIC_RELEASE);
+    }
+    // The index is left to the builder thread
+}
+// Called with lock held, the only producer
+void queue_core_mutation(const CoreMutation *m) {
+    if (!shared_nothing) return;
+    core_sequence++;
+    for (int i = 0; i < core_count; i++) {
+        CoreReplica *core = core_list[i];
+        if (core->tail - __atomic_load_n(&core->head, __ATOMIC_ACQUIRE) == CORE_QUEUE_SIZE) {
+            // Full: catch the replica up on its behalf
+            pthread_mutex_lock(&core->lock);
+            catch_up_core(core);
+            pthread_mutex_unlock(&core->lock);
+        }
+        core->queue[core->tail % CORE_QUEUE_SIZE] = *m;
+        __atomic_store_n(&core->tail, core->tail + 1, __ATOMIC_RELEASE);
+    }
+}
+// The version barrier: returns once every replica has applied every queued
+// change, applying them itself where a replica's CPU has not got to it.
+// Called with lock held.
+void sync_cores() {
+    for (int i = 0; i < core_count; i++) {
+        CoreReplica *core = core_list[i];
+        pthread_mutex_lock(&core->lock);
+        catch_up_core(core);
+        pthread_mutex_unlock(&core->lock);
+    }
+}
+// Holds every replica still, caught up, for reading their queries
+void lock_cores() {
+    for (int i = 0; i < core_count; i++) {
+        pthread_mutex_lock(&core_list[i]->lock);
+        catch_up_core(core_list[i]);
+    }
+}
+void unlock_cores() {
+    for (int i = core_count - 1; i >= 0; i--) pthread_mutex_unlock(&core_list[i]->lock);
+}
+// Parses a check for the paths that answer without lock, recording it in
+// the request history. Returns false for anything else.
+bool parse_unlocked_check(const char *request, char *ip, int *port) {
+    char trimmed_request[BUFFER_SIZE] = {0};
+    if (request[0] != 'C') return false;
+    strncpy(trimmed_request, request, BUFFER_SIZE - 1);
+    trim_whitespace(trimmed_request);
+    if (strncmp(trimmed_request, "C ", 2) != 0 ||
+        sscanf(trimmed_request + 2, "%15s %d", ip, port) != 2) {
+        return false;
+    }
+    if (__atomic_load_n(&request_count, __ATOMIC_RELAXED) < MAX_REQUESTS) {
+        // The request history fills up early on; until then it needs lock
+        pthread_mutex_lock(&lock);
+        record_request(trimmed_request);
+        pthread_mutex_unlock(&lock);
+    }
+    return true;
+}
+// Answers a check from the calling thread's replica. Returns false if the
+// hit was left unrecorded because a handoff began meanwhile.
+bool check_on_core(CoreReplica *core, const char *ip, unsigned int ip_int, int port, bool *accepted) {
+    pthread_mutex_lock(&core->lock);
+    catch_up_core(core);
+    int index = classifier_match(core->classifier, ip_int, port);
+    bool recorded = !__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE);
+    if (index >= 0 && recorded) {
+        record_query(&core->rules[index], ip, port);
+        if (query_log_dir != NULL) log_query(core->rules[index].id, ip, port);
+    }
+    pthread_mutex_unlock(&core->lock);
+    *accepted = index >= 0;
+    return recorded;
+}
+// Answers a check under rule_set_lock and the matched rule's stripe, with
+// the same result as check_on_core
+bool check_striped(const char *ip, unsigned int ip_int, int port, bool *accepted) {
+    pthread_rwlock_rdlock(&rule_set_lock);
+    int index = classifier_match(classifiers[thread_replica], ip_int, port);
+    bool recorded = !__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE);
+    if (index >= 0 && recorded) {
+        record_rule_query(&rules[index], ip, port);
+        if (query_log_dir != NULL) log_query(rules[index].id, ip, port);
+    }
+    pthread_rwlock_unlock(&rule_set_lock);
+    *accepted = index >= 0;
+    return recorded;
+}
+// Answers a check without taking lock, from the thread's replica with -P
+// or under striped locks with -k. Returns false for anything else, and
+// while draining after a handoff, when accepted checks go to the successor.
+bool answer_unlocked(const char *request, char *response) {
+    CoreReplica *core = thread_core;
+    char ip[INET_ADDRSTRLEN] = {0};
+    int port;
+    if ((core == NULL && lock_stripes == 0) || __atomic_load_n(&leader_pool, __ATOMIC_ACQUIRE) != NULL ||
+        __atomic_load_n(&handing_off, __ATOMIC_ACQUIRE) || !parse_unlocked_check(request, ip, &port)) {
+        return false;
+    }
+    unsigned int ip_int;
+    if (!is_valid_ip(ip) || port < 0 || port > 65535 || !ip_to_integer(ip, &ip_int)) {
+        strncpy(response, "Illegal IP address or port specified", BUFFER_SIZE - 1);
+        response[BUFFER_SIZE - 1] = '\0';
+        return true;
+    }
+    bool accepted;
+    bool recorded = core != NULL ? check_on_core(core, ip, ip_int, port, &accepted) :
+                                   check_striped(ip, ip_int, port, &accepted);
+    if (accepted && !recorded) {
+        // The snapshot for the successor was taken after the check began:
+        // the hit is queued with the others made during the handoff
+        char hit[INET_ADDRSTRLEN + 8], ignored[BUFFER_SIZE];
+        snprintf(hit, sizeof(hit), "%s %d", ip, port);
+        pthread_mutex_lock(&lock);
+        record_hits(hit, ignored);
+        pthread_mutex_unlock(&lock);
+    }
+    strncpy(response, accepted ? "Connection accepted" : "Connection rejected", BUFFER_SIZE - 1);
+    response[BUFFER_SIZE - 1] = '\0';
+    return true;
+}
+LockStripe *stripe_of(unsigned long id) {
+    return &stripes[id % lock_stripes];
+}
+void lock_stripe(LockStripe *stripe) {
+    if (pthread_mutex_trylock(&stripe->lock) != 0) {
+        pthread_mutex_lock(&stripe->lock);
+        stripe->contended++;
+    }
+    stripe->acquired++;
+}
+// Writers are preferred so a steady stream of checks cannot hold off rule
+// changes
+void start_lock_stripes() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&rule_set_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (lock_stripes == 0) return;
+    stripes = aligned_alloc(64, lock_stripes * sizeof(LockStripe));
+    for (int i = 0; i < lock_stripes; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        stripes[i].acquired = stripes[i].contended = 0;
+    }
+}
+// Asks the builder thread for indexes once a change has dropped them.
+// -P cores may not have applied the change yet, so they are assumed stale
+// unless the engine has no index. Called with lock held.
+void rebuild_classifiers() {
+    if (!classifier_stale(classifiers[0]) &&
+        (core_count == 0 || classifiers[0]->engine == CLASSIFIER_LINEAR)) {
+        return;
+    }
+    build_requested = true;
+    pthread_cond_signal(&build_wake);
+}
+// Whether target t, one of classifiers[] and then each -P core's, still
+// has built's rules and no index. If so and install is set, index goes in
+// it. Called with lock held.
+bool offer_built_index(int t, const Classifier *built, bool install, void *index) {
+    CoreReplica *core = t < classifier_count ? NULL : core_list[t - classifier_count];
+    Classifier *target = core == NULL ? classifiers[t] : core->classifier;
+    if (core != NULL) {
+        pthread_mutex_lock(&core->lock);
+        catch_up_core(core);
+    }
+    bool wanted = (core == NULL || core->previous == NULL) && classifier_stale(target) &&
+                  classifier_same_rules(target, built);
+    if (wanted && install) {
+        if (core == NULL) write_lock_rules();
+        classifier_install(target, index);
+        if (core == NULL) write_unlock_rules();
+    }
+    if (core != NULL) pthread_mutex_unlock(&core->lock);
+    return wanted;
+}
+// Builds with lock released, so checks and changes carry on meanwhile
+void *build_unlocked(const Classifier *built) {
+    pthread_mutex_unlock(&lock);
+    void *index = classifier_build(built);
+    pthread_mutex_lock(&lock);
+    return index;
+}
+// Builds indexes, one rule set at a time. The rules are copied under lock
+// and built without it, and checks scan until the result is installed.
+// Engines that can share build once for every target, the others once per
+// target on its node. A change made meanwhile
+// asks for another round, which supersedes what is left of this one.
+void *run_classifier_builder(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (!build_requested) pthread_cond_wait(&build_wake, &lock);
+        build_requested = false;
+        Classifier *built = classifier_create(-1);
+        for (int i = 0; i < classifiers[0]->count; i++) {
+            classifier_append(built, &classifiers[0]->rules[i]);
+        }
+        bool shares = classifier_engine_shares(built->engine);
+        bool shared_built = false;
+        void *shared = NULL;
+        for (int t = 0; t < classifier_count + core_count && !build_requested; t++) {
+            if (!offer_built_index(t, built, false, NULL)) continue;
+            void *index;
+            if (!shares) {
+                built->node = t < classifier_count ? classifiers[t]->node :
+                              core_list[t - classifier_count]->node;
+                index = build_unlocked(built);
+            } else {
+                if (!shared_built) shared = build_unlocked(built);
+                shared_built = true;
+                index = classifier_share(built, shared);
+            }
+            if (!offer_built_index(t, built, true, index)) classifier_discard(built, index);
+        }
+        classifier_discard(built, shared);
+        classifier_destroy(built);
+    }
+    return NULL;
+}
+void start_classifier_builder() {
+    pthread_t builder;
+    if (pthread_create(&builder, NULL, run_classifier_builder, NULL) != 0) {
+        perror("Failed to start the classifier builder");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(builder);
+}
+// Taken, with lock held, around every change to rules[] or the classifiers
+void write_lock_rules() {
+    if (lock_stripes == 0) return;
+    pthread_rwlock_wrlock(&rule_set_lock);
+    rule_set_exclusive++;
+}
+void write_unlock_rules() {
+    if (lock_stripes > 0) pthread_rwlock_unlock(&rule_set_lock);
+}
+// Checks record queries concurrently under the rule's stripe; anything
+// else touching a rule's queries takes the stripe too
+void record_rule_query(FirewallRule *rule, const char *ip, int port) {
+    if (lock_stripes == 0) {
+        record_query(rule, ip, port);
+        return;
+    }
+    LockStripe *stripe = stripe_of(rule->id);
+    lock_stripe(stripe);
+    record_query(rule, ip, port);
+    pthread_mutex_unlock(&stripe->lock);
+}
+void end_connection() {
+    pthread_mutex_lock(&lock);
+    if (--active_connections == 0) pthread_cond_broadcast(&connections_drained);
+    pthread_mutex_unlock(&lock);
+}
+// Connection state is first written by its own pinned thread, so fresh
+// pages from mmap end up on that thread's node
+ClientConnection *allocate_connection() {
+    if (worker_cpu_count == 0) return calloc(1, sizeof(ClientConnection));
+    void *conn = mmap(NULL, sizeof(ClientConnection), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return conn == MAP_FAILED ? NULL : conn;
+}
+void free_connection(ClientConnection *conn) {
+    if (worker_cpu_count == 0) {
+        free(conn);
+    } else {
+        munmap(conn, sizeof(ClientConnection));
+    }
+}
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+long elapsed_ns(const struct timespec *since, const struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) * 1000000000L + (now->tv_nsec - since->tv_nsec);
+}
+// Spins until ready(arg) holds, for at most the thread's spin window and
+// within its CPU budget. Returns false when the caller should block. The
+// window grows to twice any wait that ended in it, and halves whenever
+// spinning comes up empty.
+bool spin_until(bool (*ready)(void *), void *arg) {
+    if (busy_poll_budget == 0) return false;
+    SpinState *state = &spin_state;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (state->window_ns == 0 || elapsed_ns(&state->period_start, &start) >= BUSY_POLL_PERIOD_NS) {
+        if (state->window_ns == 0) state->window_ns = BUSY_POLL_MAX_SPIN_NS;
+        state->period_start = start;
+        state->spun_ns = 0;
+    }
+    long allowed = (elapsed_ns(&state->period_start, &start) + state->window_ns) *
+                   busy_poll_budget / 100 - state->spun_ns;
+    long window = allowed < state->window_ns ? allowed : state->window_ns;
+    if (window <= 0) return false;
+    long spun = 0;
+    do {
+        if (ready(arg)) {
+            if (spun * 2 > state->window_ns) {
+                state->window_ns = spun * 2 < BUSY_POLL_MAX_SPIN_NS ? spun * 2 : BUSY_POLL_MAX_SPIN_NS;
+            }
+            state->spun_ns += spun;
+            return true;
+        }
+        cpu_relax();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        spun = elapsed_ns(&start, &now);
+    } while (spun < window);
+    state->spun_ns += spun;
+    if (state->window_ns / 2 >= BUSY_POLL_MIN_SPIN_NS) state->window_ns /= 2;
+    return false;
+}
+typedef struct {
+    struct pollfd *fds;
+    int count;
+} PollSet;
+bool poll_ready(void *arg) {
+    PollSet *set = arg;
+    return poll(set->fds, set->count, 0) > 0;
+}
+// Busy-polls fds before a blocking call on them. A green thread yields
+// instead: its loop has other connections to run.
+void spin_on_fds(struct pollfd *fds, int count) {
+    if (green_active()) return;
+    PollSet set = { fds, count };
+    spin_until(poll_ready, &set);
+}
+// Lets the kernel poll the device queue for a socket's data too, where
+// the kernel supports it and allows the value
+void enable_socket_busy_poll(int sock) {
+#ifdef SO_BUSY_POLL
+    int usec = BUSY_POLL_MAX_SPIN_NS / 1000;
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#endif
+}
+bool worker_handed_socket(void *arg) {
+    return __atomic_load_n(&((IdleWorker *)arg)->sock, __ATOMIC_ACQUIRE) >= 0;
+}
+// Called by a connection thread once its connection is done: waits to be
+// handed the next one. Returns a socket of -1 if enough threads are idle
+// already.
+NewConnection wait_for_connection() {
+    IdleWorker worker = { .sock = -1 };
+    pthread_cond_init(&worker.wake, NULL);
+    pthread_mutex_lock(&idle_lock);
+    if (idle_worker_count >= MAX_IDLE_WORKERS) {
+        pthread_mutex_unlock(&idle_lock);
+        pthread_cond_destroy(&worker.wake);
+        return (NewConnection){ .sock = -1 };
+    }
+    worker.next = idle_workers;
+    idle_workers = &worker;
+    idle_worker_count++;
+    pthread_mutex_unlock(&idle_lock);
+    spin_until(worker_handed_socket, &worker);
+    pthread_mutex_lock(&idle_lock);
+    while (worker.sock < 0) pthread_cond_wait(&worker.wake, &idle_lock);
+    pthread_mutex_unlock(&idle_lock);
+    pthread_cond_destroy(&worker.wake);
+    return (NewConnection){ .sock = worker.sock, .pipelined = worker.pipelined };
+}
+// Gives a new connection to an idle connection thread, if there is one
+bool hand_to_idle_worker(int sock, bool pipelined) {
+    pthread_mutex_lock(&idle_lock);
+    IdleWorker *worker = idle_workers;
+    if (worker != NULL) {
+        idle_workers = worker->next;
+        idle_worker_count--;
+        worker->pipelined = pipelined;
+        __atomic_store_n(&worker->sock, sock, __ATOMIC_RELEASE);
+        pthread_cond_signal(&worker->wake);
+    }
+    pthread_mutex_unlock(&idle_lock);
+    return worker != NULL;
+}
+bool take_from_deque(WorkerDeque *deque, bool oldest, NewConnection *conn) {
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->count > 0;
+    if (taken && oldest) {
+        *conn = deque->items[deque->head];
+        deque->head = (deque->head + 1) % POOL_DEQUE_SIZE;
+    } else if (taken) {
+        *conn = deque->items[(deque->head + deque->count - 1) % POOL_DEQUE_SIZE];
+    }
+    if (taken) deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+// The urgent heap of a deque, earliest deadline on top. Called with the
+// deque's lock held.
+void push_urgent(WorkerDeque *deque, const NewConnection *conn) {
+    int i = deque->urgent_count++;
+    while (i > 0 && deque->urgent[(i - 1) / 2].deadline_ms > conn->deadline_ms) {
+        deque->urgent[i] = deque->urgent[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    deque->urgent[i] = *conn;
+}
+NewConnection pop_urgent(WorkerDeque *deque) {
+    NewConnection top = deque->urgent[0];
+    NewConnection last = deque->urgent[--deque->urgent_count];
+    int i = 0;
+    for (int child = 1; child < deque->urgent_count; child = 2 * i + 1) {
+        if (child + 1 < deque->urgent_count &&
+            deque->urgent[child + 1].deadline_ms < deque->urgent[child].deadline_ms) {
+            child++;
+        }
+        if (last.deadline_ms <= deque->urgent[child].deadline_ms) break;
+        deque->urgent[i] = deque->urgent[child];
+        i = child;
+    }
+    deque->urgent[i] = last;
+    return top;
+}
+// Takes the connection with the earliest deadline among all deques' heaps,
+// preferring the thread's own on a tie
+bool take_earliest(int self, NewConnection *conn) {
+    int size = __atomic_load_n(&pool_size, __ATOMIC_ACQUIRE);
+    int best = -1;
+    long best_deadline = 0;
+    for (int i = 0; i < size; i++) {
+        WorkerDeque *deque = &pool_deques[(self + i) % size];
+        pthread_mutex_lock(&deque->lock);
+        if (deque->urgent_count > 0 && (best < 0 || deque->urgent[0].deadline_ms < best_deadline)) {
+            best = (self + i) % size;
+            best_deadline = deque->urgent[0].deadline_ms;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    if (best < 0) return false;
+    WorkerDeque *deque = &pool_deques[best];
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->urgent_count > 0;
+    if (taken) *conn = pop_urgent(deque);
+    pthread_mutex_unlock(&deque->lock);
+    if (taken) {
+        __atomic_sub_fetch(&pool_urgent, 1, __ATOMIC_ACQ_REL);
+        if (best != self) __atomic_add_fetch(&pool_steals, 1, __ATOMIC_RELAXED);
+    }
+    return taken;
+}
+// Connections with deadlines go first, earliest first. Otherwise a thread
+// serves its own deque oldest first; thieves take the newest from the
+// other end, so owner and thief rarely meet.
+bool take_connection(int self, NewConnection *conn) {
+    if (__atomic_load_n(&pool_urgent, __ATOMIC_ACQUIRE) > 0 && take_earliest(self, conn)) {
+        return true;
+    }
+    if (take_from_deque(&pool_deques[self], true, conn)) return true;
+    int size = __atomic_load_n(&pool_size, __ATOMIC_ACQUIRE);
+    for (int i = 1; i < size; i++) {
+        if (take_from_deque(&pool_deques[(self + i) % size], false, conn)) {
+            __atomic_add_fetch(&pool_steals, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+bool pool_has_work(void *arg) {
+    return __atomic_load_n(&pool_queued, __ATOMIC_ACQUIRE) > 0;
+}
+void serve_connection(int sock, bool pipelined);
+void *run_pool_worker(void *arg) {
+    int self = (int)(intptr_t)arg;
+    place_thread();
+    pool_thread = true;
+    for (;;) {
+        NewConnection conn;
+        if (take_connection(self, &conn)) {
+            __atomic_sub_fetch(&pool_queued, 1, __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&pool_idle, 1, __ATOMIC_ACQ_REL);
+            serve_connection(conn.sock, conn.pipelined);
+            __atomic_add_fetch(&pool_idle, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        if (spin_until(pool_has_work, NULL)) continue;
+        pthread_mutex_lock(&pool_lock);
+        while (!pool_has_work(NULL)) pthread_cond_wait(&pool_work, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+// Pool threads get a small fixed stack: connection buffers are on the heap
+bool start_pool_worker() {
+    int self = pool_size;
+    pthread_mutex_init(&pool_deques[self].lock, NULL);
+    pthread_t thread;
+    pthread_attr_t attr;
+    init_worker_attr(&attr, false);
+    pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+    __atomic_add_fetch(&pool_idle, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&pool_size, self + 1, __ATOMIC_RELEASE);
+    int created = pthread_create(&thread, &attr, run_pool_worker, (void *)(intptr_t)self);
+    pthread_attr_destroy(&attr);
+    if (created != 0) {
+        perror("Thread creation failed");
+        __atomic_sub_fetch(&pool_idle, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&pool_size, self, __ATOMIC_RELEASE);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+void start_pool() {
+    pool_deques = calloc(pool_max, sizeof(WorkerDeque));
+    int initial = pool_size;
+    pool_size = 0;
+    for (int i = 0; i < initial; i++) {
+        if (!start_pool_worker()) exit(EXIT_FAILURE);
+    }
+    printf("Thread pool of %d threads, up to %d\n", pool_size, pool_max);
+}
+// Queues a connection on the next deque with room, after adding a thread
+// if queued connections already claim every idle one and the cap allows
+void submit_to_pool(int sock, bool pipelined) {
+    if (__atomic_load_n(&pool_idle, __ATOMIC_ACQUIRE) <= __atomic_load_n(&pool_queued, __ATOMIC_ACQUIRE) &&
+        pool_size < pool_max) {
+        start_pool_worker();
+    }
+    NewConnection conn = { .sock = sock, .pipelined = pipelined, .deadline_ms = peek_deadline(sock) };
+    bool queued = false, urgent = false;
+    for (int i = 0; i < pool_size && !queued; i++) {
+        WorkerDeque *deque = &pool_deques[pool_next++ % pool_size];
+        pthread_mutex_lock(&deque->lock);
+        if (conn.deadline_ms > 0 && deque->urgent_count < POOL_DEQUE_SIZE) {
+            push_urgent(deque, &conn);
+            queued = urgent = true;
+        } else if (deque->count < POOL_DEQUE_SIZE) {
+            deque->items[(deque->head + deque->count) % POOL_DEQUE_SIZE] = conn;
+            deque->count++;
+            queued = true;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    if (!queued) {
+        fprintf(stderr, "Thread pool queues full, closing socket %d\n", sock);
+        close(sock);
+        end_connection();
+        return;
+    }
+    if (urgent) __atomic_add_fetch(&pool_urgent, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&pool_queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+}
+void serve_green_connection(void *arg) {
+    NewConnection new_conn = *(NewConnection *)arg;
+    free(arg);
+    serve_connection(new_conn.sock, new_conn.pipelined);
+}
+void *run_green_loop(void *arg) {
+    place_thread();
+    green_loop_run(arg);
+    return NULL;
+}
+// Each loop is a worker thread, pinned like the others with -a. Every
+// connection holds a descriptor, so the descriptor limit is raised as far
+// as allowed.
+void start_green_loops() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    green_loops = calloc(green_loop_count, sizeof(GreenLoop *));
+    for (int i = 0; i < green_loop_count; i++) {
+        green_loops[i] = green_loop_create();
+        pthread_t thread;
+        pthread_attr_t attr;
+        init_worker_attr(&attr, false);
+        int created = pthread_create(&thread, &attr, run_green_loop, green_loops[i]);
+        pthread_attr_destroy(&attr);
+        if (created != 0) {
+            perror("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    printf("Green threads on %d event loops, up to %lu descriptors\n", green_loop_count,
+           (unsigned long)limit.rlim_cur);
+}
+// Gives a connection to an event loop, the pool, an idle thread or a new
+// thread
+void start_connection(int sock, bool pipelined) {
+    if (green_loop_count > 0) {
+        NewConnection *new_conn = malloc(sizeof(NewConnection));
+        new_conn->sock = sock;
+        new_conn->pipelined = pipelined;
+        green_spawn(green_loops[green_next++ % green_loop_count], serve_green_connection, new_conn);
+        return;
+    }
+    if (pool_max > 0) {
+        submit_to_pool(sock, pipelined);
+        return;
+    }
+    if (busy_poll_budget > 0 && hand_to_idle_worker(sock, pipelined)) {
+        printf("Idle thread took socket %d\n", sock);
+        return;
+    }
+    pthread_t client_thread;
+    NewConnection *new_conn = malloc(sizeof(NewConnection));
+    new_conn->sock = sock;
+    new_conn->pipelined = pipelined;
+    pthread_attr_t attr;
+    init_worker_attr(&attr, false);
+    int created = pthread_create(&client_thread, &attr, handle_client, new_conn);
+    pthread_attr_destroy(&attr);
+    if (created != 0) {
+        perror("Thread creation failed");
+        free(new_conn);
+        close(sock);
+        end_connection();
+    } else {
+        pthread_detach(client_thread);
+        printf("Thread created for socket %d\n", sock);
+    }
+}
+// Answers a new connection's first request on the accept thread if it is a
+// lone check that has already arrived. A pipelined connection is left open
+// to linger in the accept loop; a one-shot one is closed. A request without
+// a newline is only taken as one-shot once the client has half-closed;
+// otherwise a thread waits to see whether more follows.
+int serve_inline(int sock) {
+    char request[BUFFER_SIZE], response[BUFFER_SIZE];
+    ssize_t len = recv(sock, request, sizeof(request) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (len <= 0) return INLINE_DECLINED;
+    request[len] = '\0';
+    char *newline = memchr(request, '\n', len);
+    if (newline != NULL && newline != request + len - 1) return INLINE_DECLINED;
+    if (newline == NULL) {
+        struct pollfd fds[1] = { { .fd = sock, .events = POLLRDHUP } };
+        if (poll(fds, 1, 0) <= 0 || !(fds[0].revents & POLLRDHUP)) return INLINE_DECLINED;
+    }
+    if (newline != NULL) *newline = '\0';
+    // Expired requests of any kind are as cheap to answer as a check
+    bool expired;
+    const char *body = strip_deadline(request, &expired);
+    if (!expired && strncmp(body, "C ", 2) != 0) return INLINE_DECLINED;
+    char consumed[BUFFER_SIZE];
+    if (recv(sock, consumed, len, MSG_DONTWAIT) != len) return INLINE_DECLINED;
+    if (expired) {
+        strcpy(response, DEADLINE_EXCEEDED);
+    } else if (!answer_unlocked(body, response)) {
+        pthread_mutex_lock(&lock);
+        process_request(body, response);
+        pthread_mutex_unlock(&lock);
+    }
+    // Pipelined responses carry their terminator; one-shot ones end at close
+    if (newline != NULL && send_all(sock, response, strlen(response) + 1)) {
+        return INLINE_ANSWERED;
+    }
+    if (newline == NULL) send_all(sock, response, strlen(response));
+    close(sock);
+    end_connection();
+    return INLINE_CLOSED;
+}
+// A lingering connection became readable: closed by the client, as after a
+// single call, or sending more, in which case a thread takes it over
+void resume_lingering(int sock, bool timed_out) {
+    char byte;
+    ssize_t len = timed_out ? 0 : recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) len = 1;
+    if (len > 0) {
+        start_connection(sock, true);
+    } else {
+        close(sock);
+        end_connection();
+    }
+}
+void handle_network_mode(int port, bool datagrams, int server_fd, int datagram_fd) {
+    struct sockaddr_in address;
+    int addrlen = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (server_fd < 0) {
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
+        int opt = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("Bind failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+        // Event loops take connections in bursts far larger than threads can
+        int backlog = green_loop_count > 0 ? SOMAXCONN : 128;
+        if (listen(server_fd, backlog) < 0) {
+            perror("Listen failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+        if (datagrams) {
+            // Datagram requests are served on the same port number by one thread
+            if ((datagram_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+                bind(datagram_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+                perror("Datagram socket setup failed");
+                close(server_fd);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (busy_poll_budget > 0 && datagram_fd >= 0) enable_socket_busy_poll(datagram_fd);
+    if (inline_checks || pool_max > 0) {
+        // Connections then reach accept with their first request, if it
+        // comes within a second, so the peek after accept finds it, and
+        // the pool can queue them by deadline
+        int defer_s = 1;
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_s, sizeof(defer_s));
+    }
+    // The listening socket may be shared with a predecessor or successor
+    // for a moment, so accept must never block after poll
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    if (datagram_fd >= 0) {
+        int *udp_ptr = malloc(sizeof(int));
+        *udp_ptr = datagram_fd;
+        pthread_t datagram_thread;
+        pthread_attr_t attr;
+        init_worker_attr(&attr, true);
+        int created = pthread_create(&datagram_thread, &attr, handle_datagrams, (void*)udp_ptr);
+        pthread_attr_destroy(&attr);
+        if (created != 0) {
+            perror("Thread creation failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(datagram_thread);
+    }
+    if (worker_cpu_count > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpus[0], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        place_thread();
+    }
+    int handoff_fd = handoff_path != NULL ? open_handoff_socket(handoff_path) : -1;
+    int handoff_done_fd = handoff_path != NULL ? eventfd(0, EFD_NONBLOCK) : -1;
+    printf("Server started\n");
+    // Connections answered inline follow the listening and handoff sockets
+    struct pollfd fds[2 + MAX_LINGERING] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = handoff_fd, .events = POLLIN },
+    };
+    time_t lingering_since[MAX_LINGERING];
+    int lingering = 0;
+    bool handed_off = false;
+    while (!handed_off) {
+        spin_on_fds(fds, 2 + lingering);
+        if (poll(fds, 2 + lingering, lingering > 0 ? 1000 : -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Poll failed");
+            break;
+        }
+        if (fds[1].revents & POLLIN && fds[1].fd == handoff_fd) {
+            if (start_handoff(handoff_fd, handoff_done_fd, server_fd, datagram_fd)) {
+                fds[1].fd = handoff_done_fd;
+            }
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t result = 0;
+            if (read(handoff_done_fd, &result, sizeof(result)) != sizeof(result)) continue;
+            handed_off = result == 1;
+            finish_handoff(handed_off, server_fd);
+            fds[1].fd = handoff_fd;
+            continue;
+        }
+        time_t now = time(NULL);
+        for (int i = 0; i < lingering; i++) {
+            bool timed_out = now - lingering_since[i] >= LINGER_TIMEOUT_S;
+            if (!fds[2 + i].revents && !timed_out) continue;
+            resume_lingering(fds[2 + i].fd, timed_out);
+            lingering--;
+            fds[2 + i] = fds[2 + lingering];
+            lingering_since[i] = lingering_since[lingering];
+            i--;
+        }
+        if (!(fds[0].revents & POLLIN)) continue;
+        int new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED) continue;
+            break;
+        }
+        printf("Accepted connection: socket %d\n", new_socket);
+        pthread_mutex_lock(&lock);
+        active_connections++;
+        pthread_mutex_unlock(&lock);
+        if (busy_poll_budget > 0) enable_socket_busy_poll(new_socket);
+        if (inline_checks && shard_count == 0) {
+            int served = serve_inline(new_socket);
+            if (served == INLINE_CLOSED) continue;
+            if (served == INLINE_ANSWERED && lingering < MAX_LINGERING) {
+                fds[2 + lingering].fd = new_socket;
+                fds[2 + lingering].events = POLLIN;
+                fds[2 + lingering].revents = 0;
+                lingering_since[lingering++] = now;
+                continue;
+            }
+            if (served == INLINE_ANSWERED) {
+                start_connection(new_socket, true);
+                continue;
+            }
+        }
+        start_connection(new_socket, false);
+    }
+    close(server_fd);
+    // Whatever is still lingering is served out by threads like the rest
+    for (int i = 0; i < lingering; i++) start_connection(fds[2 + i].fd, true);
+    if (!handed_off) return;
+    close(handoff_fd);
+    close(handoff_done_fd);
+    // Let in-flight connections finish, up to a limit, then leave
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_S;
+    pthread_mutex_lock(&lock);
+    while (active_connections > 0) {
+        if (pthread_cond_timedwait(&connections_drained, &lock, &deadline) != 0) break;
+    }
+    printf("Drained with %d connections left, exiting\n", active_connections);
+    pthread_mutex_unlock(&lock);
+    // Checks answered during the drain belong in the successor's query logs
+    char *hits = malloc(MAX_PENDING_HITS);
+    send_hits(hits, true);
+    if (query_log_dir != NULL) flush_query_logs();
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
+// Returns the request past its deadline, if it has one, and sets expired
+// when that deadline has passed. Malformed deadlines are left in place, to
+// be refused as illegal requests.
+const char *strip_deadline(const char *request, bool *expired) {
+    *expired = false;
+    char *end;
+    if (request[0] != '@') return request;
+    long deadline_ms = strtol(request + 1, &end, 10);
+    if (end == request + 1 || *end != ' ') return request;
+    if (!__atomic_load_n(&deadlines_seen, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&deadlines_seen, true, __ATOMIC_RELAXED);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec * 1000L + now.tv_nsec / 1000000 > deadline_ms) {
+        __atomic_add_fetch(&deadline_expired, 1, __ATOMIC_RELAXED);
+        *expired = true;
+    }
+    return end + 1;
+}
+// The deadline of the first request waiting on sock, or 0. A connection is
+// queued once, so later requests on it do not change its place.
+long peek_deadline(int sock) {
+    char head[32];
+    ssize_t len = recv(sock, head, sizeof(head) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (len < 2 || head[0] != '@') return 0;
+    head[len] = '\0';
+    return strtol(head + 1, NULL, 10);
+}
+void process_request(const char *request, char *response) {
+    response[0] = '\0';
+    char trimmed_request[BUFFER_SIZE] = {0};
+    strncpy(trimmed_request, request, BUFFER_SIZE - 1);
+    trim_whitespace(trimmed_request);
+    record_request(trimmed_request);
+    if (strncmp(trimmed_request, "A ", 2) == 0 || strncmp(trimmed_request, "D ", 2) == 0) {
+        wait_for_handoff();
+    }
+    if (leader_pool != NULL && (strncmp(trimmed_request, "A ", 2) == 0 ||
+        strncmp(trimmed_request, "D ", 2) == 0 || strcmp(trimmed_request, "L") == 0)) {
+        forward_to_leader(trimmed_request, response);
+    } else if (shard_count > 0 && route_request(trimmed_request, response)) {
+        // Answered by the shards
+    } else if (strncmp(trimmed_request, "A ", 2) == 0) {
+        char ip_range[IP_RANGE_SIZE] = {0};
+        char port_range[PORT_RANGE_SIZE] = {0};
+        if (sscanf(trimmed_request + 2, "%63s %15s", ip_range, port_range) == 2) {
+            add_rule(ip_range, port_range, response);
+        } else {
+            strncpy(response, "Invalid rule format", BUFFER_SIZE - 1);
+        }
+    } else if (strncmp(trimmed_request, "C ", 2) == 0) {
+        char ip[INET_ADDRSTRLEN] = {0};
+        int port;
+        if (sscanf(trimmed_request + 2, "%15s %d", ip, &port) == 2) {
+            check_connection(ip, port, response);
+        } else {
+            strncpy(response, "Illegal IP address or port specified", BUFFER_SIZE -
+1);
+        }
+    } else if (strncmp(trimmed_request, "D ", 2) == 0) {
+        char ip_range[IP_RANGE_SIZE] = {0};
+        char port_range[PORT_RANGE_SIZE] = {0};
+        if (sscanf(trimmed_request + 2, "%63s %15s", ip_range, port_range) == 2) {
+            delete_rule(ip_range, port_range, response);
+        } else {
+            strncpy(response, "Invalid rule format", BUFFER_SIZE - 1);
+        }
+    } else if (strncmp(trimmed_request, "H ", 2) == 0) {
+        record_hits(trimmed_request + 2, response);
+    } else if (strcmp(trimmed_request, "R") == 0) {
+        list_requests(response);
+    } else if (strcmp(trimmed_request, "L") == 0) {
+        list_rules(response);
+    } else if (strcmp(trimmed_request, "B") == 0) {
+        start_snapshot(response);
+    } else if (strcmp(trimmed_request, "I") == 0) {
+        show_info(response);
+    } else {
+        strncpy(response, "Illegal request", BUFFER_SIZE - 1);
+    }
+    response[BUFFER_SIZE - 1] = '\0';
+}
+bool send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = green_send(sock, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+bool subscribe(ClientConnection *conn) {
+    if (!conn->subscribed) {
+        conn->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (conn->wake_fd < 0) return false;
+        pthread_mutex_init(&conn->push_lock, NULL);
+        conn->push_capacity = conn->sending_capacity = CONN_BUFFER_SIZE;
+        conn->pushes = malloc(conn->push_capacity);
+        conn->sending = malloc(conn->sending_capacity);
+        conn->subscribed = true;
+        conn->next_subscriber = subscribers;
+        subscribers = conn;
+    }
+    return true;
+}
+void append_backlog(ClientConnection *conn, const char *frame) {
+    size_t len = strlen(frame) + 1;
+    conn->backlog = realloc(conn->backlog, conn->backlog_len + len);
+    memcpy(conn->backlog + conn->backlog_len, frame, len);
+    conn->backlog_len += len;
+}
+// Starts streaming mutations after from_version. Changes still in the log
+// are replayed; otherwise the watcher gets a reset frame followed by the
+// current rules as additions.
+void start_watch(ClientConnection *conn, unsigned long from_version, char *response) {
+    if (!subscribe(conn)) {
+        strcpy(response, "Watch failed");
+        return;
+    }
+    char frame[BUFFER_SIZE];
+    unsigned long oldest = rule_version >= MUTATION_LOG_SIZE ?
+        rule_version - MUTATION_LOG_SIZE + 1 : 1;
+    if (oldest <= log_floor) oldest = log_floor + 1;
+    if (from_version <= rule_version && from_version + 1 >= oldest) {
+        for (unsigned long v = from_version + 1; v <= rule_version; v++) {
+            format_mutation(frame, sizeof(frame), &mutation_log[v % MUTATION_LOG_SIZE]);
+            append_backlog(conn, frame);
+        }
+    } else {
+        snprintf(frame, sizeof(frame), "!R %lu %d", rule_version, rule_count);
+        append_backlog(conn, frame);
+        for (int i = 0; i < rule_count; i++) {
+            Mutation m = { rule_version, 'A', rules[i].id, "", "" };
+            strcpy(m.ip_range, rules[i].ip_range);
+            strcpy(m.port_range, rules[i].port_range);
+            format_mutation(frame, sizeof(frame), &m);
+            append_backlog(conn, frame);
+        }
+    }
+    conn->wants_mutations = true;
+    snprintf(response, BUFFER_SIZE, "Watching %lu", rule_version);
+}
+// Requests that act on the connection itself rather than on the rule set.
+// Called with lock held.
+void process_connection_request(ClientConnection *conn, const char *request, char *response) {
+    unsigned long from_version;
+    if (strcmp(request, "S") == 0) {
+        if (!subscribe(conn)) {
+            strcpy(response, "Subscription failed");
+            return;
+        }
+        conn->wants_invalidations = true;
+        snprintf(response, BUFFER_SIZE, "Subscribed %lu", rule_version);
+    } else if (sscanf(request, "W %lu", &from_version) == 1) {
+        start_watch(conn, from_version, response);
+    } else {
+        process_request(request, response);
+    }
+}
+void unsubscribe(ClientConnection *conn) {
+    pthread_mutex_lock(&lock);
+    for (ClientConnection **p = &subscribers; *p != NULL; p = &(*p)->next_subscriber) {
+        if (*p == conn) {
+            *p = conn->next_subscriber;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    close(conn->wake_fd);
+    pthread_mutex_destroy(&conn->push_lock);
+    free(conn->pushes);
+    free(conn->sending);
+}
+// Moves queued pushes to the socket. Only the connection's own handler
+// writes to it, so pushes never split a response. The queue is swapped
+// for the emptied sending buffer, so pushes are not copied and other
+// threads can queue more while these are written.
+bool flush_pushes(ClientConnection *conn) {
+    uint64_t count;
+    if (read(conn->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return false;
+    }
+    pthread_mutex_lock(&conn->push_lock);
+    bool overflow = conn->push_overflow;
+    size_t len = conn->push_len;
+    char *sending = conn->pushes;
+    size_t sending_capacity = conn->push_capacity;
+    conn->pushes = conn->sending;
+    conn->push_capacity = conn->sending_capacity;
+    conn->sending = sending;
+    conn->sending_capacity = sending_capacity;
+    conn->push_len = 0;
+    conn->push_frames = 0;
+    pthread_mutex_unlock(&conn->push_lock);
+    return !overflow && send_all(conn->sock, sending, len);
+}
+// Sends buffered responses, then any watch catch-up. Every flush goes
+// through here, so a watch's catch-up always follows its "Watching" reply
+// and precedes the live pushes after it.
+bool flush_responses(ClientConnection *conn) {
+    if (!send_all(conn->sock, conn->out, conn->out_len)) return false;
+    conn->out_len = 0;
+    if (conn->backlog != NULL) {
+        bool sent = send_all(conn->sock, conn->backlog, conn->backlog_len);
+        free(conn->backlog);
+        conn->backlog = NULL;
+        conn->backlog_len = 0;
+        if (!sent) return false;
+    }
+    return true;
+}
+// Sends buffered responses and catch-up, then queued pushes
+bool flush_output(ClientConnection *conn) {
+    if (!flush_responses(conn)) return false;
+    return !conn->subscribed || flush_pushes(conn);
+}
+// Waits for checks submitted to the shards and appends their answers in
+// request order. Called with lock held; released while waiting.
+bool collect_routed(ClientConnection *conn, FwFuture **routed, int *count) {
+    pthread_mutex_unlock(&lock);
+    bool ok = true;
+    for (int i = 0; i < *count; i++) {
+        // Every future is waited on, even after a failed flush, to release it
+        char *response = conn->out + conn->out_len;
+        if (routed[i] == NULL || fw_future_wait(routed[i], response, BUFFER_SIZE) != FW_OK) {
+            strcpy(response, "Shard unavailable");
+        }
+        conn->out_len += strlen(response) + 1;
+        if (CONN_BUFFER_SIZE - conn->out_len < BUFFER_SIZE) {
+            ok = ok && flush_responses(conn);
+            conn->out_len = 0;
+        }
+    }
+    *count = 0;
+    pthread_mutex_lock(&lock);
+    return ok;
+}
+// Processes every complete line in conn->in under a single lock acquisition,
+// appending NUL-terminated responses to conn->out. Returns false if the
+// output could not be flushed.
+bool process_pipelined(ClientConnection *conn) {
+    size_t start = 0;
+    char *newline;
+    // Router mode: runs of checks are in flight on the shards together
+    FwFuture *routed[ROUTE_BATCH];
+    int routed_count = 0;
+    // Shared-nothing and striped modes: lock is only taken once a request
+    // needs it
+    bool locked = !shared_nothing && lock_stripes == 0;
+    if (locked) pthread_mutex_lock(&lock);
+    while ((newline = memchr(conn->in + start, '\n', conn->in_len - start)) != NULL) {
+        *newline = '\0';
+        bool expired = false;
+        const char *request = conn->in + start;
+        if (!conn->discarding) request = strip_deadline(request, &expired);
+        start = newline + 1 - conn->in;
+        if (expired) {
+            // Answered in request order, so after any checks still on shards
+            if (routed_count > 0 && !collect_routed(conn, routed, &routed_count)) {
+                pthread_mutex_unlock(&lock);
+                return false;
+            }
+            strcpy(conn->out + conn->out_len, DEADLINE_EXCEEDED);
+            conn->out_len += strlen(DEADLINE_EXCEEDED) + 1;
+            if (CONN_BUFFER_SIZE - conn->out_len < BUFFER_SIZE) {
+                if (locked) pthread_mutex_unlock(&lock);
+                if (!flush_responses(conn)) return false;
+                if (locked) pthread_mutex_lock(&lock);
+            }
+            continue;
+        }
+        if (!locked && !conn->discarding && answer_unlocked(request, conn->out + conn->out_len)) {
+            conn->out_len += strlen(conn->out + conn->out_len) + 1;
+            if (CONN_BUFFER_SIZE - conn->out_len < BUFFER_SIZE) {
+                if (!flush_responses(conn)) return false;
+            }
+            continue;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&lock);
+            locked = true;
+        }
+        bool routed_check = !conn->discarding && shard_count > 0 &&
+                            submit_routed_check(request, &routed[routed_count]);
+        if (routed_check && ++routed_count < ROUTE_BATCH) continue;
+        if (routed_count > 0 && !collect_routed(conn, routed, &routed_count)) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        if (routed_check) continue;
+        if (conn->discarding) {
+            // Tail of an oversized line: answer it once as a whole
+            conn->discarding = false;
+            strcpy(conn->out + conn->out_len, "Illegal request");
+        } else {
+            process_connection_request(conn, request, conn->out + conn->out_len);
+        }
+        conn->out_len += strlen(conn->out + conn->out_len) + 1;
+        if (CONN_BUFFER_SIZE - conn->out_len < BUFFER_SIZE) {
+            // Output buffer full: flush early rather than grow it
+            pthread_mutex_unlock(&lock);
+            if (!flush_responses(conn)) return false;
+            pthread_mutex_lock(&lock);
+        }
+    }
+    bool collected = routed_count == 0 || collect_routed(conn, routed, &routed_count);
+    if (locked) pthread_mutex_unlock(&lock);
+    if (!collected) return false;
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+    if (conn->in_len == CONN_BUFFER_SIZE) {
+        conn->discarding = true;
+        conn->in_len = 0;
+    }
+    return true;
+}
+// Whether a first read without a newline is a whole one-shot request: the
+// client has half-closed, or sent nothing more within ONE_SHOT_GRACE_MS.
+// The rest of a request split across reads is added to conn->in.
+bool one_shot_request(ClientConnection *conn) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        if (memchr(conn->in, '\n', conn->in_len) != NULL || conn->in_len == CONN_BUFFER_SIZE) {
+            return false;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = ONE_SHOT_GRACE_MS - elapsed_ns(&start, &now) / 1000000;
+        if (remaining_ms <= 0) return true;
+        struct pollfd fds[1] = { { .fd = conn->sock, .events = POLLIN } };
+        int ready = green_poll(fds, 1, (int)remaining_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return true;
+        ssize_t len = green_recv(conn->sock, conn->in + conn->in_len,
+                                 CONN_BUFFER_SIZE - conn->in_len, MSG_DONTWAIT, 0);
+        if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        // Closed by the client, or failed: nothing more is coming
+        if (len <= 0) return true;
+        conn->in_len += len;
+    }
+}
+bool hand_off_subscriber(ClientConnection *conn);
+// Serves conn until it closes. A connection that subscribes on a pool
+// thread is handed to a thread of its own instead, as it may stay for good
+// and would keep the pool thread from new connections.
+void run_connection(ClientConnection *conn, bool first) {
+    char response[BUFFER_SIZE];
+    for (;;) {
+        if (conn->subscribed && conn->out_len == 0) {
+            // Subscribers idle indefinitely, waking for input or pushes
+            struct pollfd fds[2] = {
+                { .fd = conn->sock, .events = POLLIN },
+                { .fd = conn->wake_fd, .events = POLLIN },
+            };
+            spin_on_fds(fds, 2);
+            if (green_poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if ((fds[1].revents & POLLIN) && !flush_pushes(conn)) break;
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        }
+        // Block only when there is nothing to flush; otherwise drain what the
+        // kernel already has and send the accumulated responses in one go
+        int flags = conn->out_len > 0 ? MSG_DONTWAIT : 0;
+        if (flags == 0 && !conn->subscribed) {
+            struct pollfd fds[1] = { { .fd = conn->sock, .events = POLLIN } };
+            spin_on_fds(fds, 1);
+        }
+        ssize_t recv_len = green_recv(conn->sock, conn->in + conn->in_len,
+                                      CONN_BUFFER_SIZE - conn->in_len, flags,
+                                      CONN_IDLE_TIMEOUT * 1000);
+        if (recv_len < 0 && errno == EINTR) continue;
+        if (recv_len < 0 && flags && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!flush_output(conn)) break;
+            continue;
+        }
+        if (recv_len <= 0) {
+            send_all(conn->sock, conn->out, conn->out_len);
+            break;
+        }
+        conn->in_len += recv_len;
+        if (first && memchr(conn->in, '\n', conn->in_len) == NULL && one_shot_request(conn)) {
+            // One-shot request without a terminator: answer with the bare
+            // response and close, as before
+            conn->in[conn->in_len < BUFFER_SIZE ? conn->in_len : BUFFER_SIZE - 1] = '\0';
+            bool expired;
+            const char *request = strip_deadline(conn->in, &expired);
+            if (expired) {
+                strcpy(response, DEADLINE_EXCEEDED);
+            } else if (!answer_unlocked(request, response)) {
+                pthread_mutex_lock(&lock);
+                process_request(request, response);
+                pthread_mutex_unlock(&lock);
+            }
+            send_all(conn->sock, response, strlen(response));
+            printf("Thread for socket %d completed request\n", conn->sock);
+            break;
+        }
+        first = false;
+        if (!process_pipelined(conn)) break;
+        if (conn->subscribed && pool_thread && hand_off_subscriber(conn)) return;
+    }
+    if (conn->subscribed) unsubscribe(conn);
+    free(conn->backlog);
+    close(conn->sock);
+    printf("Thread for socket %d closed socket and exiting\n", conn->sock);
+    free_connection(conn);
+    end_connection();
+}
+void serve_connection(int sock, bool pipelined) {
+    struct timeval timeout;
+    timeout.tv_sec = CONN_IDLE_TIMEOUT;
+    timeout.tv_usec = 0;
+    ClientConnection *conn = allocate_connection();
+    conn->sock = sock;
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    run_connection(conn, !pipelined);
+}
+void *run_subscriber(void *arg) {
+    place_thread();
+    run_connection(arg, false);
+    return NULL;
+}
+// False if no thread could be started, leaving conn with the caller
+bool hand_off_subscriber(ClientConnection *conn) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    init_worker_attr(&attr, false);
+    int created = pthread_create(&thread, &attr, run_subscriber, conn);
+    pthread_attr_destroy(&attr);
+    if (created != 0) {
+        perror("Thread creation failed");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+void *handle_client(void *arg) {
+    NewConnection new_conn = *(NewConnection *)arg;
+    free(arg);
+    place_thread();
+    do {
+        serve_connection(new_conn.sock, new_conn.pipelined);
+    } while (busy_poll_budget > 0 && (new_conn = wait_for_connection()).sock >= 0);
+    return NULL;
+}
+void *handle_datagrams(void *socket_desc) {
+    place_thread();
+    int sock = *(int*)socket_desc;
+    free(socket_desc);
+    static char buffers[DATAGRAM_BATCH][BUFFER_SIZE];
+    static char responses[DATAGRAM_BATCH][BUFFER_SIZE];
+    struct sockaddr_in peers[DATAGRAM_BATCH];
+    struct iovec in_iov[DATAGRAM_BATCH], out_iov[DATAGRAM_BATCH];
+    struct mmsghdr in_msgs[DATAGRAM_BATCH], out_msgs[DATAGRAM_BATCH];
+    for (;;) {
+        memset(in_msgs, 0, sizeof(in_msgs));
+        for (int i = 0; i < DATAGRAM_BATCH; i++) {
+            in_iov[i].iov_base = buffers[i];
+            in_iov[i].iov_len = BUFFER_SIZE - 1;
+            in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+            in_msgs[i].msg_hdr.msg_iovlen = 1;
+            in_msgs[i].msg_hdr.msg_name = &peers[i];
+            in_msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        }
+        // Wait for one datagram, then take whatever else is already queued
+        struct pollfd fds[1] = { { .fd = sock, .events = POLLIN } };
+        spin_on_fds(fds, 1);
+        int count = recvmmsg(sock, in_msgs, DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("Datagram receive failed");
+            break;
+        }
+        memset(out_msgs, 0, sizeof(out_msgs));
+        bool locked = false;
+        for (int i = 0; i < count; i++) {
+            buffers[i][in_msgs[i].msg_len] = '\0';
+            buffers[i][strcspn(buffers[i], "\n")] = '\0';
+            bool expired;
+            const char *request = strip_deadline(buffers[i], &expired);
+            // Shared-nothing and striped checks are answered without lock
+            // until a request needs it
+            if (expired) {
+                strcpy(responses[i], DEADLINE_EXCEEDED);
+            } else if (locked || !answer_unlocked(request, responses[i])) {
+                if (!locked) pthread_mutex_lock(&lock);
+                locked = true;
+                process_request(request, responses[i]);
+            }
+            out_iov[i].iov_base = responses[i];
+            out_iov[i].iov_len = strlen(responses[i]);
+            out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+            out_msgs[i].msg_hdr.msg_iovlen = 1;
+            out_msgs[i].msg_hdr.msg_name = &peers[i];
+            out_msgs[i].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+        }
+        if (locked) pthread_mutex_unlock(&lock);
+        for (int sent = 0; sent < count; ) {
+            int n = sendmmsg(sock, out_msgs + sent, count - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("Datagram send failed");
+                break;
+            }
+            sent += n;
+        }
+    }
+    close(sock);
+    return NULL;
+}
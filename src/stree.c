@@ -0,0 +1,90 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "stree.h"
+#include "region.h"
+
+// Keys compare as signed integers in SIMD registers, so they are stored
+// with the sign bit flipped
+#define STREE_FLIP 0x80000000U
+
+bool stree_avx2 = false;
+
+size_t stree_child(size_t k, int i) {
+    return k * (STREE_KEYS + 1) + i + 1;
+}
+// Fills the nodes under k in order, so an in-order walk reads the keys
+// sorted and then the padding
+void stree_fill(StaticTree *tree, const uint32_t *keys, size_t k, size_t *next) {
+    if (k >= tree->node_count) return;
+    for (int i = 0; i < STREE_KEYS; i++) {
+        stree_fill(tree, keys, stree_child(k, i), next);
+        size_t slot = k * STREE_KEYS + i;
+        if (*next < tree->count) {
+            tree->nodes[slot] = (int32_t)(keys[*next] ^ STREE_FLIP);
+            tree->ranks[slot] = *next;
+            (*next)++;
+        } else {
+            tree->nodes[slot] = INT32_MAX;
+            tree->ranks[slot] = tree->count;
+        }
+    }
+    stree_fill(tree, keys, stree_child(k, STREE_KEYS), next);
+}
+StaticTree *stree_build(const uint32_t *keys, size_t count, int node) {
+    stree_avx2 = __builtin_cpu_supports("avx2");
+    StaticTree *tree = calloc(1, sizeof(StaticTree));
+    tree->count = count;
+    tree->node_count = count / STREE_KEYS + 1;
+    size_t nodes_size = tree->node_count * STREE_KEYS * sizeof(int32_t);
+    size_t ranks_size = tree->node_count * STREE_KEYS * sizeof(uint32_t);
+    tree->nodes = region_alloc(&nodes_size, node);
+    tree->ranks = region_alloc(&ranks_size, node);
+    tree->size = nodes_size + ranks_size;
+    size_t next = 0;
+    stree_fill(tree, keys, 0, &next);
+    return tree;
+}
+void stree_free(StaticTree *tree) {
+    if (tree == NULL) return;
+    region_free(tree->nodes);
+    region_free(tree->ranks);
+    free(tree);
+}
+// Each level finds the first key in the node greater than key. That key is
+// the answer unless a later level finds a smaller one under it.
+__attribute__((target("avx2")))
+size_t stree_rank_avx2(const StaticTree *tree, uint32_t key) {
+    __m256i x = _mm256_set1_epi32((int32_t)(key ^ STREE_FLIP));
+    size_t found = SIZE_MAX;
+    for (size_t k = 0; k < tree->node_count; ) {
+        const __m256i *keys = (const __m256i *)(tree->nodes + k * STREE_KEYS);
+        __m256i low = _mm256_cmpgt_epi32(_mm256_load_si256(keys), x);
+        __m256i high = _mm256_cmpgt_epi32(_mm256_load_si256(keys + 1), x);
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(low)) |
+                        _mm256_movemask_ps(_mm256_castsi256_ps(high)) << 8;
+        int i = __builtin_ctz(mask | 1U << STREE_KEYS);
+        if (i < STREE_KEYS) found = k * STREE_KEYS + i;
+        k = stree_child(k, i);
+    }
+    return found == SIZE_MAX ? tree->count : tree->ranks[found];
+}
+size_t stree_rank_scalar(const StaticTree *tree, uint32_t key) {
+    int32_t x = (int32_t)(key ^ STREE_FLIP);
+    size_t found = SIZE_MAX;
+    for (size_t k = 0; k < tree->node_count; ) {
+        const int32_t *keys = tree->nodes + k * STREE_KEYS;
+        // Branch-free count of the keys not greater than x
+        int i = 0;
+        for (int j = 0; j < STREE_KEYS; j++) i += keys[j] <= x;
+        if (i < STREE_KEYS) found = k * STREE_KEYS + i;
+        k = stree_child(k, i);
+    }
+    return found == SIZE_MAX ? tree->count : tree->ranks[found];
+}
+size_t stree_rank(const StaticTree *tree, uint32_t key) {
+    if (stree_avx2) return stree_rank_avx2(tree, key);
+    return stree_rank_scalar(tree, key);
+}
@@ -0,0 +1,29 @@
+#ifndef STREE_H
+#define STREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Static B-tree (S-tree) over a sorted array of keys, laid out implicitly:
+// node k holds STREE_KEYS keys in one cache line and its children are
+// nodes k * (STREE_KEYS + 1) + 1 + i. A search reads one node per level,
+// log16(n) cache lines against log2(n) for a binary search, and compares
+// the key with a whole node at once, with AVX2 where the CPU has it.
+
+#define STREE_KEYS 16
+
+typedef struct {
+    int32_t *nodes;   // keys with the sign bit flipped, padded with INT32_MAX
+    uint32_t *ranks;  // position in the sorted array of each node slot
+    size_t node_count;
+    size_t count;
+    size_t size;      // bytes mapped for nodes and ranks
+} StaticTree;
+
+// Lays out count sorted keys on node (-1 for no placement)
+StaticTree *stree_build(const uint32_t *keys, size_t count, int node);
+void stree_free(StaticTree *tree);
+// Number of keys less than or equal to key
+size_t stree_rank(const StaticTree *tree, uint32_t key);
+
+#endif
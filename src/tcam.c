@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "tcam.h"
+#include "intervals.h"
+#include "region.h"
+
+#define TCAM_MAX_PREFIXES 64
+
+bool tcam_avx2 = false;
+
+typedef struct {
+    uint32_t value;
+    uint32_t mask;
+} TernaryPrefix;
+
+// Splits low to high, bits wide, into the fewest prefixes: each is the
+// largest aligned block starting at low that stays within high
+int tcam_prefixes(uint64_t low, uint64_t high, int bits, TernaryPrefix *prefixes) {
+    uint64_t full = (1ULL << bits) - 1;
+    int count = 0;
+    while (low <= high) {
+        int size = 0;
+        while (size < bits && (low & (1ULL << size)) == 0 &&
+               low + (2ULL << size) - 1 <= high) {
+            size++;
+        }
+        prefixes[count++] = (TernaryPrefix){ low, full & ~((1ULL << size) - 1) };
+        low += 1ULL << size;
+    }
+    return count;
+}
+void *tcam_alloc(TernaryTable *table, size_t size, int node) {
+    void *data = region_alloc(&size, node);
+    table->size += size;
+    return data;
+}
+void tcam_free(TernaryTable *table) {
+    if (table == NULL) return;
+    region_free(table->ip_values);
+    region_free(table->ip_masks);
+    region_free(table->port_values);
+    region_free(table->port_masks);
+    region_free(table->rules);
+    free(table);
+}
+TernaryTable *tcam_build(const ClassifierRule *rules, int count, int node) {
+    tcam_avx2 = __builtin_cpu_supports("avx2");
+    // Counted first, so an oversized rule set is declined before mapping
+    size_t total = 0;
+    TernaryPrefix ips[TCAM_MAX_PREFIXES], ports[TCAM_MAX_PREFIXES];
+    for (int r = 0; r < count; r++) {
+        if (!intervals_usable(&rules[r])) continue;
+        total += (size_t)tcam_prefixes(rules[r].ip_start, rules[r].ip_end, 32, ips) *
+                 tcam_prefixes(rules[r].port_start, rules[r].port_end, 16, ports);
+        if (total > TCAM_MAX_ENTRIES) return NULL;
+    }
+    TernaryTable *table = calloc(1, sizeof(TernaryTable));
+    table->block_count = total / TCAM_BLOCK + 1;
+    size_t slots = table->block_count * TCAM_BLOCK;
+    table->ip_values = tcam_alloc(table, slots * sizeof(uint32_t), node);
+    table->ip_masks = tcam_alloc(table, slots * sizeof(uint32_t), node);
+    table->port_values = tcam_alloc(table, slots * sizeof(uint32_t), node);
+    table->port_masks = tcam_alloc(table, slots * sizeof(uint32_t), node);
+    table->rules = tcam_alloc(table, slots * sizeof(int32_t), node);
+    for (int r = 0; r < count; r++) {
+        if (!intervals_usable(&rules[r])) continue;
+        int ip_count = tcam_prefixes(rules[r].ip_start, rules[r].ip_end, 32, ips);
+        int port_count = tcam_prefixes(rules[r].port_start, rules[r].port_end, 16, ports);
+        for (int i = 0; i < ip_count; i++) {
+            for (int p = 0; p < port_count; p++) {
+                size_t e = table->count++;
+                table->ip_values[e] = ips[i].value;
+                table->ip_masks[e] = ips[i].mask;
+                table->port_values[e] = ports[p].value;
+                table->port_masks[e] = ports[p].mask;
+                table->rules[e] = r;
+            }
+        }
+    }
+    // Padding never matches: no key masked to nothing equals 1
+    for (size_t e = table->count; e < slots; e++) {
+        table->ip_values[e] = 1;
+        table->rules[e] = -1;
+    }
+    return table;
+}
+// Each block's entries are compared at once: an entry hits when neither
+// masked field differs from its value
+__attribute__((target("avx2")))
+int tcam_match_avx2(const TernaryTable *table, uint32_t ip, int port) {
+    __m256i ips = _mm256_set1_epi32((int32_t)ip);
+    __m256i ports = _mm256_set1_epi32(port);
+    __m256i zero = _mm256_setzero_si256();
+    for (size_t b = 0; b < table->block_count; b++) {
+        size_t e = b * TCAM_BLOCK;
+        __m256i ip_diff = _mm256_xor_si256(
+            _mm256_and_si256(ips, _mm256_load_si256((const __m256i *)(table->ip_masks + e))),
+            _mm256_load_si256((const __m256i *)(table->ip_values + e)));
+        __m256i port_diff = _mm256_xor_si256(
+            _mm256_and_si256(ports, _mm256_load_si256((const __m256i *)(table->port_masks + e))),
+            _mm256_load_si256((const __m256i *)(table->port_values + e)));
+        __m256i hits = _mm256_cmpeq_epi32(_mm256_or_si256(ip_diff, port_diff), zero);
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(hits));
+        if (mask != 0) return table->rules[e + __builtin_ctz(mask)];
+    }
+    return -1;
+}
+int tcam_match_scalar(const TernaryTable *table, uint32_t ip, int port) {
+    for (size_t b = 0; b < table->block_count; b++) {
+        size_t e = b * TCAM_BLOCK;
+        // Branch-free within the block, like the AVX2 compare
+        unsigned mask = 0;
+        for (int i = 0; i < TCAM_BLOCK; i++) {
+            uint32_t diff = ((ip & table->ip_masks[e + i]) ^ table->ip_values[e + i]) |
+                            ((port & table->port_masks[e + i]) ^ table->port_values[e + i]);
+            mask |= (unsigned)(diff == 0) << i;
+        }
+        if (mask != 0) return table->rules[e + __builtin_ctz(mask)];
+    }
+    return -1;
+}
+int tcam_match(const TernaryTable *table, uint32_t ip, int port) {
+    if (tcam_avx2) return tcam_match_avx2(table, ip, port);
+    return tcam_match_scalar(table, ip, port);
+}
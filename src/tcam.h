@@ -0,0 +1,41 @@
+#ifndef TCAM_H
+#define TCAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "classifier.h"
+
+// Software model of a ternary CAM, as in the hardware firewall tables. A
+// TCAM entry matches a key when the key's bits agree with the entry's value
+// wherever its mask is set. Ranges are not ternary, so each rule's address
+// and port ranges are split into prefixes and the rule takes one entry per
+// pair: up to 62 x 30 entries for the worst ranges, one for a prefix and a
+// single port. Entries keep rule order, and the first hit wins, as the
+// hardware's priority encoder does.
+//
+// Values and masks are stored as separate arrays, padded to whole blocks
+// of TCAM_BLOCK entries, so AVX2 compares a block in a few instructions;
+// without AVX2 a block is compared in a plain loop. A rule set past
+// TCAM_MAX_ENTRIES entries is declined.
+
+#define TCAM_BLOCK 8
+#define TCAM_MAX_ENTRIES (1024 * 1024)
+
+typedef struct {
+    uint32_t *ip_values;
+    uint32_t *ip_masks;
+    uint32_t *port_values;  // widened to 32 bits to share the address's lanes
+    uint32_t *port_masks;
+    int32_t *rules;         // rule index of each entry
+    size_t count;           // entries, before padding
+    size_t block_count;
+    size_t size;            // bytes mapped for the arrays
+} TernaryTable;
+
+// Expands rules into entries on node; NULL past TCAM_MAX_ENTRIES
+TernaryTable *tcam_build(const ClassifierRule *rules, int count, int node);
+void tcam_free(TernaryTable *table);
+// Index of the first rule matching ip and port, or -1
+int tcam_match(const TernaryTable *table, uint32_t ip, int port);
+
+#endif
@@ -0,0 +1,111 @@
+#!/bin/bash
+
+# =============================================================================
+# SERVER MODES TEST SCRIPT
+# Runs the pipeline checks against each locking, threading and classifier mode
+# =============================================================================
+
+echo "Multithreaded Firewall - Server Modes Test"
+echo "=========================================="
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+BASE_PORT=2320
+PIPELINE_COUNT=2000
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+
+MODES=("-a 0" "-p 2:4" "-P -a 0" "-k 16" "-G 2" "-e linear" "-e rfc" "-e stree"
+       "-e learned" "-e rangetree" "-e native" "-e tcam")
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# The checks of test_pipeline.sh, plus deadlines, against one server
+run_checks() {
+    local port=$1
+    actual=$("$CLIENT" localhost $port A 10.0.0.1-10.0.0.9 80)
+    check_result "One-shot add" "Rule added" "$actual"
+
+    actual=$(printf 'C 10.0.0.5 80\nC 10.0.0.50 80\nA 10.0.1.1 22\nC 10.0.1.1 22\nD 10.0.1.1 22\nC 10.0.1.1 22\nbogus\n' \
+        | "$CLIENT" localhost $port -)
+    expected=$(printf 'Connection accepted\nConnection rejected\nRule added\nConnection accepted\nRule deleted\nConnection rejected\nIllegal request')
+    check_result "Mixed pipeline" "$expected" "$actual"
+
+    # A wider rule overlapping the first, so checks match one, both or neither
+    "$CLIENT" localhost $port A 10.0.0.0-10.0.0.255 80-90 > /dev/null
+    for i in $(seq 1 $PIPELINE_COUNT); do
+        echo "C 10.0.0.$((i % 20)) $((80 + i % 20))"
+    done > modes_commands.tmp
+    "$CLIENT" localhost $port - < modes_commands.tmp > modes_results.tmp
+    accepted=$(grep -c "Connection accepted" modes_results.tmp)
+    rejected=$(grep -c "Connection rejected" modes_results.tmp)
+    check_result "Accepted count" "$((PIPELINE_COUNT / 20 * 11))" "$accepted"
+    check_result "Rejected count" "$((PIPELINE_COUNT / 20 * 9))" "$rejected"
+
+    now_ms=$(date +%s%3N)
+    actual=$(printf '@1 C 10.0.0.5 80\n@%s C 10.0.0.5 80\n' $((now_ms + 60000)) \
+        | "$CLIENT" localhost $port -)
+    expected=$(printf 'Deadline exceeded\nConnection accepted')
+    check_result "Deadlines" "$expected" "$actual"
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+port=$BASE_PORT
+for mode in "${MODES[@]}"; do
+    echo -e "\n${YELLOW}Mode: $mode${NC}"
+    "$PROJECT_ROOT/server" $mode $port > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    if ! kill -0 $SERVER_PID 2>/dev/null; then
+        echo -e "${RED}Server failed to start${NC}"
+        cat server_output.log
+        FAILURES=$((FAILURES + 1))
+    else
+        run_checks $port
+        kill $SERVER_PID 2>/dev/null
+        wait $SERVER_PID 2>/dev/null
+    fi
+    port=$((port + 1))
+done
+
+# Every engine against a scan, on rules that overlap
+echo -e "\n${YELLOW}Engines against a scan${NC}"
+"$PROJECT_ROOT/bench" -r 300 -l 5000 > modes_bench.tmp 2>&1
+check_result "Bench exit status" "0" "$?"
+check_result "Answers match a scan" "" "$(grep differ modes_bench.tmp)"
+
+rm -f modes_*.tmp server_output.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Server modes test completed${NC}"
+else
+    echo -e "\n${RED}Server modes test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
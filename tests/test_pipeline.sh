@@ -0,0 +1,120 @@
+#!/bin/bash
+
+# =============================================================================
+# PIPELINE TEST SCRIPT
+# Tests persistent pipelined connections through the client's stdin mode
+# =============================================================================
+
+echo "Multithreaded Firewall - Pipeline Test"
+echo "======================================"
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+TEST_PORT=2304
+PIPELINE_COUNT=5000
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+"$PROJECT_ROOT/server" $TEST_PORT > server_output.log 2>&1 &
+SERVER_PID=$!
+sleep 1
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    echo -e "${RED}Server failed to start${NC}"
+    cat server_output.log
+    exit 1
+fi
+
+# Test 1: one-shot requests keep working
+echo -e "\n${YELLOW}Test 1: One-shot requests${NC}"
+actual=$("$PROJECT_ROOT/client" localhost $TEST_PORT A 10.0.0.1-10.0.0.9 80)
+check_result "One-shot add" "Rule added" "$actual"
+
+# A request without a newline is answered bare once nothing more follows,
+# and the connection closed
+exec 3<>/dev/tcp/127.0.0.1/$TEST_PORT
+printf 'C 10.0.0.5 80' >&3
+check_result "Bare one-shot" "Connection accepted" "$(timeout 2 cat <&3)"
+exec 3<&-
+
+# A first request split across writes is still served as pipelined
+exec 3<>/dev/tcp/127.0.0.1/$TEST_PORT
+printf 'C 10.0.0' >&3
+sleep 0.005
+printf '.5 80\n' >&3
+check_result "Split first request" "Connection accepted" "$(timeout 2 head -c 20 <&3 | tr -d '\0')"
+exec 3<&-
+
+# Test 2: responses come back in request order on one connection
+echo -e "\n${YELLOW}Test 2: Ordered pipelined responses${NC}"
+actual=$(printf 'C 10.0.0.5 80\nC 10.0.0.50 80\nA 10.0.1.1 22\nC 10.0.1.1 22\nD 10.0.1.1 22\nC 10.0.1.1 22\nbogus\n' \
+    | "$PROJECT_ROOT/client" localhost $TEST_PORT -)
+expected=$(printf 'Connection accepted\nConnection rejected\nRule added\nConnection accepted\nRule deleted\nConnection rejected\nIllegal request')
+check_result "Mixed pipeline" "$expected" "$actual"
+
+# Test 3: a long pipeline is answered completely
+echo -e "\n${YELLOW}Test 3: $PIPELINE_COUNT pipelined checks${NC}"
+start_time=$(date +%s.%N)
+for i in $(seq 1 $PIPELINE_COUNT); do
+    echo "C 10.0.0.$((i % 20)) 80"
+done > pipeline_commands.tmp
+"$PROJECT_ROOT/client" localhost $TEST_PORT - < pipeline_commands.tmp > pipeline_results.tmp
+end_time=$(date +%s.%N)
+accepted=$(grep -c "Connection accepted" pipeline_results.tmp)
+rejected=$(grep -c "Connection rejected" pipeline_results.tmp)
+check_result "Accepted count" "$((PIPELINE_COUNT / 20 * 9))" "$accepted"
+check_result "Rejected count" "$((PIPELINE_COUNT / 20 * 11))" "$rejected"
+pipeline_time=$(awk "BEGIN { printf \"%.3f\", $end_time - $start_time }")
+echo "Pipeline of $PIPELINE_COUNT requests over one connection: ${pipeline_time}s"
+
+# Test 4: watchers replay the change log and then follow live changes
+echo -e "\n${YELLOW}Test 4: Rule-change watch stream${NC}"
+"$PROJECT_ROOT/client" localhost $TEST_PORT W 0 > pipeline_watch.tmp 2>&1 &
+WATCH_PID=$!
+sleep 0.5
+"$PROJECT_ROOT/client" localhost $TEST_PORT A 10.0.2.0-10.0.2.255 443 > /dev/null
+"$PROJECT_ROOT/client" localhost $TEST_PORT D 10.0.2.0-10.0.2.255 443 > /dev/null
+sleep 0.5
+kill $WATCH_PID 2>/dev/null
+wait $WATCH_PID 2>/dev/null
+expected=$(printf '1 A 1 10.0.0.1-10.0.0.9 80\n2 A 2 10.0.1.1 22\n3 D 2 10.0.1.1 22\n4 A 3 10.0.2.0-10.0.2.255 443\n5 D 3 10.0.2.0-10.0.2.255 443')
+check_result "Watch from version 0" "$expected" "$(cat pipeline_watch.tmp)"
+
+kill $SERVER_PID 2>/dev/null
+wait $SERVER_PID 2>/dev/null
+rm -f pipeline_*.tmp server_output.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Pipeline test completed${NC}"
+else
+    echo -e "\n${RED}Pipeline test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
@@ -0,0 +1,118 @@
+#!/bin/bash
+
+# =============================================================================
+# QUERY LOG TEST SCRIPT
+# Tests the on-disk query log across restarts and reloads, read with qlog
+# =============================================================================
+
+echo "Multithreaded Firewall - Query Log Test"
+echo "======================================="
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+TEST_PORT=2342
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+WORK_DIR="$(mktemp -d)"
+LOG_DIR="$WORK_DIR/queries"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+start_server() {
+    "$PROJECT_ROOT/server" -q "$LOG_DIR" "$@" $TEST_PORT > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    if ! kill -0 $SERVER_PID 2>/dev/null; then
+        echo -e "${RED}Server failed to start${NC}"
+        cat server_output.log
+        rm -rf "$WORK_DIR"
+        exit 1
+    fi
+}
+
+stop_server() {
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+}
+
+# Number of logged queries, for all rules or just the one given
+count_queries() {
+    "$PROJECT_ROOT/qlog" "$LOG_DIR" "$@" | grep -c '^  '
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+# Test 1: accepted checks are flushed to the log; rejected ones are not
+echo -e "\n${YELLOW}Test 1: Accepted queries logged${NC}"
+start_server
+"$CLIENT" localhost $TEST_PORT A 10.0.0.1-10.0.0.9 80 > /dev/null
+printf 'C 10.0.0.5 80\nC 10.0.0.6 80\nC 10.0.0.50 80\n' | "$CLIENT" localhost $TEST_PORT - > /dev/null
+sleep 0.5
+check_result "Records flushed" "2 records" \
+    "$("$CLIENT" localhost $TEST_PORT I | grep '^Query log:' | grep -o '[0-9]* records')"
+stop_server
+check_result "Rule defined" "Rule 1: 10.0.0.1-10.0.0.9 80" "$("$PROJECT_ROOT/qlog" "$LOG_DIR" | head -1)"
+check_result "Queries read back" "2" "$(count_queries)"
+
+# Test 2: a restart starts a new segment; rule ids are reused, but each
+# rule's history stays its own
+echo -e "\n${YELLOW}Test 2: Across restarts${NC}"
+start_server
+"$CLIENT" localhost $TEST_PORT A 10.0.5.0-10.0.5.9 22 > /dev/null
+"$CLIENT" localhost $TEST_PORT C 10.0.5.1 22 > /dev/null
+sleep 0.5
+stop_server
+check_result "Segments" "2" "$(ls "$LOG_DIR" | grep -c '^queries-')"
+expected=$(printf 'Rule 1: 10.0.0.1-10.0.0.9 80\nRule 1: 10.0.5.0-10.0.5.9 22')
+check_result "Both histories" "$expected" "$("$PROJECT_ROOT/qlog" "$LOG_DIR" | grep '^Rule ')"
+check_result "All queries" "3" "$(count_queries)"
+
+# Test 3: rules kept across a rules file reload keep one history
+echo -e "\n${YELLOW}Test 3: Across reloads${NC}"
+rm -rf "$LOG_DIR"
+printf '10.0.0.1-10.0.0.9 80\n' > "$WORK_DIR/rules.txt"
+start_server -c "$WORK_DIR/rules.txt"
+"$CLIENT" localhost $TEST_PORT C 10.0.0.5 80 > /dev/null
+printf '10.0.0.1-10.0.0.9 80\n10.0.5.0-10.0.5.9 22\n' > "$WORK_DIR/rules.txt"
+sleep 1
+printf 'C 10.0.0.5 80\nC 10.0.5.1 22\n' | "$CLIENT" localhost $TEST_PORT - > /dev/null
+sleep 0.5
+stop_server
+check_result "Kept rule's history" "2" "$(count_queries 1)"
+check_result "New rule's history" "1" "$(count_queries 2)"
+
+rm -rf "$WORK_DIR"
+rm -f server_output.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Query log test completed${NC}"
+else
+    echo -e "\n${RED}Query log test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
@@ -0,0 +1,108 @@
+#!/bin/bash
+
+# =============================================================================
+# RELOAD TEST SCRIPT
+# Tests loading the rule set from a file and reloading it when it changes
+# =============================================================================
+
+echo "Multithreaded Firewall - Reload Test"
+echo "===================================="
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+TEST_PORT=2340
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+WORK_DIR="$(mktemp -d)"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+check_batch() {
+    printf 'C 10.0.0.5 80\nC 10.0.5.3 8085\nC 10.1.0.3 22\n' | "$CLIENT" localhost $TEST_PORT -
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+printf '# initial rules\n10.0.0.1-10.0.0.9 80\n' > "$WORK_DIR/rules.txt"
+# Line buffered, so that each reload shows in the log as it happens
+stdbuf -oL "$PROJECT_ROOT/server" -c "$WORK_DIR/rules.txt" $TEST_PORT > server_output.log 2>&1 &
+SERVER_PID=$!
+sleep 1
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    echo -e "${RED}Server failed to start${NC}"
+    cat server_output.log
+    rm -rf "$WORK_DIR"
+    exit 1
+fi
+
+# Test 1: the rules file is loaded at start
+echo -e "\n${YELLOW}Test 1: Rules from file${NC}"
+expected=$(printf 'Connection accepted\nConnection rejected\nConnection rejected')
+check_result "Initial rules" "$expected" "$(check_batch)"
+
+# Test 2: rewriting the file replaces the rule set, including rules added
+# with A since
+echo -e "\n${YELLOW}Test 2: Reload on change${NC}"
+"$CLIENT" localhost $TEST_PORT A 10.1.0.0-10.1.0.255 22 > /dev/null
+printf '10.0.0.1-10.0.0.9 80\n\n10.0.5.0-10.0.5.9 8080-8090\n' > "$WORK_DIR/rules.txt"
+sleep 1
+expected=$(printf 'Connection accepted\nConnection accepted\nConnection rejected')
+check_result "Reload on rewrite" "$expected" "$(check_batch)"
+
+# A file with an invalid line is rejected and the current rules kept
+printf '10.0.0.1-10.0.0.9 80\nnot a rule\n' > "$WORK_DIR/rules.txt"
+sleep 1
+check_result "Invalid file ignored" "$expected" "$(check_batch)"
+
+printf '10.1.0.0-10.1.0.255 22\n' > "$WORK_DIR/rules.tmp"
+mv "$WORK_DIR/rules.tmp" "$WORK_DIR/rules.txt"
+sleep 1
+expected=$(printf 'Connection rejected\nConnection rejected\nConnection accepted')
+check_result "Reload on replace" "$expected" "$(check_batch)"
+
+# Test 3: SIGHUP reloads the file as it stands
+echo -e "\n${YELLOW}Test 3: Reload on SIGHUP${NC}"
+loads=$(grep -c "^Loaded" server_output.log)
+kill -HUP $SERVER_PID
+sleep 1
+check_result "Reloaded" "$((loads + 1))" "$(grep -c "^Loaded" server_output.log)"
+check_result "Nothing changed" "(0 added, 0 deleted)" "$(grep "^Loaded" server_output.log | tail -1 | grep -o '(.*)')"
+check_result "Rules kept" "$expected" "$(check_batch)"
+
+kill $SERVER_PID 2>/dev/null
+wait $SERVER_PID 2>/dev/null
+rm -rf "$WORK_DIR"
+rm -f server_output.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Reload test completed${NC}"
+else
+    echo -e "\n${RED}Reload test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
@@ -0,0 +1,112 @@
+#!/bin/bash
+
+# =============================================================================
+# REPLICATION TEST SCRIPT
+# Tests follower servers fed by the leader's mutation stream
+# =============================================================================
+
+echo "Multithreaded Firewall - Replication Test"
+echo "========================================="
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+LEADER_PORT=2305
+FOLLOWER_PORTS=(2306 2307)
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+HANDOFF_PATH="/tmp/fw_handoff_$LEADER_PORT.sock"
+"$PROJECT_ROOT/server" -H $HANDOFF_PATH $LEADER_PORT > leader_output.log 2>&1 &
+SERVER_PIDS=($!)
+sleep 0.5
+"$CLIENT" localhost $LEADER_PORT A 10.0.0.0-10.0.0.255 80 > /dev/null
+
+# Followers started after the leader has state must catch up before serving
+for port in "${FOLLOWER_PORTS[@]}"; do
+    "$PROJECT_ROOT/server" -f localhost:$LEADER_PORT $port > follower_$port.log 2>&1 &
+    SERVER_PIDS+=($!)
+done
+sleep 1
+
+# Test 1: followers answer checks from the replicated rule set
+echo -e "\n${YELLOW}Test 1: Catch-up on start${NC}"
+for port in "${FOLLOWER_PORTS[@]}"; do
+    check_result "Follower $port check" "Connection accepted" "$("$CLIENT" localhost $port C 10.0.0.7 80)"
+done
+
+# Test 2: writes through a follower reach the leader and every follower
+echo -e "\n${YELLOW}Test 2: Forwarded writes${NC}"
+check_result "Add via follower" "Rule added" "$("$CLIENT" localhost ${FOLLOWER_PORTS[0]} A 10.0.1.0-10.0.1.255 443)"
+check_result "Read own write" "Connection accepted" "$("$CLIENT" localhost ${FOLLOWER_PORTS[0]} C 10.0.1.1 443)"
+sleep 0.5
+check_result "Leader sees write" "Connection accepted" "$("$CLIENT" localhost $LEADER_PORT C 10.0.1.2 443)"
+check_result "Other follower sees write" "Connection accepted" "$("$CLIENT" localhost ${FOLLOWER_PORTS[1]} C 10.0.1.3 443)"
+check_result "Delete via follower" "Rule deleted" "$("$CLIENT" localhost ${FOLLOWER_PORTS[1]} D 10.0.1.0-10.0.1.255 443)"
+sleep 0.5
+check_result "Delete replicated" "Connection rejected" "$("$CLIENT" localhost ${FOLLOWER_PORTS[0]} C 10.0.1.1 443)"
+
+# Test 3: checks answered by followers end up in the leader's query log
+echo -e "\n${YELLOW}Test 3: Query log aggregation${NC}"
+for port in "${FOLLOWER_PORTS[@]}"; do
+    for i in $(seq 1 10); do echo "C 10.0.0.$i 80"; done | "$CLIENT" localhost $port - > /dev/null
+done
+sleep 0.5
+queries=$("$CLIENT" localhost $LEADER_PORT L | grep -c "Query: 10.0.0.")
+check_result "Leader query count" "22" "$queries"
+
+# Test 4: a new leader process takes over the listening socket and state;
+# followers resume their streams against it without a gap
+echo -e "\n${YELLOW}Test 4: Zero-downtime restart${NC}"
+"$PROJECT_ROOT/server" -T $HANDOFF_PATH -H $HANDOFF_PATH $LEADER_PORT > leader_new.log 2>&1 &
+SERVER_PIDS+=($!)
+sleep 1
+queries=$("$CLIENT" localhost $LEADER_PORT L | grep -c "Query: 10.0.0.")
+check_result "Query logs handed over" "22" "$queries"
+check_result "Add after restart" "Rule added" "$("$CLIENT" localhost $LEADER_PORT A 10.0.2.0-10.0.2.255 22)"
+sleep 1
+for port in "${FOLLOWER_PORTS[@]}"; do
+    check_result "Follower $port resumed" "Connection accepted" "$("$CLIENT" localhost $port C 10.0.2.9 22)"
+done
+
+for pid in "${SERVER_PIDS[@]}"; do
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+done
+rm -f leader_output.log leader_new.log follower_*.log $HANDOFF_PATH
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Replication test completed${NC}"
+else
+    echo -e "\n${RED}Replication test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
@@ -0,0 +1,102 @@
+#!/bin/bash
+
+# =============================================================================
+# ROUTER TEST SCRIPT
+# Tests a router partitioning the IPv4 space across shard servers
+# =============================================================================
+
+echo "Multithreaded Firewall - Router Test"
+echo "===================================="
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+ROUTER_PORT=2310
+SHARD_PORTS=(2311 2312 2313)
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+SERVER_PIDS=()
+SHARDS=""
+for port in "${SHARD_PORTS[@]}"; do
+    "$PROJECT_ROOT/server" $port > shard_$port.log 2>&1 &
+    SERVER_PIDS+=($!)
+    SHARDS="$SHARDS${SHARDS:+,}localhost:$port"
+done
+sleep 0.5
+"$PROJECT_ROOT/server" -r $SHARDS $ROUTER_PORT > router_output.log 2>&1 &
+SERVER_PIDS+=($!)
+sleep 0.5
+
+# Test 1: a rule spanning every shard is cut at the shard boundaries
+echo -e "\n${YELLOW}Test 1: Rule splitting${NC}"
+check_result "Add spanning rule" "Rule added" "$("$CLIENT" localhost $ROUTER_PORT A 10.0.0.0-200.0.0.0 80)"
+check_result "Add overlapping rule" "Rule added" "$("$CLIENT" localhost $ROUTER_PORT A 10.0.0.0-50.0.0.0 80)"
+check_result "Duplicate rule" "Rule already exists" "$("$CLIENT" localhost $ROUTER_PORT A 10.0.0.0-50.0.0.0 80)"
+check_result "First shard piece" "Rule: 10.0.0.0-85.85.85.85 80" "$("$CLIENT" localhost ${SHARD_PORTS[0]} L | head -1)"
+check_result "Last shard piece" "Rule: 170.170.170.171-200.0.0.0 80" "$("$CLIENT" localhost ${SHARD_PORTS[2]} L | head -1)"
+
+# Test 2: pipelined checks are answered by the owning shards, in order
+echo -e "\n${YELLOW}Test 2: Routed checks${NC}"
+expected=$'Connection accepted\nConnection accepted\nConnection accepted\nConnection rejected\nIllegal IP address or port specified'
+actual=$(printf 'C 20.0.0.1 80\nC 100.0.0.1 80\nC 190.0.0.1 80\nC 210.0.0.1 80\nC 300.0.0.1 80\n' | "$CLIENT" localhost $ROUTER_PORT -)
+check_result "Pipelined checks" "$expected" "$actual"
+
+# Test 3: listings merge each rule's queries from every shard
+echo -e "\n${YELLOW}Test 3: Merged listing${NC}"
+expected=$'Rule: 10.0.0.0-200.0.0.0 80\nQuery: 20.0.0.1 80\nQuery: 100.0.0.1 80\nQuery: 190.0.0.1 80\nRule: 10.0.0.0-50.0.0.0 80'
+check_result "Merged listing" "$expected" "$("$CLIENT" localhost $ROUTER_PORT L)"
+check_result "Delete spanning rule" "Rule deleted" "$("$CLIENT" localhost $ROUTER_PORT D 10.0.0.0-200.0.0.0 80)"
+check_result "Remaining rule" "Connection accepted" "$("$CLIENT" localhost $ROUTER_PORT C 20.0.0.1 80)"
+check_result "Removed piece" "Connection rejected" "$("$CLIENT" localhost $ROUTER_PORT C 100.0.0.1 80)"
+
+# Test 4: a failed update is undone on the shards it changed, and only those
+echo -e "\n${YELLOW}Test 4: Rollback${NC}"
+"$CLIENT" localhost ${SHARD_PORTS[0]} A 20.0.0.0-85.85.85.85 90 > /dev/null
+kill ${SERVER_PIDS[2]} 2>/dev/null
+wait ${SERVER_PIDS[2]} 2>/dev/null
+check_result "Shard down" "Shard unavailable" "$("$CLIENT" localhost $ROUTER_PORT A 20.0.0.0-200.0.0.0 90)"
+check_result "Changed piece undone" "Connection rejected" "$("$CLIENT" localhost ${SHARD_PORTS[1]} C 100.0.0.1 90)"
+check_result "Existing piece kept" "Connection accepted" "$("$CLIENT" localhost ${SHARD_PORTS[0]} C 20.0.0.1 90)"
+
+for pid in "${SERVER_PIDS[@]}"; do
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+done
+rm -f router_output.log shard_*.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Router test completed${NC}"
+else
+    echo -e "\n${RED}Router test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi
@@ -0,0 +1,106 @@
+#!/bin/bash
+
+# =============================================================================
+# SNAPSHOT TEST SCRIPT
+# Tests background snapshots with B, the I command and restoring with -s
+# =============================================================================
+
+echo "Multithreaded Firewall - Snapshot Test"
+echo "======================================"
+
+# Terminal colour formatting
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+TEST_PORT=2341
+FAILURES=0
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+CLIENT="$PROJECT_ROOT/client"
+WORK_DIR="$(mktemp -d)"
+
+# Compare actual output against expected output for one test case
+check_result() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [ "$expected" == "$actual" ]; then
+        echo -e "${GREEN}✓ $name${NC}"
+    else
+        echo -e "${RED}✗ $name${NC}"
+        echo "  expected: $(echo "$expected" | head -5 | tr '\n' '|')"
+        echo "  actual:   $(echo "$actual" | head -5 | tr '\n' '|')"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+start_server() {
+    "$PROJECT_ROOT/server" -s "$1" $TEST_PORT > server_output.log 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+    if ! kill -0 $SERVER_PID 2>/dev/null; then
+        echo -e "${RED}Server failed to start${NC}"
+        cat server_output.log
+        rm -rf "$WORK_DIR"
+        exit 1
+    fi
+}
+
+stop_server() {
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+}
+
+echo -e "${BLUE}Building project${NC}"
+(cd "$PROJECT_ROOT" && make) > /dev/null
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+# Test 1: B saves the state in the background and I reports it
+echo -e "\n${YELLOW}Test 1: Background snapshot${NC}"
+start_server "$WORK_DIR/state.snap"
+"$CLIENT" localhost $TEST_PORT A 10.0.0.1-10.0.0.9 80 > /dev/null
+"$CLIENT" localhost $TEST_PORT A 10.0.5.0-10.0.5.9 8080-8090 > /dev/null
+"$CLIENT" localhost $TEST_PORT D 10.0.0.1-10.0.0.9 80 > /dev/null
+printf 'C 10.0.5.3 8085\nC 10.0.5.4 8090\n' | "$CLIENT" localhost $TEST_PORT - > /dev/null
+check_result "Snapshot started" "Snapshot started at version 3" "$("$CLIENT" localhost $TEST_PORT B)"
+sleep 1
+info=$("$CLIENT" localhost $TEST_PORT I)
+check_result "Snapshot idle" "Snapshot: idle" "$(echo "$info" | grep '^Snapshot:')"
+check_result "Snapshot counted" "Snapshots: 1 completed, 0 failed" "$(echo "$info" | grep '^Snapshots:')"
+stop_server
+
+# Test 2: a restart with -s restores rules, version and query history
+echo -e "\n${YELLOW}Test 2: Restore on start${NC}"
+start_server "$WORK_DIR/state.snap"
+actual=$(printf 'C 10.0.0.5 80\nC 10.0.5.3 8085\n' | "$CLIENT" localhost $TEST_PORT -)
+expected=$(printf 'Connection rejected\nConnection accepted')
+check_result "Rules restored" "$expected" "$actual"
+check_result "Version restored" "Version: 3" "$("$CLIENT" localhost $TEST_PORT I | grep '^Version:')"
+check_result "Queries restored" "3" "$("$CLIENT" localhost $TEST_PORT L | grep -c 'Query: 10.0.5.')"
+stop_server
+
+# Test 3: a snapshot that cannot be written is counted as failed
+echo -e "\n${YELLOW}Test 3: Failed snapshot${NC}"
+start_server "$WORK_DIR/missing/state.snap"
+"$CLIENT" localhost $TEST_PORT B > /dev/null
+sleep 1
+check_result "Failure counted" "Snapshots: 0 completed, 1 failed" \
+    "$("$CLIENT" localhost $TEST_PORT I | grep '^Snapshots:')"
+stop_server
+
+rm -rf "$WORK_DIR"
+rm -f server_output.log
+
+if [ $FAILURES -eq 0 ]; then
+    echo -e "\n${GREEN}Snapshot test completed${NC}"
+else
+    echo -e "\n${RED}Snapshot test failed: $FAILURES check(s)${NC}"
+    exit 1
+fi